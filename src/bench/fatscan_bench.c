@@ -0,0 +1,101 @@
+#include "../fs/fat.h"
+
+//microbenchmark of the FAT scan kernels: every kernel at every level the CPU supports, on a FAT
+//whose blocks are partly in use, checking that all levels agree
+//usage: fatscan-bench [entries] [rounds]
+
+//seconds since an arbitrary point
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//results of one level, compared across levels
+typedef struct {
+    uint32_t free_count;
+    uint32_t used;
+    uint32_t orphans;
+    double seconds[4];          //fill, count, mark_used, find_orphan
+} BenchResult;
+
+static const char* kernel_names[] = {"fill", "count", "mark_used", "find_orphan"};
+
+//run every kernel rounds times at the current level
+static void run_level(uint32_t* fat, uint32_t* scratch, const uint32_t* owner, uint8_t* map, uint32_t n, int rounds, BenchResult* r) {
+    memset(r, 0, sizeof(BenchResult));
+    double t = now();
+    for (int i = 0; i < rounds; i++) fat_fill(scratch, n, FAT_FREE);
+    r->seconds[0] = now() - t;
+    t = now();
+    for (int i = 0; i < rounds; i++) r->free_count = fat_count(fat, n, FAT_FREE);
+    r->seconds[1] = now() - t;
+    t = now();
+    for (int i = 0; i < rounds; i++) r->used = fat_mark_used(fat, n, map);
+    r->seconds[2] = now() - t;
+    t = now();
+    for (int i = 0; i < rounds; i++) {
+        //walk every orphan the way fsck does
+        r->orphans = 0;
+        for (uint32_t b = fat_find_orphan(fat, owner, n); b < n; b += 1 + fat_find_orphan(fat + b + 1, owner + b + 1, n - b - 1)) r->orphans++;
+    }
+    r->seconds[3] = now() - t;
+}
+
+int main(int argc, char** argv) {
+    //16M entries: the FAT of a 64 GB disk
+    uint32_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 16u << 20;
+    int rounds = argc > 2 ? atoi(argv[2]) : 20;
+    if (n == 0 || rounds <= 0) {
+        fprintf(stderr, "Usage: %s [entries] [rounds]\n", argv[0]);
+        return 1;
+    }
+    uint32_t* fat = malloc((size_t)n * sizeof(uint32_t));
+    uint32_t* scratch = malloc((size_t)n * sizeof(uint32_t));
+    uint32_t* owner = calloc(n, sizeof(uint32_t));
+    uint8_t* map = malloc(((size_t)n + 7) / 8);
+    uint8_t* scalar_map = malloc(((size_t)n + 7) / 8);
+    if (fat == NULL || scratch == NULL || owner == NULL || map == NULL || scalar_map == NULL) handle_error("Failed to allocate the FAT");
+    //chains of 1 to 64 blocks with free gaps in between, about two thirds in use, a few orphans
+    srand(42);
+    for (uint32_t b = 0; b < n;) {
+        uint32_t len = 1 + rand() % 64;
+        bool used = rand() % 3 != 0;
+        for (uint32_t i = 0; i < len && b < n; i++, b++) {
+            fat[b] = !used ? FAT_FREE : (i + 1 < len && b + 1 < n ? b + 1 : FAT_EOC);
+            owner[b] = used && rand() % 100000 != 0 ? 1 : 0;
+        }
+    }
+    printf("%u entries (%s of FAT), %d rounds\n", n, format_size((size_t)n * sizeof(uint32_t)), rounds);
+    BenchResult results[FAT_SCAN_AVX2 + 1];
+    FatScanLevel best = fat_scan_level();
+    for (int level = FAT_SCAN_SCALAR; level <= FAT_SCAN_AVX2; level++) {
+        if (fat_scan_set_level(level) != 0) {
+            printf("%-7s not supported\n", fat_scan_level_name(level));
+            continue;
+        }
+        run_level(fat, scratch, owner, map, n, rounds, &results[level]);
+        const BenchResult* r = &results[level];
+        const BenchResult* base = &results[FAT_SCAN_SCALAR];
+        if (level == FAT_SCAN_SCALAR) memcpy(scalar_map, map, ((size_t)n + 7) / 8);
+        if (r->free_count != base->free_count || r->used != base->used || r->orphans != base->orphans ||
+            memcmp(map, scalar_map, ((size_t)n + 7) / 8) != 0) {
+            printf("%-7s disagrees with scalar\n", fat_scan_level_name(level));
+            return 1;
+        }
+        printf("%-7s", fat_scan_level_name(level));
+        for (int k = 0; k < 4; k++) {
+            double gbs = (double)n * sizeof(uint32_t) * rounds / r->seconds[k] / 1e9;
+            printf("  %s %6.2f GB/s (x%.1f)", kernel_names[k], gbs, base->seconds[k] / r->seconds[k]);
+        }
+        printf("\n");
+    }
+    fat_scan_set_level(best);
+    printf("default level: %s, %u free, %u used, %u orphans\n", fat_scan_level_name(best), results[best].free_count, results[best].used, results[best].orphans);
+    free(fat);
+    free(scratch);
+    free(owner);
+    free(map);
+    free(scalar_map);
+    return 0;
+}
@@ -0,0 +1,108 @@
+#include "../fs/fs.h"
+
+//sequential throughput of the block backends: writes a file through fs_pwrite, remounts with the image dropped
+//from the page cache and reads it back through fs_pread, checking the contents
+//usage: io-bench [size] [extra mount options], e.g. io-bench 1G qd=64
+
+#define BENCH_IMAGE "io-bench.img"
+#define BENCH_CHUNK (1u << 20)
+
+static const char* backend_names[] = {"mmap", "pread", "direct", "uring", "pool"};
+
+//seconds since an arbitrary point
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//fill a chunk with a pattern that depends on its offset
+static void fill_chunk(uint8_t* buf, uint64_t offset) {
+    for (size_t i = 0; i < BENCH_CHUNK; i += sizeof(uint64_t)) {
+        uint64_t v = (offset + i) * 0x9E3779B97F4A7C15ull;
+        memcpy(buf + i, &v, sizeof(v));
+    }
+}
+
+//evict the image from the page cache so reads come from the device
+static void drop_cache(void) {
+    int fd = open(BENCH_IMAGE, O_RDONLY);
+    if (fd < 0) return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+//write and read back size bytes with one backend, returns 0 if the data came back intact
+static int run_backend(int io, uint64_t size, const char* extra, double* write_s, double* read_s) {
+    MountOptions opts;
+    default_mount_options(&opts);
+    if (extra != NULL && parse_mount_options(extra, &opts) != 0) return -1;
+    opts.io = io;
+    uint8_t* buf = aligned_alloc(DIRECT_IO_ALIGN, BENCH_CHUNK);
+    uint8_t* expect = malloc(BENCH_CHUNK);
+    if (buf == NULL || expect == NULL) handle_error("Failed to allocate the buffers");
+    Volume vol;
+    unlink(BENCH_IMAGE);
+    int ret = fs_format(&vol, BENCH_IMAGE, size + size / 8 + (64u << 20), &opts);
+    if (ret != FS_OK) {
+        printf("%-6s format failed: %s\n", backend_names[io], fs_strerror(ret));
+        free(buf);
+        free(expect);
+        return -1;
+    }
+    if (vol.disk.queue != NULL && io == DISK_IO_URING && vol.disk.queue->engine != IOQ_ENGINE_URING) {
+        printf("%-6s io_uring unavailable, running on the %s\n", backend_names[io], ioq_engine_name(vol.disk.queue));
+    }
+    uint32_t ino;
+    fs_create(&vol, ROOT_INO, "data", &ino);
+    int fd = fs_open_ino(&vol, ino);
+    double t = now();
+    for (uint64_t off = 0; off < size && ret == FS_OK; off += BENCH_CHUNK) {
+        fill_chunk(buf, off);
+        if (fs_pwrite(&vol, fd, buf, BENCH_CHUNK, off) != BENCH_CHUNK) ret = -1;
+    }
+    fs_close(&vol, fd);
+    if (fs_unmount(&vol) != FS_OK) ret = -1;
+    drop_cache();
+    *write_s = now() - t;
+    if (ret == FS_OK && fs_mount(&vol, BENCH_IMAGE, &opts) != FS_OK) ret = -1;
+    if (ret == FS_OK) {
+        fd = fs_open(&vol, ROOT_INO, "data");
+        t = now();
+        for (uint64_t off = 0; off < size && ret == FS_OK; off += BENCH_CHUNK) {
+            if (fs_pread(&vol, fd, buf, BENCH_CHUNK, off) != BENCH_CHUNK) ret = -1;
+            fill_chunk(expect, off);
+            if (ret == FS_OK && memcmp(buf, expect, BENCH_CHUNK) != 0) ret = -1;
+        }
+        *read_s = now() - t;
+        fs_close(&vol, fd);
+        fs_unmount(&vol);
+    }
+    unlink(BENCH_IMAGE);
+    free(buf);
+    free(expect);
+    return ret;
+}
+
+int main(int argc, char** argv) {
+    uint64_t size = argc > 1 ? parse_size(argv[1], 1 << 20) : 256u << 20;
+    const char* extra = argc > 2 ? argv[2] : NULL;
+    size &= ~(uint64_t)(BENCH_CHUNK - 1);
+    if (size == 0) {
+        fprintf(stderr, "Usage: %s [size] [extra mount options]\n", argv[0]);
+        return 1;
+    }
+    printf("%s sequential in 1 MB chunks\n", format_size(size));
+    int failed = 0;
+    for (int io = DISK_IO_MMAP; io <= DISK_IO_POOL; io++) {
+        double write_s = 0, read_s = 0;
+        if (run_backend(io, size, extra, &write_s, &read_s) != 0) {
+            printf("%-6s failed or read back wrong data\n", backend_names[io]);
+            failed = 1;
+            continue;
+        }
+        printf("%-6s write %8.1f MB/s  read %8.1f MB/s\n", backend_names[io], size / write_s / 1e6, size / read_s / 1e6);
+    }
+    return failed;
+}
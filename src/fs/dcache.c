@@ -0,0 +1,160 @@
+#include "dcache.h"
+#include "fat.h"
+
+//FNV-1a over the name, mixed with parent inode and type
+static uint32_t dentry_hash(uint32_t parent_ino, const char* name, uint8_t type) {
+    uint32_t h = 2166136261u ^ (parent_ino * 2654435761u) ^ type;
+    for (const char* c = name; *c != '\0'; c++) {
+        h ^= (uint8_t)*c;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+//double the bucket array and rehash every node
+static void dcache_grow(DentryCache* dc) {
+    uint32_t new_count = dc->num_buckets * 2;
+    DentryNode** new_buckets = calloc(new_count, sizeof(DentryNode*));
+    if (new_buckets == NULL) return; //keep the old table, chains just get longer
+    for (uint32_t i = 0; i < dc->num_buckets; i++) {
+        DentryNode* node = dc->buckets[i];
+        while (node != NULL) {
+            DentryNode* next = node->next;
+            uint32_t b = dentry_hash(node->parent_ino, node->name, node->type) & (new_count - 1);
+            node->next = new_buckets[b];
+            new_buckets[b] = node;
+            node = next;
+        }
+    }
+    free(dc->buckets);
+    dc->buckets = new_buckets;
+    dc->num_buckets = new_count;
+}
+
+//allocate an empty cache, with locking if it is shared by threads
+int dcache_init(DentryCache* dc, bool threaded) {
+    memset(dc, 0, sizeof(DentryCache));
+    dc->num_buckets = DCACHE_INITIAL_BUCKETS;
+    dc->buckets = calloc(dc->num_buckets, sizeof(DentryNode*));
+    if (dc->buckets == NULL) return -1;
+    dc->threaded = threaded;
+    pthread_rwlock_init(&dc->lock, NULL);
+    return 0;
+}
+
+//take the cache lock in threaded mode
+static void dcache_lock(DentryCache* dc, bool write) {
+    if (!dc->threaded) return;
+    if (write) pthread_rwlock_wrlock(&dc->lock);
+    else pthread_rwlock_rdlock(&dc->lock);
+}
+
+//release the cache lock
+static void dcache_unlock(DentryCache* dc) {
+    if (dc->threaded) pthread_rwlock_unlock(&dc->lock);
+}
+
+//release every node and the tables
+void dcache_destroy(DentryCache* dc) {
+    if (dc->buckets != NULL) {
+        for (uint32_t i = 0; i < dc->num_buckets; i++) {
+            DentryNode* node = dc->buckets[i];
+            while (node != NULL) {
+                DentryNode* next = node->next;
+                free(node);
+                node = next;
+            }
+        }
+        pthread_rwlock_destroy(&dc->lock);
+    }
+    free(dc->buckets);
+    memset(dc, 0, sizeof(DentryCache));
+}
+
+//find the link pointing to a node, so it can be read or unlinked
+static DentryNode** dcache_find(const DentryCache* dc, uint32_t parent_ino, const char* name, uint8_t type) {
+    uint32_t b = dentry_hash(parent_ino, name, type) & (dc->num_buckets - 1);
+    DentryNode** link = &dc->buckets[b];
+    while (*link != NULL) {
+        DentryNode* node = *link;
+        if (node->parent_ino == parent_ino && node->type == type && strncmp(node->name, name, MAX_NAME_LEN) == 0)
+            return link;
+        link = &node->next;
+    }
+    return link;
+}
+
+//look up a child, FAT_EOF if not cached
+uint32_t dcache_lookup(DentryCache* dc, uint32_t parent_ino, const char* name, uint8_t type) {
+    dcache_lock(dc, false);
+    uint32_t ino = FAT_EOF;
+    if (dc->buckets != NULL) {
+        DentryNode** link = dcache_find(dc, parent_ino, name, type);
+        if (*link != NULL) ino = (*link)->child_ino;
+    }
+    dcache_unlock(dc);
+    return ino;
+}
+
+//add or update a child
+int dcache_insert(DentryCache* dc, uint32_t parent_ino, const char* name, uint8_t type, uint32_t child_ino) {
+    dcache_lock(dc, true);
+    if (dc->buckets == NULL) {
+        dcache_unlock(dc);
+        return -1;
+    }
+    DentryNode** link = dcache_find(dc, parent_ino, name, type);
+    if (*link != NULL) {
+        (*link)->child_ino = child_ino;
+        dcache_unlock(dc);
+        return 0;
+    }
+    DentryNode* node = malloc(sizeof(DentryNode));
+    if (node == NULL) {
+        dcache_unlock(dc);
+        return -1;
+    }
+    node->parent_ino = parent_ino;
+    node->type = type;
+    strncpy(node->name, name, MAX_NAME_LEN);
+    node->name[MAX_NAME_LEN - 1] = '\0';
+    node->child_ino = child_ino;
+    node->next = NULL;
+    *link = node;
+    dc->count++;
+    if (dc->count > dc->num_buckets * 2) dcache_grow(dc);
+    dcache_unlock(dc);
+    return 0;
+}
+
+//drop a child
+void dcache_remove(DentryCache* dc, uint32_t parent_ino, const char* name, uint8_t type) {
+    dcache_lock(dc, true);
+    DentryNode** link = dc->buckets != NULL ? dcache_find(dc, parent_ino, name, type) : NULL;
+    if (link != NULL && *link != NULL) {
+        DentryNode* node = *link;
+        *link = node->next;
+        free(node);
+        dc->count--;
+    }
+    dcache_unlock(dc);
+}
+
+//drop every cached child of a directory
+void dcache_invalidate_dir(DentryCache* dc, uint32_t parent_ino) {
+    dcache_lock(dc, true);
+    for (uint32_t i = 0; dc->buckets != NULL && i < dc->num_buckets; i++) {
+        DentryNode** link = &dc->buckets[i];
+        while (*link != NULL) {
+            DentryNode* node = *link;
+            if (node->parent_ino == parent_ino) {
+                *link = node->next;
+                free(node);
+                dc->count--;
+            } else {
+                link = &node->next;
+            }
+        }
+    }
+    dcache_unlock(dc);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "disk.h"
+#include "../utils/utils.h"
+
+#define DCACHE_INITIAL_BUCKETS 256
+
+//cached name -> inode mapping for one child of a directory
+typedef struct DentryNode {
+    uint32_t parent_ino;        //inode of the directory containing the child
+    uint8_t type;               //ENTRY_TYPE_FILE or ENTRY_TYPE_DIR
+    char name[MAX_NAME_LEN];    //child name
+    uint32_t child_ino;         //inode of the child entry
+    struct DentryNode* next;    //next node in the same bucket
+} DentryNode;
+
+//hash table of dentries keyed by (parent inode, type, name)
+typedef struct {
+    DentryNode** buckets;
+    uint32_t num_buckets;
+    uint32_t count;
+    bool threaded;              //lookups take the lock shared, updates exclusive
+    pthread_rwlock_t lock;
+} DentryCache;
+
+//allocate an empty cache, with locking if it is shared by threads
+int dcache_init(DentryCache* dc, bool threaded);
+
+//release every node and the tables
+void dcache_destroy(DentryCache* dc);
+
+//look up a child, FAT_EOF if not cached
+uint32_t dcache_lookup(DentryCache* dc, uint32_t parent_ino, const char* name, uint8_t type);
+
+//add or update a child
+int dcache_insert(DentryCache* dc, uint32_t parent_ino, const char* name, uint8_t type, uint32_t child_ino);
+
+//drop a child
+void dcache_remove(DentryCache* dc, uint32_t parent_ino, const char* name, uint8_t type);
+
+//drop every cached child of a directory
+void dcache_invalidate_dir(DentryCache* dc, uint32_t parent_ino);
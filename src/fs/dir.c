@@ -0,0 +1,255 @@
+#include "dir.h"
+
+//FNV-1a over the name
+uint32_t dirent_hash(const char* name) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < MAX_NAME_LEN && name[i] != '\0'; i++) {
+        h ^= (uint8_t)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+//bucket of a hash: level bits, or level + 1 bits for buckets that were already split
+static uint32_t bucket_of(const DirIndex* idx, uint32_t hash) {
+    uint32_t b = hash & ((1u << idx->level) - 1);
+    if (b < idx->split) b = hash & ((1u << (idx->level + 1)) - 1);
+    return b;
+}
+
+//block of the directory index, FAT_EOC while the directory never had children
+uint32_t get_dir_index_block(const Volume* vol, uint32_t dir_ino) {
+    const Entry* dir = get_entry(vol, dir_ino);
+    if (dir == NULL) return FAT_EOC;
+    return dir->start_block;
+}
+
+//borrow the index of a directory, NULL if it has none
+static const DirIndex* get_dir_index(const Volume* vol, uint32_t dir_ino) {
+    uint32_t index_block = get_dir_index_block(vol, dir_ino);
+    if (index_block == FAT_EOC) return NULL;
+    return get_block(&vol->disk, index_block);
+}
+
+//writable view of the index of a directory, NULL if it has none
+static DirIndex* get_dir_index_mut(Volume* vol, uint32_t dir_ino) {
+    uint32_t index_block = get_dir_index_block(vol, dir_ino);
+    if (index_block == FAT_EOC) return NULL;
+    return get_block_mut(&vol->disk, index_block);
+}
+
+//scan the n dirents of a bucket for a child, returns the slot or -1
+static inline int scan_bucket(const Dirent* bucket, uint32_t n, const char* name, uint8_t type) {
+    for (uint32_t i = 0; i < n; i++) {
+        const Dirent* d = &bucket[i];
+        if (d->ino != 0 && d->type == type && strncmp(d->name, name, MAX_NAME_LEN) == 0) return i;
+    }
+    return -1;
+}
+
+//first free slot among the n dirents of a bucket, NULL if full
+static inline Dirent* scan_free_slot(Dirent* bucket, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        if (bucket[i].ino == 0) return &bucket[i];
+    }
+    return NULL;
+}
+
+//scan one bucket for a child, returns the slot or -1; the common block sizes get a copy of the
+//loop with a constant bound, the others share the generic one
+static int bucket_find(const Disk* disk, const Dirent* bucket, const char* name, uint8_t type) {
+    switch (disk->block_size) {
+        case 1024: return scan_bucket(bucket, 1024 / sizeof(Dirent), name, type);
+        case 4096: return scan_bucket(bucket, 4096 / sizeof(Dirent), name, type);
+        case 65536: return scan_bucket(bucket, 65536 / sizeof(Dirent), name, type);
+        default: return scan_bucket(bucket, DIRENTS_PER_BLOCK(disk), name, type);
+    }
+}
+
+//first free slot of a bucket, NULL if full; specialized like bucket_find
+static Dirent* bucket_free_slot(const Disk* disk, Dirent* bucket) {
+    switch (disk->block_size) {
+        case 1024: return scan_free_slot(bucket, 1024 / sizeof(Dirent));
+        case 4096: return scan_free_slot(bucket, 4096 / sizeof(Dirent));
+        case 65536: return scan_free_slot(bucket, 65536 / sizeof(Dirent));
+        default: return scan_free_slot(bucket, DIRENTS_PER_BLOCK(disk));
+    }
+}
+
+//find a child by name and type, NULL if not found
+const Dirent* find_dirent(const Volume* vol, uint32_t dir_ino, const char* name, uint8_t type) {
+    const DirIndex* idx = get_dir_index(vol, dir_ino);
+    if (idx == NULL || idx->num_buckets == 0) return NULL;
+    uint32_t bucket_block = idx->buckets[bucket_of(idx, dirent_hash(name))];
+    const Dirent* bucket = get_block(&vol->disk, bucket_block);
+    if (bucket == NULL) return NULL;
+    int slot = bucket_find(&vol->disk, bucket, name, type);
+    return slot < 0 ? NULL : &bucket[slot];
+}
+
+//allocate a zeroed block at the end of the directory chain, starting the chain if needed; stores it in block,
+//returns FS_ERR_NO_SPACE if the disk is full or FS_ERR_IO if a block cannot be read
+static int append_dir_block(Volume* vol, uint32_t dir_ino, uint32_t* block) {
+    Entry* dir = get_entry_mut(vol, dir_ino);
+    if (dir == NULL) return FS_ERR_IO;
+    *block = append_entry_block(vol, dir);
+    if (*block == FAT_EOF) return FS_ERR_NO_SPACE;
+    //freed blocks keep their old contents
+    void* view = get_block_mut(&vol->disk, *block);
+    if (view == NULL) return FS_ERR_IO;
+    memset(view, 0, vol->disk.block_size);
+    mark_meta_dirty(vol, *block);
+    return 0;
+}
+
+//create the index and the first bucket of a directory, stores the index in idx
+static int create_dir_index(Volume* vol, uint32_t dir_ino, DirIndex** idx) {
+    uint32_t index_block, bucket_block;
+    int res = append_dir_block(vol, dir_ino, &index_block);
+    if (res == 0) res = append_dir_block(vol, dir_ino, &bucket_block);
+    if (res == 0 && (*idx = get_block_mut(&vol->disk, index_block)) == NULL) res = FS_ERR_IO;
+    if (res != 0) {
+        //give back what was appended, a directory without buckets must have no index
+        Entry* dir = get_entry_mut(vol, dir_ino);
+        if (dir != NULL && dir->start_block != FAT_EOC) release_entry_blocks(vol, dir);
+        return res;
+    }
+    (*idx)->num_buckets = 1;
+    (*idx)->level = 0;
+    (*idx)->split = 0;
+    (*idx)->buckets[0] = bucket_block;
+    mark_meta_dirty(vol, index_block);
+    return 0;
+}
+
+//split the next bucket: add a bucket and move over the dirents that now hash to it
+static int split_bucket(Volume* vol, uint32_t dir_ino, DirIndex* idx) {
+    if (idx->num_buckets >= DIR_MAX_BUCKETS(&vol->disk)) return FS_ERR_DIR_FULL;
+    uint32_t new_block;
+    int res = append_dir_block(vol, dir_ino, &new_block);
+    if (res != 0) return res;
+    uint32_t old = idx->split;
+    uint32_t old_block = idx->buckets[old];
+    //both buckets are in hand before the index changes
+    Dirent* from = get_block_mut(&vol->disk, old_block);
+    Dirent* to = get_block_mut(&vol->disk, new_block);
+    if (from == NULL || to == NULL) return FS_ERR_IO;
+    idx->buckets[idx->num_buckets] = new_block;
+    idx->num_buckets++;
+    idx->split++;
+    if (idx->split == (1u << idx->level)) {
+        idx->level++;
+        idx->split = 0;
+    }
+    mark_meta_dirty(vol, get_dir_index_block(vol, dir_ino));
+    //dirents of the old bucket either stay or move to the new one
+    uint32_t moved = 0;
+    for (uint32_t i = 0; i < DIRENTS_PER_BLOCK(&vol->disk); i++) {
+        if (from[i].ino == 0) continue;
+        if (bucket_of(idx, dirent_hash(from[i].name)) == old) continue;
+        to[moved++] = from[i];
+        memset(&from[i], 0, sizeof(Dirent));
+    }
+    mark_meta_dirty(vol, old_block);
+    mark_meta_dirty(vol, new_block);
+    return 0;
+}
+
+//add a dirent for the child, growing the directory by one bucket at a time,
+//returns FS_ERR_NO_SPACE or FS_ERR_DIR_FULL if it cannot grow, FS_ERR_IO if a block cannot be read
+int update_directory_children(Volume* vol, uint32_t dir_ino, const Entry* child) {
+    if (child == NULL) return FS_ERR_INVALID;
+    Entry* dir = get_entry_mut(vol, dir_ino);
+    if (dir == NULL) return FS_ERR_INVALID;
+    DirIndex* idx = get_dir_index_mut(vol, dir_ino);
+    //a directory with blocks whose index cannot be read must not get a second one
+    if (idx == NULL && dir->start_block != FAT_EOC) return FS_ERR_IO;
+    if (idx == NULL) {
+        int res = create_dir_index(vol, dir_ino, &idx);
+        if (res != 0) return res;
+    }
+    uint32_t hash = dirent_hash(child->name);
+    Dirent* slot = NULL;
+    uint32_t bucket_block = 0;
+    while (slot == NULL) {
+        bucket_block = idx->buckets[bucket_of(idx, hash)];
+        Dirent* bucket = get_block_mut(&vol->disk, bucket_block);
+        if (bucket == NULL) return FS_ERR_IO;
+        slot = bucket_free_slot(&vol->disk, bucket);
+        //the target bucket is full: keep splitting until it gets room
+        if (slot == NULL) {
+            int res = split_bucket(vol, dir_ino, idx);
+            if (res != 0) return res;
+        }
+    }
+    memcpy(slot->name, child->name, MAX_NAME_LEN);
+    slot->type = child->type;
+    slot->size = child->size;
+    slot->ino = child->ino;
+    mark_meta_dirty(vol, bucket_block);
+    dir->num_children++;
+    mark_entry_dirty(vol, dir_ino);
+    //keep buckets below the load limit so most inserts never hit a full one
+    if ((uint64_t)dir->num_children * 100 > (uint64_t)idx->num_buckets * DIRENTS_PER_BLOCK(&vol->disk) * DIR_MAX_LOAD)
+        split_bucket(vol, dir_ino, idx);
+    return 0;
+}
+
+//find the dirent a directory keeps for a child, NULL if not found
+static Dirent* find_dirent_mut(Volume* vol, uint32_t dir_ino, const Entry* child, uint32_t* bucket_block) {
+    const DirIndex* idx = get_dir_index(vol, dir_ino);
+    if (idx == NULL || idx->num_buckets == 0) return NULL;
+    *bucket_block = idx->buckets[bucket_of(idx, dirent_hash(child->name))];
+    Dirent* bucket = get_block_mut(&vol->disk, *bucket_block);
+    if (bucket == NULL) return NULL;
+    int slot = bucket_find(&vol->disk, bucket, child->name, child->type);
+    if (slot < 0 || bucket[slot].ino != child->ino) return NULL;
+    return &bucket[slot];
+}
+
+//remove a child's dirent from a directory, returns -1 if not found
+int remove_directory_child(Volume* vol, uint32_t dir_ino, const Entry* child) {
+    Entry* dir = get_entry_mut(vol, dir_ino);
+    if (dir == NULL) return -1;
+    uint32_t bucket_block;
+    Dirent* d = find_dirent_mut(vol, dir_ino, child, &bucket_block);
+    if (d == NULL) return -1;
+    //buckets are never merged back, the directory keeps its blocks until removed
+    memset(d, 0, sizeof(Dirent));
+    mark_meta_dirty(vol, bucket_block);
+    dir->num_children--;
+    mark_entry_dirty(vol, dir_ino);
+    return 0;
+}
+
+//copy an entry's size into the dirent its parent keeps for it
+int refresh_parent_dirent(Volume* vol, const Entry* entry) {
+    if (entry->parent_ino == FAT_EOF) return 0; //root has no parent
+    uint32_t bucket_block;
+    Dirent* d = find_dirent_mut(vol, entry->parent_ino, entry, &bucket_block);
+    if (d == NULL) return -1;
+    d->size = entry->size;
+    mark_meta_dirty(vol, bucket_block);
+    return 0;
+}
+
+//true if the directory has no children
+bool directory_is_empty(const Entry* dir) {
+    return dir->num_children == 0;
+}
+
+//call fn on every child of a directory, stops early and returns fn's result if it is not 0
+int for_each_dirent(const Volume* vol, uint32_t dir_ino, int (*fn)(const Dirent* d, void* arg), void* arg) {
+    const DirIndex* idx = get_dir_index(vol, dir_ino);
+    if (idx == NULL) return 0;
+    for (uint32_t b = 0; b < idx->num_buckets; b++) {
+        const Dirent* bucket = get_block(&vol->disk, idx->buckets[b]);
+        if (bucket == NULL) return -1;
+        for (uint32_t i = 0; i < DIRENTS_PER_BLOCK(&vol->disk); i++) {
+            if (bucket[i].ino == 0) continue;
+            int res = fn(&bucket[i], arg);
+            if (res != 0) return res;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "disk.h"
+#include "fat.h"
+#include "entry.h"
+#include "volume.h"
+#include "errors.h"
+#include "../utils/utils.h"
+
+//compact directory entry, enough to list a child without reading it
+typedef struct {
+    char name[MAX_NAME_LEN];
+    uint8_t type;                           //ENTRY_TYPE_FILE or ENTRY_TYPE_DIR
+    uint32_t ino;                           //inode of the child, 0 for an unused slot
+    uint64_t size;                          //size of the child
+} Dirent;
+
+#define DIRENTS_PER_BLOCK(disk) ((disk)->block_size / sizeof(Dirent))
+#define DIR_MAX_BUCKETS(disk)   ((disk)->block_size / sizeof(uint32_t) - 3)
+
+//split a bucket when the directory is this full (percent of all bucket slots)
+#define DIR_MAX_LOAD 75
+
+//index block of a directory: the first block of its chain, pointed to by the entry.
+//Children are spread over bucket blocks by a linear hash of their name, so a
+//lookup reads the index and a single bucket whatever the directory size.
+typedef struct {
+    uint32_t num_buckets;                   //bucket blocks in use, 2^level + split
+    uint32_t level;                         //buckets below split are addressed with level + 1 bits
+    uint32_t split;                         //next bucket to split
+    uint32_t buckets[];                     //block of each bucket, up to DIR_MAX_BUCKETS
+} DirIndex;
+
+//hash of a child name, used to pick its bucket
+uint32_t dirent_hash(const char* name);
+
+//block of the directory index, FAT_EOC while the directory never had children
+uint32_t get_dir_index_block(const Volume* vol, uint32_t dir_ino);
+
+//find a child by name and type, NULL if not found
+const Dirent* find_dirent(const Volume* vol, uint32_t dir_ino, const char* name, uint8_t type);
+
+//add a dirent for the child, growing the directory by one bucket at a time,
+//returns FS_ERR_NO_SPACE or FS_ERR_DIR_FULL if it cannot grow, FS_ERR_IO if a block cannot be read
+int update_directory_children(Volume* vol, uint32_t dir_ino, const Entry* child);
+
+//remove a child's dirent from a directory, returns -1 if not found
+int remove_directory_child(Volume* vol, uint32_t dir_ino, const Entry* child);
+
+//copy an entry's size into the dirent its parent keeps for it
+int refresh_parent_dirent(Volume* vol, const Entry* entry);
+
+//true if the directory has no children
+bool directory_is_empty(const Entry* dir);
+
+//call fn on every child of a directory, stops early and returns fn's result if it is not 0
+int for_each_dirent(const Volume* vol, uint32_t dir_ino, int (*fn)(const Dirent* d, void* arg), void* arg);
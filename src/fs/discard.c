@@ -0,0 +1,80 @@
+#include "discard.h"
+
+//set up an empty queue, enabled or not
+void discard_init(DiscardQueue* dq, bool enabled, bool threaded) {
+    memset(dq, 0, sizeof(DiscardQueue));
+    dq->enabled = enabled;
+    dq->threaded = threaded;
+    pthread_mutex_init(&dq->lock, NULL);
+}
+
+//release the queue
+void discard_destroy(DiscardQueue* dq) {
+    free(dq->ranges);
+    pthread_mutex_destroy(&dq->lock);
+    memset(dq, 0, sizeof(DiscardQueue));
+}
+
+//queue a run of freed blocks, merging it into the last run when they touch
+void discard_add(DiscardQueue* dq, uint32_t start, uint32_t len) {
+    if (!dq->enabled || len == 0) return;
+    if (dq->threaded) pthread_mutex_lock(&dq->lock);
+    DiscardRange* last = dq->count > 0 ? &dq->ranges[dq->count - 1] : NULL;
+    //chains are mostly freed in order, so most runs extend the previous one
+    if (last != NULL && last->start + last->len == start) last->len += len;
+    else if (last != NULL && start + len == last->start) {
+        last->start = start;
+        last->len += len;
+    } else {
+        if (dq->count == dq->capacity) {
+            uint32_t capacity = dq->capacity > 0 ? dq->capacity * 2 : 64;
+            DiscardRange* ranges = realloc(dq->ranges, (size_t)capacity * sizeof(DiscardRange));
+            //a run that cannot be queued stays allocated in the file until the next trim
+            if (ranges == NULL) {
+                if (dq->threaded) pthread_mutex_unlock(&dq->lock);
+                return;
+            }
+            dq->ranges = ranges;
+            dq->capacity = capacity;
+        }
+        dq->ranges[dq->count++] = (DiscardRange){start, len};
+    }
+    __atomic_store_n(&dq->pending_blocks, dq->pending_blocks + len, __ATOMIC_RELAXED);
+    if (dq->threaded) pthread_mutex_unlock(&dq->lock);
+}
+
+//true once enough blocks are queued for a batch
+bool discard_due(const DiscardQueue* dq) {
+    return dq->enabled && __atomic_load_n(&dq->pending_blocks, __ATOMIC_RELAXED) >= DISCARD_BATCH_BLOCKS;
+}
+
+//order of ranges by first block
+static int compare_ranges(const void* a, const void* b) {
+    uint32_t sa = ((const DiscardRange*)a)->start, sb = ((const DiscardRange*)b)->start;
+    return sa < sb ? -1 : sa > sb;
+}
+
+//take every queued run sorted by start and coalesced, the queue is left empty; the caller frees *ranges
+uint32_t discard_take(DiscardQueue* dq, DiscardRange** ranges) {
+    if (dq->threaded) pthread_mutex_lock(&dq->lock);
+    DiscardRange* taken = dq->ranges;
+    uint32_t count = dq->count;
+    dq->ranges = NULL;
+    dq->count = dq->capacity = 0;
+    __atomic_store_n(&dq->pending_blocks, 0, __ATOMIC_RELAXED);
+    if (dq->threaded) pthread_mutex_unlock(&dq->lock);
+    //runs freed by different chains may touch or overlap, each byte range is punched once
+    if (count > 1) qsort(taken, count, sizeof(DiscardRange), compare_ranges);
+    uint32_t merged = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        DiscardRange* prev = merged > 0 ? &taken[merged - 1] : NULL;
+        uint64_t end = (uint64_t)taken[i].start + taken[i].len;
+        if (prev != NULL && taken[i].start <= prev->start + prev->len) {
+            if (end > prev->start + prev->len) prev->len = end - prev->start;
+        } else {
+            taken[merged++] = taken[i];
+        }
+    }
+    *ranges = taken;
+    return merged;
+}
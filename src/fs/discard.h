@@ -0,0 +1,39 @@
+#pragma once
+
+#include "disk.h"
+#include "../utils/utils.h"
+
+#define DISCARD_BATCH_BLOCKS 1024   //freed blocks queued before a flush punches them out (4 MB with 4 KB blocks)
+
+//run of freed blocks waiting to be punched out of the disk file
+typedef struct {
+    uint32_t start;
+    uint32_t len;
+} DiscardRange;
+
+//freed block runs queued by deallocations; they are punched after the transaction that freed them is
+//committed, skipping any block allocated again in the meantime
+typedef struct {
+    bool enabled;               //"discard" mount option, nothing is queued without it
+    DiscardRange* ranges;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t pending_blocks;    //blocks in ranges, overlaps counted twice
+    bool threaded;              //chains are freed from several threads at once
+    pthread_mutex_t lock;
+} DiscardQueue;
+
+//set up an empty queue, enabled or not
+void discard_init(DiscardQueue* dq, bool enabled, bool threaded);
+
+//release the queue
+void discard_destroy(DiscardQueue* dq);
+
+//queue a run of freed blocks, merging it into the last run when they touch
+void discard_add(DiscardQueue* dq, uint32_t start, uint32_t len);
+
+//true once enough blocks are queued for a batch
+bool discard_due(const DiscardQueue* dq);
+
+//take every queued run sorted by start and coalesced, the queue is left empty; the caller frees *ranges
+uint32_t discard_take(DiscardQueue* dq, DiscardRange** ranges);
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE //fallocate
 #include "disk.h"
 #include "fat.h"
 
@@ -7,54 +8,218 @@ void print_disk_info(const DiskInfo* info) {
     printf("Disk Size: %zu bytes\n", info->disk_size);
     printf("Block Size: %zu bytes\n", info->block_size);
     printf("Free Blocks: %zu\n", info->free_blocks);
-    printf("Free List Head: %u\n", info->free_list_head);
+    printf("Allocation Hint: %u\n", info->alloc_hint);
+    printf("Maximum Size: %zu bytes\n", info->max_size);
+    printf("Inode Table: %u inodes in %u extents from block %u, %u free\n", info->inode_count, info->inode_extents, info->inode_table[0].start, info->free_inodes);
+    printf("Journal: %u blocks at block %u\n", info->journal_blocks, info->journal_start);
+    printf("Format Version: %u\n", info->magic == FS_MAGIC ? info->version : 1);
 }
 
 // print disk status: metainfo and first ENTRIES_TO_PRINT FAT entries
-void print_disk_status(char* disk_mem, size_t disk_size_bytes){
+void print_disk_status(const Disk* disk){
     //read metainfo
     printf("Disk status:\n");
     DiskInfo info = {0};
-    int res = read_metainfo(disk_mem, &info, BLOCK_SIZE, disk_size_bytes);
-    if (res != 0) handle_error("Failed to read metainfo");
+    int res = read_metainfo(disk, &info);
+    if (res != 0) return;
     printf("Metainfo:\n");
     print_disk_info(&info);
-    //read fat
-    uint32_t num_fat_entries = disk_size_bytes / BLOCK_SIZE;
-    uint32_t fat[num_fat_entries];
-    res = read_fat(disk_mem, fat, num_fat_entries, 1, BLOCK_SIZE, disk_size_bytes);
-    if (res != 0) handle_error("Failed to read FAT");
+    //the first FAT block holds more than ENTRIES_TO_PRINT entries
+    const uint32_t* fat = get_block(disk, 1);
+    if (fat == NULL) return;
     printf("\n");
     printf("FAT (first %d entries):\n", ENTRIES_TO_PRINT);
     print_fat(fat, ENTRIES_TO_PRINT);
 }
 
-//initialize disk
-char* open_and_map_disk(const char* filename, size_t filesize) {
-    //syscall to open a file
-    int fd = open(filename, O_RDWR | O_CREAT, 0666);
-    if (fd == -1) {
-        perror("Error opening/creating disk file");
-        return NULL;
+//open the disk file: a new one of *filesize bytes is created as a single hole, an existing one (*filesize 0)
+//keeps its size, stored in *filesize. Returns the descriptor or -1 with errno set
+static int open_disk_file(const char* filename, size_t* filesize, int flags) {
+    //a new image starts out as one hole, an existing image is never resized
+    int fd = open(filename, *filesize > 0 ? O_RDWR | O_CREAT | O_TRUNC | flags : O_RDWR | flags, 0666);
+    if (fd == -1) return -1;
+    int result;
+    if (*filesize > 0) result = ftruncate(fd, *filesize);
+    else {
+        struct stat st;
+        result = fstat(fd, &st);
+        if (result == 0) *filesize = st.st_size;
+        if (result == 0 && *filesize < MIN_BLOCK_SIZE) {
+            errno = EINVAL;
+            result = -1;
+        }
     }
-    //set file size
-    int result = ftruncate(fd, filesize);
     if (result == -1) {
-        perror("Error setting disk file size");
+        int saved_errno = errno;
         close(fd);
-        return NULL;
+        errno = saved_errno;
+        return -1;
     }
+    return fd;
+}
+
+//create a new sparse disk file of *filesize bytes and map it, or map an existing one at its own size when *filesize
+//is 0 (storing it in *filesize); the file stays open in *fd. NULL on failure with errno set
+char* open_and_map_disk(const char* filename, size_t* filesize, int* fd_out) {
+    int fd = open_disk_file(filename, filesize, 0);
+    if (fd == -1) return NULL;
     //mmap
-    char* file_memory = (char*) mmap(NULL, filesize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    char* file_memory = (char*) mmap(NULL, *filesize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
     if (file_memory == MAP_FAILED) {
-        perror("Error mapping disk file");
+        int saved_errno = errno;
         close(fd);
+        errno = saved_errno;
         return NULL;
     }
-    close(fd);
+    *fd_out = fd;
     return file_memory;
 }
 
+//reserve size bytes of address space for the private region blocks are loaded into, it only takes memory
+//for the blocks loaded
+static char* map_blocks(size_t size) {
+    char* mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return mem == MAP_FAILED ? NULL : mem;
+}
+
+//map the disk file (filesize 0: an existing file at its own size) with the given backend and set up dirty
+//tracking; blocks are MIN_BLOCK_SIZE until set_block_size, enough to read the metainfo
+int open_disk(Disk* disk, const char* filename, size_t filesize, int mode, int io) {
+    memset(disk, 0, sizeof(Disk));
+    disk->io = io;
+    if (io == DISK_IO_MMAP) {
+        disk->map = open_and_map_disk(filename, &filesize, &disk->fd);
+        if (disk->map == NULL) return -1;
+    } else {
+        disk->fd = open_disk_file(filename, &filesize, io == DISK_IO_DIRECT ? O_DIRECT : 0);
+        if (disk->fd == -1) return -1;
+    }
+    disk->mem = map_blocks(filesize);
+    if (disk->mem == NULL) {
+        if (disk->map != NULL) munmap(disk->map, filesize);
+        close(disk->fd);
+        return -1;
+    }
+    disk->size = filesize;
+    disk->map_size = filesize;
+    disk->block_size = MIN_BLOCK_SIZE;
+    disk->block_shift = __builtin_ctz(MIN_BLOCK_SIZE);
+    disk->num_blocks = filesize >> disk->block_shift;
+    disk->max_blocks = disk->num_blocks;
+    disk->mode = mode;
+    disk->dirty = calloc((disk->num_blocks + 7) / 8, 1);
+    disk->loaded = calloc((disk->num_blocks + 7) / 8, 1);
+    if (disk->dirty == NULL || disk->loaded == NULL) {
+        free(disk->dirty);
+        free(disk->loaded);
+        munmap(disk->mem, filesize);
+        if (disk->map != NULL) munmap(disk->map, filesize);
+        close(disk->fd);
+        return -1;
+    }
+    disk->dirty_threshold = DEFAULT_DIRTY_THRESHOLD;
+    disk->flush_interval = DEFAULT_FLUSH_INTERVAL;
+    disk->last_flush = time(NULL);
+    pthread_mutex_init(&disk->sync_lock, NULL);
+    pthread_mutex_init(&disk->load_lock, NULL);
+    return 0;
+}
+
+//start the asynchronous queue of the uring and pool backends, with depth requests in flight; the other
+//backends have none
+int open_disk_queue(Disk* disk, unsigned depth) {
+    if (disk->io != DISK_IO_URING && disk->io != DISK_IO_POOL) return 0;
+    disk->queue = malloc(sizeof(IoQueue));
+    if (disk->queue == NULL) return -1;
+    if (ioq_init(disk->queue, disk->fd, depth, disk->io == DISK_IO_POOL, disk->threaded) != 0) {
+        free(disk->queue);
+        disk->queue = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+//switch the disk to blocks of block_size bytes (a power of two from MIN_BLOCK_SIZE to MAX_BLOCK_SIZE),
+//before any block is written
+int set_block_size(Disk* disk, uint32_t block_size) {
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0) return -1;
+    uint32_t shift = __builtin_ctz(block_size);
+    uint32_t max_blocks = disk->map_size >> shift;
+    //nothing is dirty yet, the bitmaps are simply sized again and blocks loaded so far are read again
+    uint8_t* dirty = calloc((max_blocks + 7) / 8, 1);
+    uint8_t* loaded = calloc((max_blocks + 7) / 8, 1);
+    if (dirty == NULL || loaded == NULL) {
+        free(dirty);
+        free(loaded);
+        return -1;
+    }
+    free(disk->dirty);
+    free(disk->loaded);
+    disk->dirty = dirty;
+    disk->loaded = loaded;
+    disk->dirty_count = 0;
+    disk->block_size = block_size;
+    disk->block_shift = shift;
+    disk->num_blocks = disk->size >> shift;
+    disk->max_blocks = max_blocks;
+    return 0;
+}
+
+//use the first size bytes of the file as the disk (a grow cut short by a crash may leave the file longer) and
+//map it again with room to grow up to max_size, before anything points into the mapping
+int reserve_disk(Disk* disk, size_t size, size_t max_size) {
+    if (size > disk->size || size > max_size) return -1;
+    disk->size = size;
+    disk->num_blocks = size >> disk->block_shift;
+    if (max_size <= disk->map_size) return 0;
+    //the private region loses what it holds, so it can only move while nothing is dirty
+    if (disk->dirty_count > 0) return -1;
+    char* mem = map_blocks(max_size);
+    //pages of the shared mapping past the end of the file are never touched, growing the file makes them usable in place
+    char* map = disk->io == DISK_IO_MMAP ? mmap(NULL, max_size, PROT_READ | PROT_WRITE, MAP_SHARED, disk->fd, 0) : NULL;
+    uint32_t max_blocks = max_size >> disk->block_shift;
+    uint8_t* dirty = calloc((max_blocks + 7) / 8, 1);
+    uint8_t* loaded = calloc((max_blocks + 7) / 8, 1);
+    if (mem == NULL || map == MAP_FAILED || dirty == NULL || loaded == NULL) {
+        free(dirty);
+        free(loaded);
+        if (mem != NULL) munmap(mem, max_size);
+        if (map != NULL && map != MAP_FAILED) munmap(map, max_size);
+        return -1;
+    }
+    //both shared mappings see the same page cache, nothing written through the old one is lost
+    if (map != NULL) {
+        munmap(disk->map, disk->map_size);
+        disk->map = map;
+    }
+    munmap(disk->mem, disk->map_size);
+    free(disk->dirty);
+    free(disk->loaded);
+    disk->mem = mem;
+    disk->map_size = max_size;
+    disk->max_blocks = max_blocks;
+    disk->dirty = dirty;
+    disk->loaded = loaded;
+    return 0;
+}
+
+//extend the disk file to new_size bytes within the reserved mapping, the new blocks read as zeros;
+//blocks already borrowed stay valid
+int grow_disk(Disk* disk, size_t new_size) {
+    if (new_size < disk->size || new_size > disk->map_size) return -1;
+    //whatever an interrupted grow left past the end is dropped first, so the new space is all holes
+    if (ftruncate(disk->fd, disk->size) != 0 || ftruncate(disk->fd, new_size) != 0) return -1;
+    __atomic_store_n(&disk->size, new_size, __ATOMIC_RELEASE);
+    __atomic_store_n(&disk->num_blocks, new_size >> disk->block_shift, __ATOMIC_RELEASE);
+    return 0;
+}
+
+//largest disk with blocks of block_size bytes: block numbers stay below the FAT markers, up to MAX_DISK_SIZE
+size_t max_disk_size(size_t block_size) {
+    size_t limit = (size_t)0xFFFFFFF0 * block_size;
+    return limit < MAX_DISK_SIZE ? limit : MAX_DISK_SIZE;
+}
+
 //compute blocks needed for metainfo + FAT
 uint32_t calc_reserved_blocks(size_t disk_size, size_t block_size) {
     uint32_t num_blocks = disk_size / block_size;
@@ -66,41 +231,390 @@ uint32_t calc_reserved_blocks(size_t disk_size, size_t block_size) {
     return meta_blocks + fat_blocks;
 }
 
-//read block from the disk to buffer
-int read_block(char* disk_mem, uint32_t block_index, void *buffer, size_t block_size, size_t disk_size_bytes) {
-    size_t offset = block_index * block_size;
-    //prevent out of bounds access
-    if (offset + block_size > disk_size_bytes) {
-        return -1;
+//read len bytes at offset of the disk file into buf, through the shared mapping for mmap, whole and aligned for O_DIRECT; past the end of the file
+//reads as zeros
+static int dev_read(const Disk* disk, void* buf, size_t len, off_t offset) {
+    if (disk->io == DISK_IO_MMAP) {
+        memcpy(buf, disk->map + offset, len);
+        return 0;
+    }
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(disk->fd, (char*)buf + done, len - done, offset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) {
+            memset((char*)buf + done, 0, len - done);
+            break;
+        }
+        done += n;
     }
-    memcpy(buffer, (char*)disk_mem + offset, block_size);
     return 0;
 }
 
-//write block from buffer to the disk
-int write_block(char* disk_mem, uint32_t block_index, const void *buffer, size_t block_size, size_t disk_size_bytes) {
-    size_t offset = block_index * block_size;
-    //prevent out of bounds access
-    if (offset + block_size > disk_size_bytes) {
-        return -1;
+//write len bytes from buf at offset of the disk file, whole and aligned for O_DIRECT
+static int dev_write(const Disk* disk, const void* buf, size_t len, off_t offset) {
+    if (disk->io == DISK_IO_MMAP) {
+        memcpy(disk->map + offset, buf, len);
+        return 0;
+    }
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(disk->fd, (const char*)buf + done, len - done, offset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += n;
     }
-    memcpy((char*)disk_mem + offset, buffer, block_size);
-    //ensure persistence
-    msync((char*)disk_mem + offset, block_size, MS_SYNC);
     return 0;
 }
 
-//close disk
-void close_and_unmap_disk(char* file_memory, size_t filesize) {
-    //sync changes to disk
-    int result = msync(file_memory, filesize, MS_SYNC);
-    if (result == -1) {
-        perror("Error syncing disk file");
+//true if a block of the private region holds the file's contents
+static bool block_loaded(const Disk* disk, uint32_t block_index) {
+    return (__atomic_load_n(&disk->loaded[block_index / 8], __ATOMIC_ACQUIRE) >> (block_index % 8)) & 1;
+}
+
+//read a block into the private region on first use; one load at a time, so a block is never read
+//over changes made after another thread loaded it
+static int load_block(const Disk* disk, uint32_t block_index) {
+    pthread_mutex_t* lock = (pthread_mutex_t*)&disk->load_lock;
+    pthread_mutex_lock(lock);
+    int res = 0;
+    if (!block_loaded(disk, block_index)) {
+        size_t offset = (size_t)block_index << disk->block_shift;
+        res = dev_read(disk, disk->mem + offset, disk->block_size, offset);
+        if (res == 0) __atomic_fetch_or(&disk->loaded[block_index / 8], 1u << (block_index % 8), __ATOMIC_RELEASE);
     }
+    pthread_mutex_unlock(lock);
+    return res;
+}
 
-    //unmap the file from memory
-    result = munmap(file_memory, filesize);
-    if (result == -1) {
-        perror("Error unmapping disk file");
+//forget the private copies of a run of blocks that now belong to file data or were punched out: clear their
+//loaded and dirty bits, after any flush that may be writing them back
+static void drop_blocks(Disk* disk, uint32_t start, uint32_t len) {
+    bool any = false;
+    for (uint32_t b = start; b < start + len && !any; b++) any = block_loaded(disk, b);
+    if (!any) return;
+    pthread_mutex_lock(&disk->sync_lock);
+    for (uint32_t b = start; b < start + len; b++) {
+        uint8_t bit = 1u << (b % 8);
+        __atomic_fetch_and(&disk->loaded[b / 8], ~bit, __ATOMIC_RELAXED);
+        if (__atomic_fetch_and(&disk->dirty[b / 8], ~bit, __ATOMIC_RELAXED) & bit) __atomic_fetch_sub(&disk->dirty_count, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&disk->sync_lock);
+}
+
+//give a run of blocks back to the host by punching a hole in the disk file, the blocks read as zeros after
+int discard_blocks(Disk* disk, uint32_t start, uint32_t len) {
+    if (len == 0) return 0;
+    if (start >= disk->num_blocks || len > disk->num_blocks - start) return -1;
+    drop_blocks(disk, start, len);
+    return fallocate(disk->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)start << disk->block_shift, (off_t)len << disk->block_shift);
+}
+
+//borrow a read-only view of a block, loaded into the private region on first use; NULL if out of bounds
+//or if the block cannot be read (an I/O error)
+const void* get_block(const Disk* disk, uint32_t block_index) {
+    //the disk may grow under readers, never shrink
+    if (disk->mem == NULL || block_index >= __atomic_load_n(&disk->num_blocks, __ATOMIC_ACQUIRE)) return NULL;
+    if (!block_loaded(disk, block_index) && load_block(disk, block_index) != 0) return NULL;
+    return disk->mem + ((size_t)block_index << disk->block_shift);
+}
+
+//borrow a writable view of a block in the private region, call mark_block_dirty after modifying it; NULL if
+//out of bounds or if the block cannot be read (an I/O error)
+void* get_block_mut(Disk* disk, uint32_t block_index) {
+    return (void*)get_block(disk, block_index);
+}
+
+//blocks a run of file data touches
+static uint32_t run_blocks(const Disk* disk, const DataRun* run) {
+    return (run->offset + run->len + disk->block_size - 1) >> disk->block_shift;
+}
+
+//true if every run lies within the disk
+static bool runs_valid(const Disk* disk, const DataRun* runs, uint32_t n) {
+    uint32_t num_blocks = __atomic_load_n(&disk->num_blocks, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < n; i++) {
+        if (runs[i].block >= num_blocks || runs[i].offset + runs[i].len > (size_t)(num_blocks - runs[i].block) << disk->block_shift) return false;
+    }
+    return true;
+}
+
+//O_DIRECT moves whole blocks between aligned buffers: a piece of a block goes through a bounce buffer,
+//read whole and, for a write, patched and written back whole
+static int bounce_block(const Disk* disk, int op, off_t block_pos, size_t offset, void* buf, size_t len) {
+    char* bounce = aligned_alloc(DIRECT_IO_ALIGN, disk->block_size);
+    if (bounce == NULL) return -1;
+    int res = op == IOQ_WRITE && len == disk->block_size ? 0 : dev_read(disk, bounce, disk->block_size, block_pos);
+    if (res == 0 && op == IOQ_READ) memcpy(buf, bounce + offset, len);
+    if (res == 0 && op == IOQ_WRITE) {
+        memcpy(bounce + offset, buf, len);
+        res = dev_write(disk, bounce, disk->block_size, block_pos);
+    }
+    free(bounce);
+    return res;
+}
+
+//move a run in the calling thread: one copy, or one pread/pwrite for the whole run; block by block only
+//where O_DIRECT cannot take the buffer as it is
+static int transfer_run(const Disk* disk, int op, const DataRun* run) {
+    off_t pos = ((off_t)run->block << disk->block_shift) + run->offset;
+    if (disk->io == DISK_IO_MMAP) {
+        if (op == IOQ_READ) memcpy(run->buf, disk->map + pos, run->len);
+        else memcpy(disk->map + pos, run->buf, run->len);
+        return 0;
+    }
+    bool aligned = ((run->offset | run->len) & (disk->block_size - 1)) == 0 && (uintptr_t)run->buf % DIRECT_IO_ALIGN == 0;
+    if (disk->io != DISK_IO_DIRECT || aligned) {
+        return op == IOQ_READ ? dev_read(disk, run->buf, run->len, pos) : dev_write(disk, run->buf, run->len, pos);
+    }
+    for (size_t done = 0; done < run->len; ) {
+        size_t in_block = (run->offset + done) & (disk->block_size - 1);
+        size_t chunk = disk->block_size - in_block;
+        if (chunk > run->len - done) chunk = run->len - done;
+        char* p = (char*)run->buf + done;
+        int res;
+        if (chunk == disk->block_size && (uintptr_t)p % DIRECT_IO_ALIGN == 0) {
+            res = op == IOQ_READ ? dev_read(disk, p, chunk, pos + done) : dev_write(disk, p, chunk, pos + done);
+        } else {
+            res = bounce_block(disk, op, pos + done - in_block, in_block, p, chunk);
+        }
+        if (res != 0) return -1;
+        done += chunk;
+    }
+    return 0;
+}
+
+//move a batch of runs through the asynchronous queue, cut into requests of at most IOQ_REQUEST_MAX bytes
+//so a single long run also keeps several requests in flight
+static int queue_runs(const Disk* disk, int op, const DataRun* runs, uint32_t n) {
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < n; i++) count += (runs[i].len + IOQ_REQUEST_MAX - 1) / IOQ_REQUEST_MAX;
+    IoRequest* reqs = malloc((size_t)count * sizeof(IoRequest));
+    if (reqs == NULL) return -1;
+    count = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        off_t pos = ((off_t)runs[i].block << disk->block_shift) + runs[i].offset;
+        for (size_t done = 0; done < runs[i].len; done += IOQ_REQUEST_MAX) {
+            size_t len = runs[i].len - done < IOQ_REQUEST_MAX ? runs[i].len - done : IOQ_REQUEST_MAX;
+            ioq_prep(&reqs[count++], op, (char*)runs[i].buf + done, len, pos + done);
+        }
+    }
+    int res = ioq_run(disk->queue, reqs, count);
+    free(reqs);
+    return res;
+}
+
+//copy a batch of runs of file data into their buffers: from the mapping, or straight from the file with the
+//other backends so file data never takes room in the private region; with a queue all of them are in flight at once
+int read_data_runs(const Disk* disk, const DataRun* runs, uint32_t n) {
+    if (!runs_valid(disk, runs, n)) return -1;
+    if (disk->queue != NULL) return queue_runs(disk, IOQ_READ, runs, n);
+    for (uint32_t i = 0; i < n; i++) {
+        if (transfer_run(disk, IOQ_READ, &runs[i]) != 0) return -1;
     }
-}
\ No newline at end of file
+    return 0;
+}
+
+//copy a batch of runs of file data from their buffers to the disk, into the shared mapping or straight to the
+//file, and drop whatever copy of the blocks the private region held
+int write_data_runs(Disk* disk, const DataRun* runs, uint32_t n) {
+    if (!runs_valid(disk, runs, n)) return -1;
+    //the blocks may have held metadata before they were freed and given to a file
+    for (uint32_t i = 0; i < n; i++) drop_blocks(disk, runs[i].block, run_blocks(disk, &runs[i]));
+    if (disk->io == DISK_IO_MMAP) {
+        for (uint32_t i = 0; i < n; i++) {
+            transfer_run(disk, IOQ_WRITE, &runs[i]);
+            uint32_t blocks = run_blocks(disk, &runs[i]);
+            //sync mode flushes the whole run at once
+            if (disk->mode == DISK_MODE_SYNC) {
+                if (sync_blocks(disk, runs[i].block, blocks) != 0) return -1;
+                continue;
+            }
+            for (uint32_t b = 0; b < blocks; b++) record_block_dirty(disk, runs[i].block + b);
+        }
+        return 0;
+    }
+    int res = 0;
+    if (disk->queue != NULL) res = queue_runs(disk, IOQ_WRITE, runs, n);
+    for (uint32_t i = 0; i < n && disk->queue == NULL && res == 0; i++) res = transfer_run(disk, IOQ_WRITE, &runs[i]);
+    if (res != 0) return -1;
+    if (disk->mode == DISK_MODE_SYNC) return fdatasync(disk->fd);
+    __atomic_store_n(&disk->unsynced, true, __ATOMIC_RELAXED);
+    return 0;
+}
+
+//copy len bytes at offset of a data block into buf
+int read_data(const Disk* disk, uint32_t block_index, size_t offset, void* buf, size_t len) {
+    if (offset + len > disk->block_size) return -1;
+    DataRun run = {block_index, offset, len, buf};
+    return read_data_runs(disk, &run, 1);
+}
+
+//copy len bytes from buf to offset of a data block
+int write_data(Disk* disk, uint32_t block_index, size_t offset, const void* buf, size_t len) {
+    if (offset + len > disk->block_size) return -1;
+    DataRun run = {block_index, offset, len, (void*)buf};
+    return write_data_runs(disk, &run, 1);
+}
+
+//zero len bytes at offset of a data block
+int zero_data(Disk* disk, uint32_t block_index, size_t offset, size_t len) {
+    static const char zeros[MAX_BLOCK_SIZE] __attribute__((aligned(DIRECT_IO_ALIGN)));
+    return write_data(disk, block_index, offset, zeros, len);
+}
+
+//msync a byte range of the shared mapping; blocks smaller than a page may start inside one, so the range is
+//widened to whole pages
+static int msync_range(const Disk* disk, size_t offset, size_t len) {
+    size_t start = offset & ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+    return msync(disk->map + start, len + offset - start, MS_SYNC);
+}
+
+#define WRITE_BACK_BATCH 64     //write-back requests issued through the queue at once
+
+//write-back requests gathered over the runs of a flush and issued together through the queue
+typedef struct {
+    IoRequest reqs[WRITE_BACK_BATCH];
+    uint32_t count;
+    int res;
+} WriteBack;
+
+//issue the write-back requests gathered so far and wait for them, returns -1 if any write failed so far
+static int issue_write_back(Disk* disk, WriteBack* wb) {
+    if (wb->count > 0 && ioq_run(disk->queue, wb->reqs, wb->count) != 0) wb->res = -1;
+    wb->count = 0;
+    return wb->res;
+}
+
+//write a run of blocks back to the file from the private region, without waiting for the device (blocks never
+//loaded are left alone, the file or the shared mapping already has them); with mmap the copies go into the
+//mapping and the whole run is msync'ed, with a queue the writes are gathered in wb and go out in batches
+static int write_back_run(Disk* disk, uint32_t start, uint32_t len, WriteBack* wb) {
+    if (len == 0) return 0;
+    uint32_t end = start + len;
+    for (uint32_t b = start; b < end; ) {
+        uint32_t run = 0;
+        while (b + run < end && block_loaded(disk, b + run)) run++;
+        size_t offset = (size_t)b << disk->block_shift;
+        size_t bytes = (size_t)run << disk->block_shift;
+        if (disk->queue == NULL && run > 0 && dev_write(disk, disk->mem + offset, bytes, offset) != 0) return -1;
+        for (size_t done = 0; disk->queue != NULL && done < bytes; done += IOQ_REQUEST_MAX) {
+            if (wb->count == WRITE_BACK_BATCH) issue_write_back(disk, wb);
+            size_t chunk = bytes - done < IOQ_REQUEST_MAX ? bytes - done : IOQ_REQUEST_MAX;
+            ioq_prep(&wb->reqs[wb->count++], IOQ_WRITE, disk->mem + offset + done, chunk, offset + done);
+        }
+        b += run > 0 ? run : 1;
+    }
+    if (disk->io == DISK_IO_MMAP) return msync_range(disk, (size_t)start << disk->block_shift, (size_t)len << disk->block_shift);
+    return 0;
+}
+
+//record that a block was modified (flush it right away in sync mode)
+void mark_block_dirty(Disk* disk, uint32_t block_index) {
+    if (disk->mode == DISK_MODE_SYNC) {
+        //ensure persistence
+        sync_blocks(disk, block_index, 1);
+        return;
+    }
+    record_block_dirty(disk, block_index);
+}
+
+//record that a block was modified, leaving the flush to sync_disk in both modes
+void record_block_dirty(Disk* disk, uint32_t block_index) {
+    uint8_t bit = 1u << (block_index % 8);
+    //threads may mark blocks sharing a bitmap byte at the same time
+    if (__atomic_load_n(&disk->dirty[block_index / 8], __ATOMIC_RELAXED) & bit) return;
+    uint8_t old = __atomic_fetch_or(&disk->dirty[block_index / 8], bit, __ATOMIC_RELAXED);
+    if (!(old & bit)) __atomic_fetch_add(&disk->dirty_count, 1, __ATOMIC_RELAXED);
+}
+
+//flush a run of blocks right away, whether they are recorded dirty or not
+int sync_blocks(Disk* disk, uint32_t start, uint32_t len) {
+    if (len == 0) return 0;
+    if (start >= disk->num_blocks || len > disk->num_blocks - start) return -1;
+    WriteBack wb = {.count = 0, .res = 0};
+    if (write_back_run(disk, start, len, &wb) != 0) return -1;
+    if (disk->io == DISK_IO_MMAP) return 0;
+    if (disk->queue != NULL && issue_write_back(disk, &wb) != 0) return -1;
+    return fdatasync(disk->fd);
+}
+
+//flush all dirty blocks, coalescing adjacent ones into a single msync or write
+int sync_disk(Disk* disk) {
+    int ret = 0;
+    WriteBack wb = {.count = 0, .res = 0};
+    pthread_mutex_lock(&disk->sync_lock);
+    uint32_t run_start = 0, run_len = 0;
+    uint32_t bitmap_bytes = (disk->num_blocks + 7) / 8;
+    for (uint32_t i = 0; i < bitmap_bytes; i++) {
+        //skip clean bytes of the bitmap in one step, take the dirty ones atomically
+        uint8_t bits = __atomic_load_n(&disk->dirty[i], __ATOMIC_RELAXED);
+        if (bits != 0) bits = __atomic_exchange_n(&disk->dirty[i], 0, __ATOMIC_ACQ_REL);
+        if (bits == 0) {
+            if (write_back_run(disk, run_start, run_len, &wb) == -1) ret = -1;
+            run_len = 0;
+            if (__atomic_load_n(&disk->dirty_count, __ATOMIC_RELAXED) == 0) break;
+            continue;
+        }
+        __atomic_fetch_sub(&disk->dirty_count, __builtin_popcount(bits), __ATOMIC_RELAXED);
+        //extend the run over all adjacent dirty blocks
+        for (uint32_t bit = 0; bit < 8; bit++) {
+            uint32_t block = i * 8 + bit;
+            if (bits & (1u << bit)) {
+                if (run_len > 0 && run_start + run_len == block) {
+                    run_len++;
+                    continue;
+                }
+                if (write_back_run(disk, run_start, run_len, &wb) == -1) ret = -1;
+                run_start = block;
+                run_len = 1;
+            } else if (run_len > 0) {
+                if (write_back_run(disk, run_start, run_len, &wb) == -1) ret = -1;
+                run_len = 0;
+            }
+        }
+    }
+    if (write_back_run(disk, run_start, run_len, &wb) == -1) ret = -1;
+    if (disk->queue != NULL && issue_write_back(disk, &wb) != 0) ret = -1;
+    //written blocks and file data reach the device with one flush
+    if (disk->io != DISK_IO_MMAP) {
+        __atomic_store_n(&disk->unsynced, false, __ATOMIC_RELAXED);
+        if (fdatasync(disk->fd) != 0) ret = -1;
+    }
+    disk->last_flush = time(NULL);
+    pthread_mutex_unlock(&disk->sync_lock);
+    return ret;
+}
+
+//true if the dirty threshold or the flush interval has been reached
+bool sync_due(const Disk* disk) {
+    uint32_t dirty_count = __atomic_load_n(&disk->dirty_count, __ATOMIC_RELAXED);
+    if (dirty_count == 0) return false;
+    if (disk->dirty_threshold > 0 && dirty_count >= disk->dirty_threshold) return true;
+    return disk->flush_interval > 0 && time(NULL) - disk->last_flush >= (time_t)disk->flush_interval;
+}
+
+//flush dirty blocks, unmap the disk and release dirty tracking, returns -1 if the flush failed
+int close_disk(Disk* disk) {
+    if (disk->mem == NULL) return 0;
+    //the private region is the only copy of the dirty blocks
+    int res = sync_disk(disk);
+    munmap(disk->mem, disk->map_size);
+    if (disk->map != NULL) {
+        if (msync(disk->map, disk->size, MS_SYNC) != 0) res = -1;
+        //the room reserved for growth goes with it in one call, the disk size need not be a multiple of the page size
+        if (munmap(disk->map, disk->map_size) != 0) res = -1;
+    }
+    if (disk->queue != NULL) {
+        ioq_destroy(disk->queue);
+        free(disk->queue);
+    }
+    if (close(disk->fd) != 0) res = -1;
+    free(disk->dirty);
+    free(disk->loaded);
+    pthread_mutex_destroy(&disk->sync_lock);
+    pthread_mutex_destroy(&disk->load_lock);
+    memset(disk, 0, sizeof(Disk));
+    return res;
+}
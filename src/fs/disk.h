@@ -1,38 +1,175 @@
 #pragma once
 
+#include "ioqueue.h"
 #include "../utils/utils.h"
 
-#define BLOCK_SIZE 4096  //4 KB
+#define MIN_BLOCK_SIZE     1024     //1 KB
+#define MAX_BLOCK_SIZE     65536    //64 KB
+#define DEFAULT_BLOCK_SIZE 4096     //4 KB, block sizes are powers of two chosen at format
 
 #define MAX_FILES 128
 #define MAX_FILE_BLOCKS 64
 #define MAX_NAME_LEN 32
 
+#define MIN_DISK_SIZE (1ul << 20)                               //1 MB: metainfo, FAT, inode table and journal plus some data
+#define MAX_DISK_SIZE ((size_t)0xFFFFFFF0 * DEFAULT_BLOCK_SIZE)  //almost 16 TB, whatever the block size
+
+#define FS_MAGIC   0x31485346   //"FSH1", missing on images written before versioning
+#define FS_VERSION 11           //2: directories hold inline dirents, 3: hashed multi-block directories, 4: inode table, 5: inline file data, 6: chain tails, 7: free-space bitmap, 8: metadata journal, 9: 64-bit sizes, 10: growable images, 11: block size chosen at format
+
+#define DISK_MODE_SYNC      0   //every written block is flushed immediately
+#define DISK_MODE_WRITEBACK 1   //written blocks are recorded and flushed in batches
+
+#define DISK_IO_MMAP   0    //metadata blocks are loaded into a private region from a shared mapping of the file, file data moves through the mapping
+#define DISK_IO_PREAD  1    //metadata blocks are loaded into a private region with pread, file data moves with pread/pwrite
+#define DISK_IO_DIRECT 2    //as DISK_IO_PREAD through O_DIRECT, so nothing goes through the page cache
+#define DISK_IO_URING  3    //as DISK_IO_PREAD, file data and write-back go out in batches through io_uring
+#define DISK_IO_POOL   4    //as DISK_IO_URING on a thread pool, what it falls back to without io_uring
+#define DIRECT_IO_ALIGN 4096    //alignment of the buffers O_DIRECT transfers use
+
+#define DEFAULT_DIRTY_THRESHOLD 1024    //blocks dirty before a forced flush (4 MB with 4 KB blocks)
+#define DEFAULT_FLUSH_INTERVAL  5       //seconds between flushes
+
+#define INODE_MAX_EXTENTS 32    //the inode table gets one extent at format and one per grow
+
+//run of inode table blocks, inodes are numbered through the extents in order
+typedef struct {
+    uint32_t start;             //first block of the extent
+    uint32_t blocks;            //blocks in the extent
+} InodeExtent;
+
 typedef struct{
     char name[MAX_NAME_LEN];    // disk file name
     size_t disk_size;           // total disk size in bytes
     size_t block_size;         // block size
     size_t free_blocks;        // free blocks
-    uint32_t free_list_head;   // index of the first free block
+    uint32_t alloc_hint;       // block where the next allocation search starts
+    uint32_t magic;            // FS_MAGIC
+    uint32_t version;          // on-disk format version
+    uint32_t inode_count;      // number of inodes in the table
+    uint32_t free_inodes;      // free inodes
+    uint32_t journal_start;    // first block of the metadata journal
+    uint32_t journal_blocks;   // blocks reserved for the journal
+    size_t max_size;           // size the disk can grow to, the FAT is reserved for it
+    uint32_t inode_extents;    // extents in inode_table
+    InodeExtent inode_table[INODE_MAX_EXTENTS]; // where the inode table lives, the first extent follows the FAT
 } DiskInfo;
 
+_Static_assert(sizeof(DiskInfo) <= MIN_BLOCK_SIZE, "metainfo must be readable before the block size is known");
+
+//disk file behind a block backend, with dirty block tracking
+typedef struct {
+    char* mem;                  //private region blocks are loaded into and changed in until they are written back
+    char* map;                  //mmap: shared mapping of the file, file data and write-back go through it
+    int io;                     //DISK_IO_MMAP, DISK_IO_PREAD, DISK_IO_DIRECT, DISK_IO_URING or DISK_IO_POOL
+    int fd;                     //disk file, kept open so the image can grow
+    size_t size;                //disk size in bytes
+    size_t map_size;            //bytes mapped: the size the disk may grow to without moving the mapping
+    uint32_t block_size;        //bytes per block, a power of two
+    uint32_t block_shift;       //log2 of block_size: block offsets are shifts, never divisions
+    uint32_t num_blocks;        //number of blocks on disk
+    uint32_t max_blocks;        //blocks in map_size, dirty tracking covers all of them
+    int mode;                   //DISK_MODE_SYNC or DISK_MODE_WRITEBACK
+    uint8_t* dirty;             //write-back mode: one bit per block written since the last flush
+    uint32_t dirty_count;       //number of bits set in dirty
+    uint32_t dirty_threshold;   //flush when this many blocks are dirty (0 = no limit)
+    unsigned flush_interval;    //flush when this many seconds passed since the last one (0 = no limit)
+    time_t last_flush;          //time of the last flush
+    bool threaded;              //mounted for concurrent use, the volume takes its locks
+    bool discard;               //freed blocks are punched out of the file
+    pthread_mutex_t sync_lock;  //one flush at a time, dirty bits are set and taken atomically
+    uint8_t* loaded;            //one bit per block of the private region holding the file's contents
+    pthread_mutex_t load_lock;  //all but mmap: one block load at a time
+    bool unsynced;              //all but mmap: file data written since the last fdatasync
+    IoQueue* queue;             //uring and pool: asynchronous queue for file data and write-back, NULL otherwise
+} Disk;
+
+//a contiguous piece of file data: len bytes from offset of the run of consecutive blocks starting at block
+typedef struct {
+    uint32_t block;
+    size_t offset;
+    size_t len;
+    void* buf;
+} DataRun;
+
 //print disk information
 void print_disk_info(const DiskInfo* info);
 
 //print disk status
-void print_disk_status(char* disk_mem, size_t disk_size_bytes);
+void print_disk_status(const Disk* disk);
+
+//create a new sparse disk file of *filesize bytes and map it, or map an existing one at its own size when *filesize
+//is 0 (storing it in *filesize); the file stays open in *fd. NULL on failure with errno set
+char* open_and_map_disk(const char* filename, size_t* filesize, int* fd);
+
+//map the disk file (filesize 0: an existing file at its own size) with the given backend and set up dirty
+//tracking; blocks are MIN_BLOCK_SIZE until set_block_size, enough to read the metainfo
+int open_disk(Disk* disk, const char* filename, size_t filesize, int mode, int io);
+
+//start the asynchronous queue of the uring and pool backends, with depth requests in flight; the other
+//backends have none
+int open_disk_queue(Disk* disk, unsigned depth);
+
+//switch the disk to blocks of block_size bytes (a power of two from MIN_BLOCK_SIZE to MAX_BLOCK_SIZE),
+//before any block is written
+int set_block_size(Disk* disk, uint32_t block_size);
 
-//initialize disk
-char* open_and_map_disk(const char* filename, size_t filesize);
+//use the first size bytes of the file as the disk (a grow cut short by a crash may leave the file longer) and
+//map it again with room to grow up to max_size, before anything points into the mapping
+int reserve_disk(Disk* disk, size_t size, size_t max_size);
+
+//extend the disk file to new_size bytes within the reserved mapping, the new blocks read as zeros;
+//blocks already borrowed stay valid
+int grow_disk(Disk* disk, size_t new_size);
+
+//give a run of blocks back to the host by punching a hole in the disk file, the blocks read as zeros after
+int discard_blocks(Disk* disk, uint32_t start, uint32_t len);
+
+//largest disk with blocks of block_size bytes: block numbers stay below the FAT markers, up to MAX_DISK_SIZE
+size_t max_disk_size(size_t block_size);
 
 //compute number of reserved blocks (metainfo + FAT)
 uint32_t calc_reserved_blocks(size_t disk_size, size_t block_size);
 
-//read a block from disk into buffer
-int read_block(char* disk_mem, uint32_t block_index, void *buffer, size_t block_size, size_t disk_size_bytes);
+//borrow a read-only view of a block, loaded into the private region on first use; NULL if out of bounds
+//or if the block cannot be read (an I/O error)
+const void* get_block(const Disk* disk, uint32_t block_index);
+
+//borrow a writable view of a block in the private region, call mark_block_dirty after modifying it; NULL if
+//out of bounds or if the block cannot be read (an I/O error)
+void* get_block_mut(Disk* disk, uint32_t block_index);
+
+//copy a batch of runs of file data into their buffers: from the mapping, or straight from the file with the
+//other backends so file data never takes room in the private region; with a queue all of them are in flight at once
+int read_data_runs(const Disk* disk, const DataRun* runs, uint32_t n);
+
+//copy a batch of runs of file data from their buffers to the disk; the other backends write the file directly
+//and drop whatever copy of the blocks the private region held
+int write_data_runs(Disk* disk, const DataRun* runs, uint32_t n);
+
+//copy len bytes at offset of a data block into buf
+int read_data(const Disk* disk, uint32_t block_index, size_t offset, void* buf, size_t len);
+
+//copy len bytes from buf to offset of a data block
+int write_data(Disk* disk, uint32_t block_index, size_t offset, const void* buf, size_t len);
+
+//zero len bytes at offset of a data block
+int zero_data(Disk* disk, uint32_t block_index, size_t offset, size_t len);
+
+//record that a block was modified (flush it right away in sync mode)
+void mark_block_dirty(Disk* disk, uint32_t block_index);
+
+//record that a block was modified, leaving the flush to sync_disk in both modes
+void record_block_dirty(Disk* disk, uint32_t block_index);
+
+//flush a run of blocks right away, whether they are recorded dirty or not
+int sync_blocks(Disk* disk, uint32_t start, uint32_t len);
+
+//flush all dirty blocks, coalescing adjacent ones into a single msync or write
+int sync_disk(Disk* disk);
 
-//write a block from buffer to disk
-int write_block(char* disk_mem, uint32_t block_index, const void *buffer, size_t block_size, size_t disk_size_bytes);
+//true if the dirty threshold or the flush interval has been reached
+bool sync_due(const Disk* disk);
 
-//unmap and close the disk
-void close_and_unmap_disk(char* file_memory, size_t filesize);
+//flush dirty blocks, unmap the disk and release dirty tracking, returns -1 if the flush failed
+int close_disk(Disk* disk);
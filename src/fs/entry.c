@@ -1,52 +1,144 @@
 #include "entry.h"
+#include "dir.h"
+
+//number of blocks of the inode table for a disk (one inode per block, one per 4 blocks past INODE_DENSE_BLOCKS)
+uint32_t calc_inode_blocks(size_t disk_size, size_t block_size) {
+    uint32_t num_blocks = disk_size / block_size;
+    uint32_t per_block = block_size / INODE_SIZE;
+    //large disks hold larger files, a full-density table would waste 3% of them
+    uint32_t inodes = num_blocks <= INODE_DENSE_BLOCKS ? num_blocks : INODE_DENSE_BLOCKS + (num_blocks - INODE_DENSE_BLOCKS) / 4;
+    return (inodes + per_block - 1) / per_block;
+}
+
+//block of the inode table holding inode ino, walking the extents in order
+static uint32_t inode_block(const Volume* vol, uint32_t ino) {
+    uint32_t b = ino >> INODE_BLOCK_SHIFT(&vol->disk);
+    for (uint32_t i = 0; i < INODE_MAX_EXTENTS; i++) {
+        const InodeExtent* extent = &vol->info.inode_table[i];
+        if (b < extent->blocks) return extent->start + b;
+        b -= extent->blocks;
+    }
+    return FAT_EOF;
+}
+
+//rebuild the in-memory map of used inodes by scanning the inode table
+int scan_inode_table(Volume* vol) {
+    uint32_t count = vol->info.inode_count;
+    free(vol->inode_map);
+    //room for the inodes later grows add
+    uint32_t per_block = INODES_PER_BLOCK(&vol->disk);
+    vol->inode_map = calloc(((size_t)calc_inode_blocks(vol->info.max_size, vol->disk.block_size) * per_block + 7) / 8, 1);
+    if (vol->inode_map == NULL) return -1;
+    vol->inode_map[0] |= 1; //inode 0 is never handed out
+    vol->inode_hint = 1;
+    //records are packed, so the scan reads the table sequentially one block at a time
+    uint32_t table_blocks = (count + per_block - 1) / per_block;
+    for (uint32_t b = 0; b < table_blocks; b++) {
+        const Entry* records = get_block(&vol->disk, inode_block(vol, b * per_block));
+        if (records == NULL) return -1;
+        for (uint32_t i = 0; i < per_block; i++) {
+            uint32_t ino = b * per_block + i;
+            if (ino >= count) break;
+            if (records[i].ino == ino && ino != 0) vol->inode_map[ino / 8] |= 1u << (ino % 8);
+        }
+    }
+    return 0;
+}
+
+//reserve a free inode, FAT_EOF if the table is full
+uint32_t allocate_inode(Volume* vol) {
+    uint32_t found = FAT_EOF;
+    lock_allocator(vol);
+    for (uint32_t ino = vol->inode_hint; vol->info.free_inodes > 0 && ino < vol->info.inode_count; ino++) {
+        if (vol->inode_map[ino / 8] & (1u << (ino % 8))) continue;
+        vol->inode_map[ino / 8] |= 1u << (ino % 8);
+        vol->inode_hint = ino + 1;
+        vol->info.free_inodes--;
+        mark_info_dirty(vol);
+        found = ino;
+        break;
+    }
+    unlock_allocator(vol);
+    return found;
+}
+
+//clear an inode record and give it back to the table
+void free_inode(Volume* vol, uint32_t ino) {
+    Entry* entry = get_entry_mut(vol, ino);
+    if (entry == NULL) return;
+    memset(entry, 0, sizeof(Entry));
+    mark_entry_dirty(vol, ino);
+    lock_allocator(vol);
+    vol->inode_map[ino / 8] &= ~(1u << (ino % 8));
+    if (ino < vol->inode_hint) vol->inode_hint = ino;
+    vol->info.free_inodes++;
+    mark_info_dirty(vol);
+    unlock_allocator(vol);
+}
 
 //initialize an Entry structure
-void init_directory(Entry* dir, const char* name, uint32_t start_block){
+void init_directory(Entry* dir, const char* name, uint32_t ino){
+    memset(dir, 0, sizeof(Entry));
     strncpy(dir->name, name, MAX_NAME_LEN);
     dir->type = ENTRY_TYPE_DIR;
     dir->size = 0; //initially empty
-    memset(dir->dir_blocks, 0, sizeof(dir->dir_blocks));
-    dir->parent_block = FAT_EOF; //no parent initially
-    dir->current_block = start_block;
-}
-
-//write an Entry to disk
-int write_entry(void *disk_mem, const Entry* dir, size_t block_size, size_t disk_size_bytes){
-    if (disk_mem == NULL || dir == NULL) return -1; //invalid parameters
-    //the entry contains the block where the directory should be written
-    uint32_t block_index = dir->current_block;
-    //check bounds
-    if (block_index * block_size >= disk_size_bytes) return -1;
-    //write the entry to the specified block
-    char buffer[block_size];
-    memset(buffer, 0, block_size);
-    if (sizeof(*dir) > block_size) return -1; // Entry size exceeds block size
-    memcpy(buffer, dir, sizeof(Entry));
-    return write_block(disk_mem, block_index, buffer, block_size, disk_size_bytes);
+    dir->num_children = 0;
+    dir->parent_ino = FAT_EOF; //no parent initially
+    dir->ino = ino;
+    dir->start_block = FAT_EOC; //the index is allocated with the first child
+    dir->tail_block = FAT_EOC;
+    dir->num_blocks = 0;
+}
+
+//write an Entry to its slot of the inode table
+int write_entry(Volume* vol, const Entry* dir){
+    if (vol == NULL || dir == NULL) return -1; //invalid parameters
+    //the entry contains its own inode number
+    Entry* slot = get_entry_mut(vol, dir->ino);
+    if (slot == NULL) return -1; //out of bounds
+    memcpy(slot, dir, sizeof(Entry));
+    mark_entry_dirty(vol, dir->ino);
+    return 0;
 }
 
 //read an Entry from disk into the provided Entry structure
-Entry* read_directory(void *disk_mem, Entry* dir, size_t block_size, size_t disk_size_bytes){
-    if (disk_mem == NULL || dir == NULL) return NULL; //invalid parameters
-    uint32_t block_index = dir->current_block;
-    if (block_index * block_size >= disk_size_bytes) return NULL; //out of bounds
-    char buffer[block_size];
-    int res = read_block(disk_mem, block_index, buffer, block_size, disk_size_bytes);
-    if (res != 0) return NULL;
-    memcpy(dir, buffer, sizeof(Entry));
+Entry* read_directory(const Volume* vol, Entry* dir){
+    if (vol == NULL || dir == NULL) return NULL; //invalid parameters
+    const Entry* stored = get_entry(vol, dir->ino);
+    if (stored == NULL) return NULL; //out of bounds
+    memcpy(dir, stored, sizeof(Entry));
     return dir;
 }
 
-//read an Entry from disk given its block index
-Entry* read_directory_from_block(void *disk_mem, uint32_t block_index, size_t block_size, size_t disk_size_bytes){
-    if (disk_mem == NULL) return NULL; //invalid parameters
-    if (block_index * block_size >= disk_size_bytes) return NULL; //out of bounds
-    char buffer[block_size];
-    int res = read_block(disk_mem, block_index, buffer, block_size, disk_size_bytes);
-    if (res != 0) return NULL;
+//borrow a read-only view of the Entry of inode ino, NULL if out of bounds
+const Entry* get_entry(const Volume* vol, uint32_t ino){
+    //the table may grow under readers, never shrink
+    if (vol == NULL || ino == 0 || ino >= __atomic_load_n(&vol->info.inode_count, __ATOMIC_ACQUIRE)) return NULL; //invalid parameters
+    const Entry* records = get_block(&vol->disk, inode_block(vol, ino));
+    if (records == NULL) return NULL;
+    return &records[ino & (INODES_PER_BLOCK(&vol->disk) - 1)];
+}
+
+//borrow a writable view of the Entry of inode ino, call mark_entry_dirty after modifying it
+Entry* get_entry_mut(Volume* vol, uint32_t ino){
+    if (vol == NULL || ino == 0 || ino >= __atomic_load_n(&vol->info.inode_count, __ATOMIC_ACQUIRE)) return NULL; //invalid parameters
+    Entry* records = get_block_mut(&vol->disk, inode_block(vol, ino));
+    if (records == NULL) return NULL;
+    return &records[ino & (INODES_PER_BLOCK(&vol->disk) - 1)];
+}
+
+//record that the Entry of inode ino was modified
+void mark_entry_dirty(Volume* vol, uint32_t ino){
+    mark_meta_dirty(vol, inode_block(vol, ino));
+}
+
+//read an Entry from disk given its inode number (heap copy, caller frees)
+Entry* read_directory_from_block(const Volume* vol, uint32_t ino){
+    const Entry* stored = get_entry(vol, ino);
+    if (stored == NULL) return NULL; //invalid parameters or out of bounds
     Entry* dir = malloc(sizeof(Entry));
     if (dir == NULL) return NULL;
-    memcpy(dir, buffer, sizeof(Entry));
+    memcpy(dir, stored, sizeof(Entry));
     return dir;
 }
 
@@ -54,56 +146,25 @@ Entry* read_directory_from_block(void *disk_mem, uint32_t block_index, size_t bl
 void print_directory(const Entry* dir){
     printf("Directory: %s\n", dir->name);
     printf("Type: %s\n", dir->type == ENTRY_TYPE_DIR ? "Directory" : "File");
-    printf("Size: %u\n", dir->size);
-    printf("Parent Block: %s\n", dir->parent_block == FAT_EOF ? "None" : "");
-    printf("Current Block: %u\n", dir->current_block);
-    //only for directories, print the indexes of children blocks
-    if (dir->type == ENTRY_TYPE_DIR) {
-        printf("Directory Blocks: ");
-        int has_child = 0;
-        for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-            if (dir->dir_blocks[i] != 0) {
-                printf("%u ", dir->dir_blocks[i]);
-                has_child = 1;
-            }
-        }
-        if (has_child) {
-            printf("-\n");
-        } else {
-            printf("No directory blocks.\n");
-        }
-    }
-}
-
-//update the children of a directory by adding a new child's starting block
-void update_directory_children(Entry* dir, uint32_t child_start_block){
-    //scan the dir_blocks array for the first 0 entry and then add the new child's start block there
-    if (dir == NULL) return;
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (dir->dir_blocks[i] == 0) {
-            dir->dir_blocks[i] = child_start_block;
-            return;
-        }
-    }
-    //directory is full
-    printf("Directory is full, cannot add more children.\n");
+    printf("Size: %" PRIu64 "\n", dir->size);
+    printf("Parent Inode: %s\n", dir->parent_ino == FAT_EOF ? "None" : "");
+    printf("Inode: %u\n", dir->ino);
+    printf("Start Block: %u\n", dir->start_block);
+    printf("Blocks: %u (last: %u)\n", dir->num_blocks, dir->tail_block);
+    //only for directories, print the number of children
+    if (dir->type == ENTRY_TYPE_DIR) printf("Children: %u\n", dir->num_children);
 }
 
-//get the array of children blocks from a directory
-uint32_t* get_children_blocks(const Entry* dir) {
-    return (uint32_t*)dir->dir_blocks;
-}
-
-//constructs the current path as a string by traversing up the directory tree from the given cursor block.
-void get_current_path(char* disk_mem, uint32_t cursor, size_t block_size, size_t disk_size_bytes, char* out_path, size_t max_len) {
+//constructs the current path as a string by traversing up the directory tree from the given cursor inode.
+void get_current_path(const Volume* vol, uint32_t cursor, char* out_path, size_t max_len) {
     //out_path has to be already allocated, max_len is the maximum size
-    char temp[MAX_NAME_LEN * MAX_DIR_ENTRIES] = {0};
+    char temp[MAX_PATH_LEN] = {0};
     int pos = sizeof(temp) - 1;
     temp[pos] = '\0';
-    uint32_t block = cursor;
+    uint32_t ino = cursor;
     //traverse up to root
-    while (block != FAT_EOF) {
-        Entry* dir = read_directory_from_block(disk_mem, block, block_size, disk_size_bytes);
+    while (ino != FAT_EOF) {
+        const Entry* dir = get_entry(vol, ino);
         if (dir == NULL) break;
         size_t name_len = strlen(dir->name);
         if (strcmp(dir->name, "/") != 0 && name_len > 0) {
@@ -114,8 +175,7 @@ void get_current_path(char* disk_mem, uint32_t cursor, size_t block_size, size_t
             if (pos < 0) break;
             temp[pos] = '/';
         }
-        block = dir->parent_block;
-        free(dir);
+        ino = dir->parent_ino;
     }
     //copy the result to out_path
     if (pos < 0) pos = 0;
@@ -128,12 +188,84 @@ void get_current_path(char* disk_mem, uint32_t cursor, size_t block_size, size_t
     }
 }
 
+//append a block to the data chain of an entry in O(1) through its tail, FAT_EOF if the disk is full
+uint32_t append_entry_block(Volume* vol, Entry* entry){
+    uint32_t got;
+    return append_entry_blocks(vol, entry, 1, &got);
+}
+
+//append up to n blocks, contiguous when possible, to the data chain of an entry through its tail;
+//returns the first new block and stores how many were added in got, FAT_EOF if the disk is full
+uint32_t append_entry_blocks(Volume* vol, Entry* entry, uint32_t n, uint32_t* got){
+    uint32_t block;
+    if (entry->start_block == FAT_EOC) {
+        block = allocate_blocks(vol, n, ALLOC_HINT_NEXT, got);
+        if (block == FAT_EOF) return FAT_EOF;
+        entry->start_block = block;
+    } else {
+        block = append_blocks_to_chain(vol, entry->tail_block, n, got);
+        if (block == FAT_EOF) return FAT_EOF;
+    }
+    //the run is chained in order, so its last block is the new tail
+    entry->tail_block = block + *got - 1;
+    entry->num_blocks += *got;
+    mark_entry_dirty(vol, entry->ino);
+    return block;
+}
+
+//give back blocks from the head of the data chain of an entry changing at most fat_blocks FAT blocks,
+//the rest stays its chain
+int release_entry_head(Volume* vol, Entry* entry, uint32_t fat_blocks){
+    if (entry == NULL) return -1; //the record could not be read
+    int res = 0;
+    uint32_t freed = 0, rest = FAT_EOC;
+    //logged directory blocks may come back as file data, which the journal must not replay over
+    if (entry->type == ENTRY_TYPE_DIR && entry->start_block != FAT_EOC) journal_request_checkpoint(&vol->journal);
+    if (entry->start_block != FAT_EOC) res = deallocate_chain_head(vol, entry->start_block, fat_blocks, &freed, &rest);
+    if (rest == FAT_EOC) {
+        entry->start_block = FAT_EOC;
+        entry->tail_block = FAT_EOC;
+        entry->num_blocks = 0;
+    } else {
+        entry->start_block = rest;
+        entry->num_blocks -= freed;
+    }
+    mark_entry_dirty(vol, entry->ino);
+    return res;
+}
+
+//give back every block of the data chain of an entry
+int release_entry_blocks(Volume* vol, Entry* entry){
+    return release_entry_head(vol, entry, UINT32_MAX);
+}
+
+//true if the file contents are stored inline in the record
+bool has_inline_data(const Entry* file){
+    //small files keep their data in the record until they outgrow it
+    return file->type == ENTRY_TYPE_FILE && file->start_block == FAT_EOC;
+}
+
 //initialize a file
-void init_file(Entry* file, const char* name, uint32_t start_block){
+void init_file(Entry* file, const char* name, uint32_t ino){
+    memset(file, 0, sizeof(Entry));
     strncpy(file->name, name, MAX_NAME_LEN);
     file->type = ENTRY_TYPE_FILE;
     file->size = 0; //initially empty
-    memset(file->dir_blocks, 0, sizeof(file->dir_blocks));
-    file->parent_block = FAT_EOF; //no parent initially
-    file->current_block = start_block;
-}
\ No newline at end of file
+    file->num_children = 0;
+    file->parent_ino = FAT_EOF; //no parent initially
+    file->ino = ino;
+    file->start_block = FAT_EOC; //no data yet
+    file->tail_block = FAT_EOC;
+    file->num_blocks = 0;
+}
+
+//find a child of a directory by name and type through the dentry cache, FAT_EOF if not found
+uint32_t lookup_child(Volume* vol, uint32_t parent_ino, const char* name, uint8_t type){
+    uint32_t ino = dcache_lookup(&vol->dcache, parent_ino, name, type);
+    if (ino != FAT_EOF) return ino;
+    //miss: one hashed lookup in the directory index, then remember the result
+    const Dirent* d = find_dirent(vol, parent_ino, name, type);
+    if (d == NULL) return FAT_EOF;
+    dcache_insert(&vol->dcache, parent_ino, name, type, d->ino);
+    return d->ino;
+}
@@ -6,40 +6,90 @@
 
 #define ENTRY_TYPE_FILE 0
 #define ENTRY_TYPE_DIR  1
-#define MAX_DIR_ENTRIES 32
+#define MAX_PATH_LEN    1024
 
+#define INODE_SIZE        128                       //bytes per Entry record in the inode table
+#define INODE_SHIFT       7                         //log2 of INODE_SIZE
+#define INODES_PER_BLOCK(disk)  ((disk)->block_size / INODE_SIZE)
+#define INODE_BLOCK_SHIFT(disk) ((disk)->block_shift - INODE_SHIFT) //inode number to table block, by shift
+#define ROOT_INO          1                         //inode 0 is never used, so 0 marks a free dirent
+#define INODE_DENSE_BLOCKS 16384                    //disks up to this many blocks get one inode per block
+#define INLINE_DATA_SIZE  (INODE_SIZE - 72)         //bytes of file data stored in the record itself, after the header
+
+//Entry records are packed in the inode table and addressed by inode number
 typedef struct {
     char name[MAX_NAME_LEN];
     uint8_t type;                           //entries can be ENTRY_TYPE_FILE or ENTRY_TYPE_DIR
-    uint32_t size;                          //size of the entry
-    uint32_t dir_blocks[MAX_DIR_ENTRIES];   //if it's a directory, the array contains the starting blocks of contained files/dirs
-    uint32_t parent_block;                  //parent directory block, EOF for root
-    uint32_t current_block;                 //starting block
+    uint64_t size;                          //size of the entry
+    uint32_t num_children;                  //if it's a directory, number of contained files/dirs
+    uint32_t parent_ino;                    //parent directory inode, EOF for root
+    uint32_t ino;                           //inode number, 0 for a free record
+    uint32_t start_block;                   //first block of the data (file contents or directory index), EOC if none
+    uint32_t tail_block;                    //last block of the data chain, EOC if none
+    uint32_t num_blocks;                    //number of blocks in the data chain
+    char data[INLINE_DATA_SIZE];            //contents of a file that has no data blocks yet
 } Entry;
 
+_Static_assert(sizeof(Entry) == INODE_SIZE && INODE_SIZE == 1 << INODE_SHIFT, "Entry must fill exactly one inode slot");
+
+//number of blocks of the inode table for a disk (one inode per block, one per 4 blocks past INODE_DENSE_BLOCKS)
+uint32_t calc_inode_blocks(size_t disk_size, size_t block_size);
+
+//rebuild the in-memory map of used inodes by scanning the inode table
+int scan_inode_table(Volume* vol);
+
+//reserve a free inode, FAT_EOF if the table is full
+uint32_t allocate_inode(Volume* vol);
+
+//clear an inode record and give it back to the table
+void free_inode(Volume* vol, uint32_t ino);
+
 //initialize an Entry structure
-void init_directory(Entry* dir, const char* name, uint32_t start_block);
+void init_directory(Entry* dir, const char* name, uint32_t ino);
 
-//write an Entry to disk
-int write_entry(void *disk_mem, const Entry* dir, size_t block_size, size_t disk_size_bytes);
+//write an Entry to its slot of the inode table
+int write_entry(Volume* vol, const Entry* dir);
 
 //read an Entry from disk into the provided Entry structure
-Entry* read_directory(void *disk_mem, Entry* dir, size_t block_size, size_t disk_size_bytes);
+Entry* read_directory(const Volume* vol, Entry* dir);
+
+//borrow a read-only view of the Entry of inode ino, NULL if out of bounds
+const Entry* get_entry(const Volume* vol, uint32_t ino);
+
+//borrow a writable view of the Entry of inode ino, call mark_entry_dirty after modifying it
+Entry* get_entry_mut(Volume* vol, uint32_t ino);
 
-//read an Entry from disk given its block index
-Entry* read_directory_from_block(void *disk_mem, uint32_t block_index, size_t block_size, size_t disk_size_bytes);
+//record that the Entry of inode ino was modified
+void mark_entry_dirty(Volume* vol, uint32_t ino);
+
+//read an Entry from disk given its inode number (heap copy, caller frees)
+Entry* read_directory_from_block(const Volume* vol, uint32_t ino);
 
 //print the contents of an Entry
 void print_directory(const Entry* dir);
 
-//update the children of a directory by adding a new child's starting block
-void update_directory_children(Entry* dir, uint32_t child_start_block);
+//get the current path as a string by traversing up to the root
+void get_current_path(const Volume* vol, uint32_t cursor, char* out_path, size_t max_len);
+
+//append up to n blocks, contiguous when possible, to the data chain of an entry through its tail;
+//returns the first new block and stores how many were added in got, FAT_EOF if the disk is full
+uint32_t append_entry_blocks(Volume* vol, Entry* entry, uint32_t n, uint32_t* got);
 
-//get the array of children blocks from a directory
-uint32_t* get_children_blocks(const Entry* dir);
+//append a block to the data chain of an entry in O(1) through its tail, FAT_EOF if the disk is full
+uint32_t append_entry_block(Volume* vol, Entry* entry);
 
-//get the current path as a string by traversing up to the root
-void get_current_path(char* disk_mem, uint32_t cursor, size_t block_size, size_t disk_size_bytes, char* out_path, size_t max_len);
+//give back blocks from the head of the data chain of an entry changing at most fat_blocks FAT blocks,
+//the rest stays its chain
+int release_entry_head(Volume* vol, Entry* entry, uint32_t fat_blocks);
+
+//give back every block of the data chain of an entry
+int release_entry_blocks(Volume* vol, Entry* entry);
+
+//true if the file contents are stored inline in the record
+bool has_inline_data(const Entry* file);
 
 //initialize a file
-void init_file(Entry* file, const char* name, uint32_t start_block);
\ No newline at end of file
+void init_file(Entry* file, const char* name, uint32_t ino);
+
+//find a child of a directory by name and type through the dentry cache, FAT_EOF if not found
+uint32_t lookup_child(Volume* vol, uint32_t parent_ino, const char* name, uint8_t type);
@@ -0,0 +1,24 @@
+#pragma once
+
+//error codes returned by the library, always negative. -1 stays the generic failure of the
+//low level helpers, so their results can be passed through unchanged.
+#define FS_OK                 0
+#define FS_ERR_IO            -1     //disk file could not be opened, mapped, read or written
+#define FS_ERR_NO_MEMORY     -2     //host allocation failed
+#define FS_ERR_NOT_FOUND     -3     //no entry with that name
+#define FS_ERR_EXISTS        -4     //an entry with that name already exists
+#define FS_ERR_NO_SPACE      -5     //no free blocks
+#define FS_ERR_NO_INODES     -6     //inode table full
+#define FS_ERR_NAME_TOO_LONG -7     //name does not fit MAX_NAME_LEN
+#define FS_ERR_NOT_EMPTY     -8     //directory still has children
+#define FS_ERR_DIR_FULL      -9     //directory index cannot grow any more
+#define FS_ERR_BUSY          -10    //file is open
+#define FS_ERR_TOO_MANY_OPEN -11    //open-file table full
+#define FS_ERR_OLD_FORMAT    -12    //image written before format versioning, convert it first
+#define FS_ERR_VERSION       -13    //image written in another format version
+#define FS_ERR_CORRUPT       -14    //broken chain or record
+#define FS_ERR_INVALID       -15    //bad argument or handle
+#define FS_ERR_TOO_LARGE     -16    //file would exceed the maximum size
+
+//message describing an error code
+const char* fs_strerror(int err);
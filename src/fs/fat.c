@@ -1,36 +1,14 @@
 #include "fat.h"
 
-//write metainfo to disk
-int write_metainfo(char* disk_mem, const DiskInfo *info, size_t block_size, size_t disk_size_bytes) {
-    char buffer[block_size];
-    memset(buffer, 0, block_size);
-    memcpy(buffer, info, sizeof(DiskInfo));
-    uint32_t index = 0; //metainfo is always at block 0
-    return write_block(disk_mem, index, buffer, block_size, disk_size_bytes);
-}
-
 //read metainfo from disk
-int read_metainfo(char* disk_mem, DiskInfo *info, size_t block_size, size_t disk_size_bytes) {
-    char buffer[block_size];
+int read_metainfo(const Disk* disk, DiskInfo *info) {
     uint32_t index = 0; //metainfo is always at block 0
-    int res = read_block(disk_mem, index, buffer, block_size, disk_size_bytes);
-    if (res != 0) return res;
-    memcpy(info, buffer, sizeof(DiskInfo));
+    const char* block = get_block(disk, index);
+    if (block == NULL) return -1;
+    memcpy(info, block, sizeof(DiskInfo));
     return 0;
 }
 
-//initialize FAT struct
-void init_fat(uint32_t* fat, uint32_t num_entries) {
-    for (uint32_t i = 0; i < num_entries; i++) {
-        //mark the end of the FAT with EOF
-        if (i == num_entries - 1) {
-            fat[i] = FAT_EOF;
-            continue;
-        }
-        fat[i] = i + 1;
-    }
-}
-
 //print FAT entries
 void print_fat(const uint32_t* fat, uint32_t num_entries) {
     for (uint32_t i = 0; i < num_entries; i++) {
@@ -44,118 +22,281 @@ void print_fat(const uint32_t* fat, uint32_t num_entries) {
             printf("FAT[%u] = EOC\n", i);
             continue;
         }
+        if (fat[i] == FAT_FREE) {
+            printf("FAT[%u] = FREE\n", i);
+            continue;
+        }
         else printf("FAT[%u] = %u\n", i, fat[i]);
     }
 }
 
-//load metainfo and FAT from disk into RAM
-void read_info_and_fat(char* disk_mem, DiskInfo* info, uint32_t* fat, size_t disk_size) {
-    //read metainfo
-    int res = read_metainfo(disk_mem, info, BLOCK_SIZE, disk_size);
-    if (res != 0) handle_error("Failed to read metainfo");
-    //read fat
-    uint32_t num_fat_entries = disk_size / BLOCK_SIZE;
-    uint32_t fat_index = 1; // FAT starts at block 1
-    res = read_fat(disk_mem, fat, num_fat_entries, fat_index, BLOCK_SIZE, disk_size);
-    if (res != 0) handle_error("Failed to read FAT");
-}
-
-//update FAT and metainfo on disk
-int write_info_and_fat(char* disk_mem, uint32_t *fat, uint32_t num_fat_entries, uint32_t fat_start_block, DiskInfo *info, size_t block_size, size_t disk_size_bytes) {
-    //this function calls both write_fat and write_metainfo
-    int res = write_fat(disk_mem, fat, num_fat_entries, fat_start_block, block_size, disk_size_bytes);
-    if (res != 0) return res;
-    return write_metainfo(disk_mem, info, block_size, disk_size_bytes);
-}
-
-//write FAT to disk
-int write_fat(char* disk_mem, const uint32_t *fat, uint32_t num_fat_entries, uint32_t start_block, size_t block_size, size_t disk_size_bytes) {
+//read FAT from disk
+int read_fat(const Disk* disk, uint32_t *fat, uint32_t num_fat_entries, uint32_t start_block) {
     //compute how many blocks are reserved for FAT
-    uint32_t fat_bytes = num_fat_entries * sizeof(uint32_t);
-    uint32_t fat_blocks = (fat_bytes + block_size - 1) / block_size;
-    //write each block of FAT to disk
+    size_t fat_bytes = (size_t)num_fat_entries * sizeof(uint32_t);
+    uint32_t fat_blocks = (fat_bytes + disk->block_size - 1) >> disk->block_shift;
+    //read each block of FAT from disk
     for (uint32_t i = 0; i < fat_blocks; i++) {
-        char buffer[block_size];
-        memset(buffer, 0, block_size);
-        size_t offset = i * block_size;
-        size_t bytes_to_copy = block_size;
+        const char* block = get_block(disk, start_block + i);
+        if (block == NULL) return -1;
+        size_t offset = (size_t)i << disk->block_shift;
+        size_t bytes_to_copy = disk->block_size;
         if (offset + bytes_to_copy > fat_bytes)
             bytes_to_copy = fat_bytes - offset;
-        memcpy(buffer, ((char*)fat) + offset, bytes_to_copy);
-        int res = write_block(disk_mem, start_block + i, buffer, block_size, disk_size_bytes);
-        if (res != 0) return res;
+        memcpy(((char*)fat) + offset, block, bytes_to_copy);
     }
     return 0;
 }
 
-//read FAT from disk
-int read_fat(char* disk_mem, uint32_t *fat, uint32_t num_fat_entries, uint32_t start_block, size_t block_size, size_t disk_size_bytes) {
-    //compute how many blocks are reserved for FAT
-    uint32_t fat_bytes = num_fat_entries * sizeof(uint32_t);
-    uint32_t fat_blocks = (fat_bytes + block_size - 1) / block_size;
-    //read each block of FAT from disk
-    for (uint32_t i = 0; i < fat_blocks; i++) {
-        char buffer[block_size];
-        int res = read_block(disk_mem, start_block + i, buffer, block_size, disk_size_bytes);
-        if (res != 0) return res;
-        size_t offset = i * block_size;
-        size_t bytes_to_copy = block_size;
-        if (offset + bytes_to_copy > fat_bytes)
-            bytes_to_copy = fat_bytes - offset;
-        memcpy(((char*)fat) + offset, buffer, bytes_to_copy);
+//mark a block in the free-space bitmap
+static void set_block_used(Volume* vol, uint32_t block, bool used) {
+    if (used) vol->block_map[block / 8] |= 1u << (block % 8);
+    else vol->block_map[block / 8] &= ~(1u << (block % 8));
+}
+
+//rebuild the in-memory free-space bitmap and the group counters from the FAT
+int build_block_map(Volume* vol) {
+    //groups start on a byte of the bitmap, so each one is mapped and counted by a single vector pass
+    //that rewrites all of its bytes
+    for (uint32_t i = 0; i < vol->num_groups; i++) {
+        AllocGroup* g = &vol->groups[i];
+        uint32_t used = fat_mark_used(vol->fat + g->start, g->end - g->start, vol->block_map + g->start / 8);
+        g->free_blocks = g->end - g->start - used;
     }
     return 0;
 }
 
-//get the index of the first free block from metainfo
-uint32_t get_list_head(const DiskInfo* info) {
-    return info->free_list_head;
-}
-
-//allocate a block from the free list and update metainfo and FAT
-uint32_t allocate_block(uint32_t* fat, DiskInfo* info) {
-    //this function updates both FAT and metainfo
-    uint32_t freeListHead = get_list_head(info);
-    uint32_t free_blocks = info->free_blocks;
-    if (free_blocks == 0) return FAT_EOF;     //no free blocks available
-    uint32_t allocatedBlock = freeListHead;
-    freeListHead = fat[allocatedBlock];       //new free list head
-    fat[allocatedBlock] = FAT_EOC;            //mark block as end of chain
-    info->free_list_head = freeListHead;
-    info->free_blocks--;
-    return allocatedBlock;
-}
-
-//append a new block to the end of a file's block chain
-uint32_t append_block_to_chain(uint32_t* fat, DiskInfo* info, uint32_t chainHead) {
-    //allocate a new block from the free list
-    uint32_t freeListHead = get_list_head(info);
-    if (freeListHead == FAT_EOF) return FAT_EOF; //no free blocks available
-    uint32_t newBlock = freeListHead;
-    freeListHead = fat[newBlock];
-    fat[newBlock] = FAT_EOC;
-    //find the last block in chain
-    uint32_t cur = chainHead;
-    while (fat[cur] != FAT_EOC) cur = fat[cur];
-    //link the last block to the new block
-    fat[cur] = newBlock;
-    info->free_list_head = freeListHead;
-    info->free_blocks--;
+//true if the block is not part of any chain
+bool block_is_free(const Volume* vol, uint32_t block) {
+    return !((vol->block_map[block / 8] >> (block % 8)) & 1);
+}
+
+//punch the free blocks of [from, to) out of the disk file in maximal runs, adding the blocks punched to discarded;
+//nothing may be allocated meanwhile
+int discard_free_blocks(Volume* vol, uint32_t from, uint32_t to, uint64_t* discarded) {
+    int res = 0;
+    uint32_t b = from;
+    while (b < to) {
+        if (b % 8 == 0 && b + 8 <= to && vol->block_map[b / 8] == 0xFF) {
+            b += 8;
+            continue;
+        }
+        if (!block_is_free(vol, b)) {
+            b++;
+            continue;
+        }
+        //free space is mostly whole bytes of the bitmap
+        uint32_t start = b;
+        while (b < to) {
+            if (b % 8 == 0 && b + 8 <= to && vol->block_map[b / 8] == 0) b += 8;
+            else if (block_is_free(vol, b)) b++;
+            else break;
+        }
+        if (discard_blocks(&vol->disk, start, b - start) != 0) res = -1;
+        else *discarded += b - start;
+    }
+    return res;
+}
+
+//find the first free run of n blocks in [from, to), remembering the longest shorter run seen
+static uint32_t find_free_run(const Volume* vol, uint32_t from, uint32_t to, uint32_t n, uint32_t* best_start, uint32_t* best_len) {
+    uint32_t b = from;
+    while (b < to) {
+        //skip fully used bytes of the bitmap eight blocks at a time
+        if (b % 8 == 0 && b + 8 <= to && vol->block_map[b / 8] == 0xFF) {
+            b += 8;
+            continue;
+        }
+        if (!block_is_free(vol, b)) {
+            b++;
+            continue;
+        }
+        uint32_t start = b;
+        while (b < to && b - start < n && block_is_free(vol, b)) b++;
+        uint32_t len = b - start;
+        if (len == n) return start;
+        if (len > *best_len) {
+            *best_start = start;
+            *best_len = len;
+        }
+    }
+    return FAT_EOF;
+}
+
+//home group of the calling thread + 1, 0 until the thread first allocates
+static __thread uint32_t thread_group;
+
+//group new chains are allocated from: per thread in threaded mode, else the group of the last allocation
+static uint32_t home_group(Volume* vol) {
+    if (!vol->threaded) return vol->last_group;
+    //threads are spread over the groups round robin the first time they allocate
+    if (thread_group == 0 || thread_group > vol->num_groups)
+        thread_group = __atomic_fetch_add(&vol->next_group, 1, __ATOMIC_RELAXED) % vol->num_groups + 1;
+    return thread_group - 1;
+}
+
+//allocate a run of n blocks in a locked group, searching from hint and wrapping around inside the group;
+//with no such run takes the longest one if it has at least min_len blocks. On failure returns FAT_EOF
+//and stores the longest run seen in got
+static uint32_t allocate_in_group(Volume* vol, uint32_t group, uint32_t n, uint32_t hint, uint32_t min_len, uint32_t* got) {
+    AllocGroup* g = &vol->groups[group];
+    *got = 0;
+    if (g->free_blocks < min_len) return FAT_EOF;
+    if (hint < g->start || hint >= g->end) hint = g->hint;
+    if (hint < g->start || hint >= g->end) hint = g->start;
+    //look for a whole run after the hint, then before it, else settle for the longest run seen
+    uint32_t best_start = FAT_EOF, best_len = 0;
+    uint32_t start = find_free_run(vol, hint, g->end, n, &best_start, &best_len);
+    if (start == FAT_EOF) start = find_free_run(vol, g->start, hint, n, &best_start, &best_len);
+    uint32_t len = n;
+    if (start == FAT_EOF) {
+        start = best_start;
+        len = best_len;
+    }
+    if (start == FAT_EOF || len < min_len) {
+        *got = best_len;
+        return FAT_EOF;
+    }
+    //chain the run in order, the last block ends the chain
+    for (uint32_t i = 0; i < len; i++) {
+        set_block_used(vol, start + i, true);
+        set_fat_entry(vol, start + i, i + 1 < len ? start + i + 1 : FAT_EOC);
+    }
+    //the counter is also read without the lock to skip full groups
+    __atomic_store_n(&g->free_blocks, g->free_blocks - len, __ATOMIC_RELAXED);
+    g->hint = start + len;
+    __atomic_store_n(&vol->last_group, group, __ATOMIC_RELAXED);
+    if (vol->threaded) thread_group = group + 1;
+    mark_info_dirty(vol);
+    *got = len;
+    return start;
+}
+
+//try the group of the hint first, then every group from the caller's home group on; returns the group
+//that holds the run, FAT_EOF if none had a run of min_len blocks. longest gets the group with the longest run seen
+static uint32_t allocate_from_groups(Volume* vol, uint32_t n, uint32_t hint, uint32_t min_len, uint32_t first, uint32_t* start, uint32_t* got, uint32_t* longest) {
+    uint32_t home = home_group(vol);
+    uint32_t best_len = 0;
+    for (uint32_t i = 0; i <= vol->num_groups; i++) {
+        //slot 0 is the first group, the rest walk all groups from home skipping it
+        uint32_t group = i == 0 ? first : (home + i - 1) % vol->num_groups;
+        if (i > 0 && group == first) continue;
+        if (__atomic_load_n(&vol->groups[group].free_blocks, __ATOMIC_RELAXED) < min_len) continue;
+        lock_group(vol, group);
+        *start = allocate_in_group(vol, group, n, group == first ? hint : FAT_EOF, min_len, got);
+        unlock_group(vol, group);
+        if (*start != FAT_EOF) return group;
+        if (*got > best_len) {
+            best_len = *got;
+            *longest = group;
+        }
+    }
+    *got = 0;
+    return FAT_EOF;
+}
+
+//allocate up to n contiguous blocks chained in order, preferring a run at or after hint;
+//returns the first block and stores the run length in got, FAT_EOF if the disk is full
+uint32_t allocate_blocks(Volume* vol, uint32_t n, uint32_t hint, uint32_t* got) {
+    *got = 0;
+    if (n == 0) return FAT_EOF;
+    //a run never crosses a group, so it only takes that group's lock
+    if (n > ALLOC_GROUP_BLOCKS(vol)) n = ALLOC_GROUP_BLOCKS(vol);
+    uint32_t first = hint < vol->num_fat_entries ? GROUP_OF(vol, hint) : home_group(vol);
+    uint32_t start, longest = first;
+    if (allocate_from_groups(vol, n, hint, n, first, &start, got, &longest) != FAT_EOF) return start;
+    //no group has a whole run: take the longest piece, starting from the group that had it
+    if (allocate_from_groups(vol, n, FAT_EOF, 1, longest, &start, got, &longest) != FAT_EOF) return start;
+    return FAT_EOF;
+}
+
+//mark n blocks from start used as a single chain (format and grow, before anything is allocated there)
+int reserve_blocks(Volume* vol, uint32_t start, uint32_t n) {
+    if (n == 0 || start > vol->num_fat_entries || n > vol->num_fat_entries - start) return -1;
+    for (uint32_t i = start; i < start + n; i++) {
+        set_block_used(vol, i, true);
+        set_fat_entry(vol, i, i + 1 < start + n ? i + 1 : FAT_EOC);
+        vol->groups[GROUP_OF(vol, i)].free_blocks--;
+    }
+    //allocations continue right after the reserved area
+    uint32_t end = start + n;
+    vol->last_group = GROUP_OF(vol, end) < vol->num_groups ? GROUP_OF(vol, end) : 0;
+    vol->groups[vol->last_group].hint = end;
+    mark_info_dirty(vol);
+    return 0;
+}
+
+//allocate up to n blocks right after the last block of a chain and link them, returns the first new block
+uint32_t append_blocks_to_chain(Volume* vol, uint32_t chainTail, uint32_t n, uint32_t* got) {
+    //the block following the tail is the best place to keep the chain contiguous
+    uint32_t newBlock = allocate_blocks(vol, n, chainTail + 1, got);
+    if (newBlock == FAT_EOF) return FAT_EOF;
+    //callers keep track of the tail, so no walk through the chain is needed; its FAT entry belongs to its group
+    uint32_t group = GROUP_OF(vol, chainTail);
+    lock_group(vol, group);
+    set_fat_entry(vol, chainTail, newBlock);
+    unlock_group(vol, group);
     return newBlock;
 }
 
-//deallocate a chain of blocks starting from 'start'
-int deallocate_chain(uint32_t* fat, DiskInfo* info, uint32_t start) {
+//deallocate blocks from the head of a chain starting from 'start', stopping where one more FAT block would be
+//changed than fat_blocks (a block the chain comes back to counts again); stores how many were freed in freed and
+//the block the rest of the chain starts at in rest (FAT_EOC once the whole chain is free, or if it is broken)
+int deallocate_chain_head(Volume* vol, uint32_t start, uint32_t fat_blocks, uint32_t* freed, uint32_t* rest) {
     uint32_t block = start;
-    uint32_t freeListHead = get_list_head(info);
+    uint32_t locked = FAT_EOF;
+    uint32_t run_start = 0, run_len = 0;   //contiguous blocks freed so far, queued for discard together
+    uint32_t changed = 0;
+    int res = 0;
+    *freed = 0;
     while (block != FAT_EOC) {
-        uint32_t next = fat[block];
-        fat[block] = freeListHead;   //concatenate to free list
-        freeListHead = block;        //new head of free list
-        info->free_blocks++;
-        if (next == FAT_EOC) break;
+        if (block >= vol->num_fat_entries) { //broken chain
+            res = -1;
+            break;
+        }
+        //only the group of the current block is held, switching as the chain crosses groups
+        uint32_t group = GROUP_OF(vol, block);
+        if (group != locked) {
+            if (changed == fat_blocks) break;
+            changed++;
+            if (locked != FAT_EOF) unlock_group(vol, locked);
+            lock_group(vol, group);
+            locked = group;
+        }
+        if (block_is_free(vol, block)) { //broken chain
+            res = -1;
+            break;
+        }
+        AllocGroup* g = &vol->groups[group];
+        uint32_t next = vol->fat[block];
+        set_fat_entry(vol, block, FAT_FREE);
+        set_block_used(vol, block, false);
+        __atomic_store_n(&g->free_blocks, g->free_blocks + 1, __ATOMIC_RELAXED);
+        if (run_len > 0 && run_start + run_len == block) run_len++;
+        else {
+            discard_add(&vol->discard, run_start, run_len);
+            run_start = block;
+            run_len = 1;
+        }
+        (*freed)++;
         block = next;
     }
-    info->free_list_head = freeListHead;
-    return 0;
-}
\ No newline at end of file
+    if (locked != FAT_EOF) unlock_group(vol, locked);
+    discard_add(&vol->discard, run_start, run_len);
+    mark_info_dirty(vol);
+    *rest = res == 0 ? block : FAT_EOC;
+    return res;
+}
+
+//deallocate a chain of blocks starting from 'start'
+int deallocate_chain(Volume* vol, uint32_t start) {
+    uint32_t freed, rest;
+    return deallocate_chain_head(vol, start, UINT32_MAX, &freed, &rest);
+}
+
+//free blocks on the whole volume
+size_t count_free_blocks(const Volume* vol) {
+    size_t total = 0;
+    for (uint32_t i = 0; i < vol->num_groups; i++) total += __atomic_load_n(&vol->groups[i].free_blocks, __ATOMIC_RELAXED);
+    return total;
+}
@@ -1,43 +1,53 @@
 #pragma once
 
 #include "disk.h"
+#include "volume.h"
+#include "fatscan.h"
 #include "../utils/utils.h"
 
 #define FAT_EOC 0xFFFFFFFF  //marks last block of a file
 #define FAT_EOF 0xFFFFFFFE  //marks end of FAT itself
+#define FAT_FREE 0          //marks a free block (no chain ever links to block 0, the metainfo)
 
-//write metainfo to disk
-int write_metainfo(char* disk_mem, const DiskInfo *info, size_t block_size, size_t disk_size_bytes);
+#define ALLOC_HINT_NEXT FAT_EOF //allocation hint: continue in the allocation group of the caller
 
 //read metainfo from disk
-int read_metainfo(char* disk_mem, DiskInfo *info, size_t block_size, size_t disk_size_bytes);
-
-//initialize FAT struct
-void init_fat(uint32_t* fat, uint32_t num_entries);
+int read_metainfo(const Disk* disk, DiskInfo *info);
 
 //print FAT entries
 void print_fat(const uint32_t* fat, uint32_t num_entries);
 
-//load metainfo and FAT from disk into RAM
-void read_info_and_fat(char* disk_mem, DiskInfo* info, uint32_t* fat, size_t disk_size);
+//read FAT from disk
+int read_fat(const Disk* disk, uint32_t *fat, uint32_t num_fat_entries, uint32_t start_block);
 
-//update FAT and metainfo on disk
-int write_info_and_fat(char* disk_mem, uint32_t *fat, uint32_t num_fat_entries, uint32_t fat_start_block, DiskInfo *info, size_t block_size, size_t disk_size_bytes);
+//rebuild the in-memory free-space bitmap and the group counters from the FAT
+int build_block_map(Volume* vol);
 
-//write FAT to disk
-int write_fat(char* disk_mem, const uint32_t *fat, uint32_t num_fat_entries, uint32_t start_block, size_t block_size, size_t disk_size_bytes);
+//punch the free blocks of [from, to) out of the disk file in maximal runs, adding the blocks punched to discarded;
+//nothing may be allocated meanwhile
+int discard_free_blocks(Volume* vol, uint32_t from, uint32_t to, uint64_t* discarded);
 
-//read FAT from disk
-int read_fat(char* disk_mem, uint32_t *fat, uint32_t num_fat_entries, uint32_t start_block, size_t block_size, size_t disk_size_bytes);
+//true if the block is not part of any chain
+bool block_is_free(const Volume* vol, uint32_t block);
 
-//get the index of the first free block from metainfo
-uint32_t get_list_head(const DiskInfo* info);
+//allocate up to n contiguous blocks chained in order, preferring a run at or after hint (ALLOC_HINT_NEXT:
+//the caller's allocation group); runs never cross a group. Returns the first block and stores the run
+//length in got, FAT_EOF if the disk is full
+uint32_t allocate_blocks(Volume* vol, uint32_t n, uint32_t hint, uint32_t* got);
 
-//allocate a block from the free list and update metainfo and FAT
-uint32_t allocate_block(uint32_t* fat, DiskInfo* info);
+//mark n blocks from start used as a single chain (format and grow, before anything is allocated there)
+int reserve_blocks(Volume* vol, uint32_t start, uint32_t n);
 
-//append a new block to the end of a file's block chain
-uint32_t append_block_to_chain(uint32_t* fat, DiskInfo* info, uint32_t chainHead);
+//allocate up to n blocks right after the last block of a chain and link them, returns the first new block
+uint32_t append_blocks_to_chain(Volume* vol, uint32_t chainTail, uint32_t n, uint32_t* got);
+
+//deallocate blocks from the head of a chain starting from 'start', stopping where one more FAT block would be
+//changed than fat_blocks (a block the chain comes back to counts again); stores how many were freed in freed and
+//the block the rest of the chain starts at in rest (FAT_EOC once the whole chain is free, or if it is broken)
+int deallocate_chain_head(Volume* vol, uint32_t start, uint32_t fat_blocks, uint32_t* freed, uint32_t* rest);
 
 //deallocate a chain of blocks starting from 'start'
-int deallocate_chain(uint32_t* fat, DiskInfo* info, uint32_t start);
\ No newline at end of file
+int deallocate_chain(Volume* vol, uint32_t start);
+
+//free blocks on the whole volume
+size_t count_free_blocks(const Volume* vol);
@@ -0,0 +1,227 @@
+#include "fatscan.h"
+#include "fat.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FAT_SCAN_X86 1
+#include <immintrin.h>
+#else
+#define FAT_SCAN_X86 0
+#endif
+
+//one implementation of every kernel
+typedef struct {
+    void (*fill)(uint32_t* fat, uint32_t n, uint32_t value);
+    uint32_t (*count)(const uint32_t* fat, uint32_t n, uint32_t value);
+    uint32_t (*mark_used)(const uint32_t* fat, uint32_t n, uint8_t* map);
+    uint32_t (*find_orphan)(const uint32_t* fat, const uint32_t* owner, uint32_t n);
+} FatKernels;
+
+//scalar kernels, also used for the entries left over by the vector loops
+
+static void fill_scalar(uint32_t* fat, uint32_t n, uint32_t value) {
+    for (uint32_t i = 0; i < n; i++) fat[i] = value;
+}
+
+static uint32_t count_scalar(const uint32_t* fat, uint32_t n, uint32_t value) {
+    uint32_t found = 0;
+    for (uint32_t i = 0; i < n; i++) found += fat[i] == value;
+    return found;
+}
+
+//entries from `from` on, whole bytes of the map at a time (the last one may be partial)
+static uint32_t mark_used_from(const uint32_t* fat, uint32_t from, uint32_t n, uint8_t* map) {
+    uint32_t used = 0;
+    for (uint32_t i = from; i < n; i += 8) {
+        uint8_t bits = 0;
+        for (uint32_t j = 0; j < 8 && i + j < n; j++) bits |= (uint8_t)(fat[i + j] != FAT_FREE) << j;
+        map[i / 8] = bits;
+        used += __builtin_popcount(bits);
+    }
+    return used;
+}
+
+static uint32_t mark_used_scalar(const uint32_t* fat, uint32_t n, uint8_t* map) {
+    return mark_used_from(fat, 0, n, map);
+}
+
+static uint32_t find_orphan_from(const uint32_t* fat, const uint32_t* owner, uint32_t from, uint32_t n) {
+    for (uint32_t i = from; i < n; i++) {
+        if (fat[i] != FAT_FREE && owner[i] == 0) return i;
+    }
+    return n;
+}
+
+static uint32_t find_orphan_scalar(const uint32_t* fat, const uint32_t* owner, uint32_t n) {
+    return find_orphan_from(fat, owner, 0, n);
+}
+
+#if FAT_SCAN_X86
+
+//SSE2 kernels: four entries per compare
+
+__attribute__((target("sse2")))
+static void fill_sse2(uint32_t* fat, uint32_t n, uint32_t value) {
+    __m128i v = _mm_set1_epi32((int)value);
+    uint32_t i = 0;
+    for (; i + 4 <= n; i += 4) _mm_storeu_si128((__m128i*)(fat + i), v);
+    fill_scalar(fat + i, n - i, value);
+}
+
+__attribute__((target("sse2")))
+static uint32_t count_sse2(const uint32_t* fat, uint32_t n, uint32_t value) {
+    __m128i v = _mm_set1_epi32((int)value);
+    __m128i acc = _mm_setzero_si128();
+    uint32_t i = 0;
+    //a match compares as -1, so subtracting counts it
+    for (; i + 4 <= n; i += 4) acc = _mm_sub_epi32(acc, _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(fat + i)), v));
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + count_scalar(fat + i, n - i, value);
+}
+
+__attribute__((target("sse2")))
+static uint32_t mark_used_sse2(const uint32_t* fat, uint32_t n, uint8_t* map) {
+    __m128i zero = _mm_setzero_si128();
+    uint32_t i = 0, used = 0;
+    for (; i + 8 <= n; i += 8) {
+        int lo = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(fat + i)), zero)));
+        int hi = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(fat + i + 4)), zero)));
+        uint8_t bits = ~(lo | hi << 4);
+        map[i / 8] = bits;
+        used += __builtin_popcount(bits);
+    }
+    return used + mark_used_from(fat, i, n, map);
+}
+
+__attribute__((target("sse2")))
+static uint32_t find_orphan_sse2(const uint32_t* fat, const uint32_t* owner, uint32_t n) {
+    __m128i zero = _mm_setzero_si128();
+    uint32_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i free_entry = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(fat + i)), zero);
+        __m128i unowned = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(owner + i)), zero);
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_andnot_si128(free_entry, unowned)));
+        if (mask != 0) return i + __builtin_ctz(mask);
+    }
+    return find_orphan_from(fat, owner, i, n);
+}
+
+//AVX2 kernels: eight entries per compare, one bitmap byte each
+
+__attribute__((target("avx2")))
+static void fill_avx2(uint32_t* fat, uint32_t n, uint32_t value) {
+    __m256i v = _mm256_set1_epi32((int)value);
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8) _mm256_storeu_si256((__m256i*)(fat + i), v);
+    fill_scalar(fat + i, n - i, value);
+}
+
+__attribute__((target("avx2")))
+static uint32_t count_avx2(const uint32_t* fat, uint32_t n, uint32_t value) {
+    __m256i v = _mm256_set1_epi32((int)value);
+    __m256i acc = _mm256_setzero_si256();
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8) acc = _mm256_sub_epi32(acc, _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)(fat + i)), v));
+    uint32_t lanes[8];
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    uint32_t found = 0;
+    for (int l = 0; l < 8; l++) found += lanes[l];
+    return found + count_scalar(fat + i, n - i, value);
+}
+
+__attribute__((target("avx2")))
+static uint32_t mark_used_avx2(const uint32_t* fat, uint32_t n, uint8_t* map) {
+    __m256i zero = _mm256_setzero_si256();
+    uint32_t i = 0, used = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i free_entry = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)(fat + i)), zero);
+        uint8_t bits = ~_mm256_movemask_ps(_mm256_castsi256_ps(free_entry));
+        map[i / 8] = bits;
+        used += __builtin_popcount(bits);
+    }
+    return used + mark_used_from(fat, i, n, map);
+}
+
+__attribute__((target("avx2")))
+static uint32_t find_orphan_avx2(const uint32_t* fat, const uint32_t* owner, uint32_t n) {
+    __m256i zero = _mm256_setzero_si256();
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i free_entry = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)(fat + i)), zero);
+        __m256i unowned = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)(owner + i)), zero);
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_andnot_si256(free_entry, unowned)));
+        if (mask != 0) return i + __builtin_ctz(mask);
+    }
+    return find_orphan_from(fat, owner, i, n);
+}
+
+#endif
+
+//indexed by FatScanLevel
+static const FatKernels kernels[] = {
+    {fill_scalar, count_scalar, mark_used_scalar, find_orphan_scalar},
+#if FAT_SCAN_X86
+    {fill_sse2, count_sse2, mark_used_sse2, find_orphan_sse2},
+    {fill_avx2, count_avx2, mark_used_avx2, find_orphan_avx2},
+#endif
+};
+
+static int current_level = -1;  //FatScanLevel in use, -1 until the first kernel call
+
+//true if the CPU can run the kernels of a level
+static bool level_supported(FatScanLevel level) {
+#if FAT_SCAN_X86
+    __builtin_cpu_init();
+    if (level == FAT_SCAN_AVX2) return __builtin_cpu_supports("avx2");
+    if (level == FAT_SCAN_SSE2) return __builtin_cpu_supports("sse2");
+#endif
+    return level == FAT_SCAN_SCALAR;
+}
+
+//level in use, detecting the best supported one on the first call
+FatScanLevel fat_scan_level(void) {
+    int level = __atomic_load_n(&current_level, __ATOMIC_RELAXED);
+    if (level < 0) {
+        //racing first calls all detect the same level
+        level = FAT_SCAN_AVX2;
+        while (!level_supported(level)) level--;
+        __atomic_store_n(&current_level, level, __ATOMIC_RELAXED);
+    }
+    return level;
+}
+
+//force a level (benchmarks), returns -1 if the CPU does not support it
+int fat_scan_set_level(FatScanLevel level) {
+    if (!level_supported(level)) return -1;
+    __atomic_store_n(&current_level, (int)level, __ATOMIC_RELAXED);
+    return 0;
+}
+
+//printable name of a level
+const char* fat_scan_level_name(FatScanLevel level) {
+    switch (level) {
+        case FAT_SCAN_SSE2: return "sse2";
+        case FAT_SCAN_AVX2: return "avx2";
+        default: return "scalar";
+    }
+}
+
+//set n entries to value
+void fat_fill(uint32_t* fat, uint32_t n, uint32_t value) {
+    kernels[fat_scan_level()].fill(fat, n, value);
+}
+
+//count the entries equal to value
+uint32_t fat_count(const uint32_t* fat, uint32_t n, uint32_t value) {
+    return kernels[fat_scan_level()].count(fat, n, value);
+}
+
+//write one bit per entry into map, set when the entry is not FAT_FREE; returns the entries in use
+uint32_t fat_mark_used(const uint32_t* fat, uint32_t n, uint8_t* map) {
+    return kernels[fat_scan_level()].mark_used(fat, n, map);
+}
+
+//index of the first entry in use whose owner is 0 (a block no chain reached), n if there is none
+uint32_t fat_find_orphan(const uint32_t* fat, const uint32_t* owner, uint32_t n) {
+    return kernels[fat_scan_level()].find_orphan(fat, owner, n);
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "../utils/utils.h"
+
+//Kernels for passes over the whole FAT. Each one has a scalar version and, on x86, SSE2 and AVX2
+//versions; the best one the CPU supports is picked at first use.
+
+//instruction set used by the kernels
+typedef enum {
+    FAT_SCAN_SCALAR,
+    FAT_SCAN_SSE2,
+    FAT_SCAN_AVX2
+} FatScanLevel;
+
+//level in use, detecting the best supported one on the first call
+FatScanLevel fat_scan_level(void);
+
+//force a level (benchmarks), returns -1 if the CPU does not support it
+int fat_scan_set_level(FatScanLevel level);
+
+//printable name of a level
+const char* fat_scan_level_name(FatScanLevel level);
+
+//set n entries to value
+void fat_fill(uint32_t* fat, uint32_t n, uint32_t value);
+
+//count the entries equal to value
+uint32_t fat_count(const uint32_t* fat, uint32_t n, uint32_t value);
+
+//write one bit per entry into map, set when the entry is not FAT_FREE; returns the entries in use
+uint32_t fat_mark_used(const uint32_t* fat, uint32_t n, uint8_t* map);
+
+//index of the first entry in use whose owner is 0 (a block no chain reached), n if there is none
+uint32_t fat_find_orphan(const uint32_t* fat, const uint32_t* owner, uint32_t n);
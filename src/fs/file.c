@@ -0,0 +1,357 @@
+#include "file.h"
+#include "dir.h"
+
+#define DATA_BATCH_RUNS 64  //runs of a read or write handed to the disk at once
+#define WRITE_TX_BLOCKS 5   //blocks a step of a write changes besides the FAT blocks of its runs: the entries of file and parent, their dirents, the FAT block the chain is linked in
+
+//slot of a valid handle, NULL otherwise
+static OpenFile* get_open_file(Volume* vol, int fd) {
+    if (fd < 0 || fd >= MAX_OPEN_FILES || vol->ftable.files[fd].ino == 0) return NULL;
+    return &vol->ftable.files[fd];
+}
+
+//make room for at least n blocks in the index
+static int reserve_index(OpenFile* of, uint32_t n) {
+    if (n <= of->capacity) return 0;
+    uint32_t capacity = of->capacity > 0 ? of->capacity : 16;
+    while (capacity < n) capacity *= 2;
+    uint32_t* blocks = realloc(of->blocks, (size_t)capacity * sizeof(uint32_t));
+    if (blocks == NULL) return -1;
+    of->blocks = blocks;
+    of->capacity = capacity;
+    return 0;
+}
+
+//walk the chain once and record every block
+static int build_index(Volume* vol, OpenFile* of, const Entry* file) {
+    if (reserve_index(of, file->num_blocks) != 0) return FS_ERR_NO_MEMORY;
+    uint32_t block = file->start_block;
+    for (uint32_t i = 0; i < file->num_blocks; i++) {
+        if (block == FAT_EOC || block >= __atomic_load_n(&vol->num_fat_entries, __ATOMIC_RELAXED)) return FS_ERR_CORRUPT; //chain shorter than recorded
+        of->blocks[i] = block;
+        block = vol->fat[block];
+    }
+    of->num_indexed = file->num_blocks;
+    return 0;
+}
+
+//empty a slot, keeping its lock
+static void clear_slot(OpenFile* of) {
+    free(of->blocks);
+    of->ino = 0;
+    of->refs = 0;
+    of->blocks = NULL;
+    of->num_indexed = 0;
+    of->capacity = 0;
+}
+
+//take the open-file table lock in threaded mode
+static void lock_table(Volume* vol) {
+    if (vol->threaded) pthread_mutex_lock(&vol->ftable.lock);
+}
+
+//release the open-file table lock
+static void unlock_table(Volume* vol) {
+    if (vol->threaded) pthread_mutex_unlock(&vol->ftable.lock);
+}
+
+//take the lock of an open file, shared for readers or exclusive for writers
+static void lock_file(Volume* vol, OpenFile* of, bool write) {
+    if (!vol->threaded) return;
+    if (write) pthread_rwlock_wrlock(&of->lock);
+    else pthread_rwlock_rdlock(&of->lock);
+}
+
+//release the lock of an open file
+static void unlock_file(Volume* vol, OpenFile* of) {
+    if (vol->threaded) pthread_rwlock_unlock(&of->lock);
+}
+
+//fs_open_ino with the parent directory locked, so an unlink cannot free the inode meanwhile
+static int open_locked(Volume* vol, uint32_t ino) {
+    const Entry* file = get_entry(vol, ino);
+    //a file without a parent is unlinked, its blocks are being freed
+    if (file == NULL || file->ino != ino || file->type != ENTRY_TYPE_FILE || file->parent_ino == FAT_EOF) return FS_ERR_INVALID;
+    int free_slot = -1;
+    lock_table(vol);
+    for (int fd = 0; fd < MAX_OPEN_FILES; fd++) {
+        OpenFile* of = &vol->ftable.files[fd];
+        if (of->ino == ino) {
+            //already open: share the index
+            of->refs++;
+            unlock_table(vol);
+            return fd;
+        }
+        if (of->ino == 0 && free_slot < 0) free_slot = fd;
+    }
+    int res = free_slot < 0 ? FS_ERR_TOO_MANY_OPEN : FS_OK;
+    if (res == FS_OK) {
+        OpenFile* of = &vol->ftable.files[free_slot];
+        res = build_index(vol, of, file);
+        if (res != FS_OK) {
+            clear_slot(of);
+        } else {
+            of->ino = ino;
+            of->refs = 1;
+            res = free_slot;
+        }
+    }
+    unlock_table(vol);
+    return res;
+}
+
+//open a file by inode, returns a handle or a negative FS_ERR_* code
+int fs_open_ino(Volume* vol, uint32_t ino) {
+    const Entry* file = get_entry(vol, ino);
+    if (file == NULL) return FS_ERR_INVALID;
+    //the parent is read before its lock is held: the inode may have been unlinked and reused in between
+    uint32_t parent_ino = __atomic_load_n(&file->parent_ino, __ATOMIC_RELAXED);
+    lock_dir(vol, parent_ino, false);
+    int res = file->parent_ino == parent_ino ? open_locked(vol, ino) : FS_ERR_INVALID;
+    unlock_dir(vol, parent_ino);
+    return res;
+}
+
+//open a file of a directory by name, returns a handle or a negative FS_ERR_* code
+int fs_open(Volume* vol, uint32_t dir_ino, const char* name) {
+    //the directory stays locked until the slot is set up, so the file cannot be removed in between
+    lock_dir(vol, dir_ino, false);
+    uint32_t ino = lookup_child(vol, dir_ino, name, ENTRY_TYPE_FILE);
+    int res = ino == FAT_EOF ? FS_ERR_NOT_FOUND : open_locked(vol, ino);
+    unlock_dir(vol, dir_ino);
+    return res;
+}
+
+//move len bytes at offset of an open file between buf and its blocks; the index gives the block holding each
+//position directly, and consecutive blocks are merged into runs handed to the disk DATA_BATCH_RUNS at a time
+static int transfer_data(Volume* vol, const OpenFile* of, void* buf, size_t len, size_t offset, bool write) {
+    //block size is a power of two: positions split into block and offset by shift and mask
+    uint32_t shift = vol->disk.block_shift;
+    size_t block_size = vol->disk.block_size;
+    DataRun runs[DATA_BATCH_RUNS];
+    uint32_t n = 0;
+    for (size_t done = 0; done < len; ) {
+        size_t pos = offset + done;
+        size_t in_block = pos & (block_size - 1);
+        size_t chunk = block_size - in_block;
+        if (chunk > len - done) chunk = len - done;
+        uint32_t block = of->blocks[pos >> shift];
+        //every run but the last ends on a block boundary, so a block right after it extends it
+        DataRun* last = n > 0 ? &runs[n - 1] : NULL;
+        if (last != NULL && block == last->block + ((last->offset + last->len) >> shift)) last->len += chunk;
+        else {
+            if (n == DATA_BATCH_RUNS) {
+                if ((write ? write_data_runs(&vol->disk, runs, n) : read_data_runs(&vol->disk, runs, n)) != 0) return -1;
+                n = 0;
+            }
+            runs[n++] = (DataRun){block, in_block, chunk, (char*)buf + done};
+        }
+        done += chunk;
+    }
+    if (n == 0) return 0;
+    return write ? write_data_runs(&vol->disk, runs, n) : read_data_runs(&vol->disk, runs, n);
+}
+
+//fs_pread with the file lock held
+static ssize_t pread_locked(Volume* vol, OpenFile* of, void* buf, size_t len, size_t offset) {
+    const Entry* file = get_entry(vol, of->ino);
+    if (file == NULL) return FS_ERR_IO;
+    if (offset >= file->size) return 0;
+    if (len > file->size - offset) len = file->size - offset;
+    if (has_inline_data(file)) {
+        memcpy(buf, file->data + offset, len);
+        return len;
+    }
+    if (transfer_data(vol, of, buf, len, offset, false) != 0) return FS_ERR_IO;
+    return len;
+}
+
+//read up to len bytes at offset, returns the bytes read (0 past the end) or an FS_ERR_* code
+ssize_t fs_pread(Volume* vol, int fd, void* buf, size_t len, size_t offset) {
+    OpenFile* of = get_open_file(vol, fd);
+    if (of == NULL) return FS_ERR_INVALID;
+    //readers of the same file share the lock, and nothing else is locked on this path
+    lock_file(vol, of, false);
+    ssize_t res = pread_locked(vol, of, buf, len, offset);
+    unlock_file(vol, of);
+    return res;
+}
+
+//move inline contents to a first data block
+static int spill_inline_data(Volume* vol, OpenFile* of, Entry* file) {
+    char inline_data[INLINE_DATA_SIZE];
+    memcpy(inline_data, file->data, file->size);
+    uint32_t first_block = append_entry_block(vol, file);
+    if (first_block == FAT_EOF) return FS_ERR_NO_SPACE;
+    memset(file->data, 0, INLINE_DATA_SIZE);
+    if (write_data(&vol->disk, first_block, 0, inline_data, file->size) != 0 ||
+        zero_data(&vol->disk, first_block, file->size, vol->disk.block_size - file->size) != 0) return FS_ERR_IO;
+    of->blocks[0] = first_block;
+    of->num_indexed = 1;
+    return 0;
+}
+
+//grow the chain to n blocks, zeroing new blocks the write [offset, end) does not fully cover
+static int grow_file(Volume* vol, OpenFile* of, Entry* file, uint32_t n, size_t offset, size_t end) {
+    if (reserve_index(of, n) != 0) return FS_ERR_NO_MEMORY;
+    while (file->num_blocks < n) {
+        uint32_t got;
+        //reserve everything still missing at once, so it comes out as one contiguous run
+        uint32_t block = append_entry_blocks(vol, file, n - file->num_blocks, &got);
+        if (block == FAT_EOF) return FS_ERR_NO_SPACE;
+        for (uint32_t i = 0; i < got; i++) {
+            uint32_t index = of->num_indexed++;
+            of->blocks[index] = block + i;
+            size_t start = (size_t)index << vol->disk.block_shift;
+            if (offset <= start && end >= start + vol->disk.block_size) continue;
+            if (zero_data(&vol->disk, block + i, 0, vol->disk.block_size) != 0) return FS_ERR_IO;
+        }
+    }
+    return 0;
+}
+
+//copy the file size into its parent: directory size and the dirents of file and parent
+static int propagate_size(Volume* vol, Entry* file, size_t old_size) {
+    Entry* parent_dir = get_entry_mut(vol, file->parent_ino);
+    if (parent_dir == NULL) return FS_ERR_CORRUPT;
+    //the parent holds the file's dirent, the grandparent the parent's
+    uint32_t grandparent_ino = parent_dir->parent_ino;
+    lock_dir_pair(vol, file->parent_ino, grandparent_ino);
+    parent_dir->size += file->size - old_size;
+    mark_entry_dirty(vol, file->parent_ino);
+    int res = FS_OK;
+    if (refresh_parent_dirent(vol, file) != 0 || refresh_parent_dirent(vol, parent_dir) != 0) res = FS_ERR_CORRUPT;
+    unlock_dir_pair(vol, file->parent_ino, grandparent_ino);
+    return res;
+}
+
+//fs_pwrite with the file lock held
+static ssize_t pwrite_locked(Volume* vol, OpenFile* of, const void* buf, size_t len, size_t offset) {
+    Entry* file = get_entry_mut(vol, of->ino);
+    if (file == NULL) return FS_ERR_IO;
+    size_t end = offset + len;
+    uint32_t shift = vol->disk.block_shift;
+    size_t block_size = vol->disk.block_size;
+    size_t old_size = file->size;
+    if (has_inline_data(file) && end <= INLINE_DATA_SIZE) {
+        //still fits in the record: no data block needed
+        memcpy(file->data + offset, buf, len);
+    } else {
+        if (has_inline_data(file) && file->size > 0) {
+            //the file outgrows the record, move the inline bytes to its first data block
+            if (reserve_index(of, 1) != 0) return FS_ERR_NO_MEMORY;
+            int res = spill_inline_data(vol, of, file);
+            if (res != 0) return res;
+        } else if (has_inline_data(file)) {
+            memset(file->data, 0, INLINE_DATA_SIZE);
+        }
+        uint32_t needed = (end + block_size - 1) >> shift;
+        int res = grow_file(vol, of, file, needed, offset, end);
+        if (res != 0) {
+            mark_entry_dirty(vol, of->ino);
+            return res;
+        }
+        if (transfer_data(vol, of, (void*)buf, len, offset, true) != 0) return FS_ERR_IO;
+    }
+    if (end > old_size) file->size = end;
+    mark_entry_dirty(vol, of->ino);
+    //the parent directory size and the dirents listing file and parent follow the growth
+    if (file->size != old_size) {
+        int res = propagate_size(vol, file, old_size);
+        if (res != FS_OK) return res;
+    }
+    return len;
+}
+
+//one step of fs_pwrite with the file lock held, as an operation of its own: writes the part of [offset, offset + len)
+//whose new blocks fit the room the open transaction grants, or if not even the hole before offset fits, only
+//grows the file into it (and sets hole); returns the bytes written or an FS_ERR_* code
+static ssize_t write_step(Volume* vol, OpenFile* of, const char* buf, size_t len, size_t offset, bool* hole) {
+    const Entry* file = get_entry(vol, of->ino);
+    if (file == NULL) return FS_ERR_IO;
+    uint32_t shift = vol->disk.block_shift;
+    uint32_t num_blocks = file->num_blocks;
+    //blocks the rest of the write adds to the chain, each may come in a run with a FAT block of its own
+    uint32_t needed = (offset + len + vol->disk.block_size - 1) >> shift;
+    uint32_t missing = needed > num_blocks ? needed - num_blocks : 0;
+    if (begin_transaction(vol, WRITE_TX_BLOCKS + 1) != 0) return FS_ERR_IO;
+    uint32_t extra = missing > 1 ? extend_transaction(vol, 0, missing - 1) : 0;
+    size_t limit = ((size_t)num_blocks + 1 + extra) << shift;
+    ssize_t res;
+    if (limit >= offset + len) res = pwrite_locked(vol, of, buf, len, offset);
+    else if (limit > offset) res = pwrite_locked(vol, of, buf, limit - offset, offset);
+    else {
+        *hole = true;
+        res = pwrite_locked(vol, of, buf, 0, limit);
+    }
+    end_transaction(vol, WRITE_TX_BLOCKS + 1 + extra);
+    return res;
+}
+
+//write len bytes at offset, growing the file as needed (holes read as zeros), returns len or an FS_ERR_* code
+ssize_t fs_pwrite(Volume* vol, int fd, const void* buf, size_t len, size_t offset) {
+    OpenFile* of = get_open_file(vol, fd);
+    if (of == NULL) return FS_ERR_INVALID;
+    size_t end = offset + len;
+    if (end < offset || end >> vol->disk.block_shift >= FAT_EOF) return FS_ERR_TOO_LARGE; //block indices are 32 bit
+    //data and chain growth only need the file; its directories are locked just for the size update. The file is
+    //locked outside the steps' operations: a step may wait for a commit, and no operation waits for a file
+    lock_file(vol, of, true);
+    size_t done = 0;
+    ssize_t res;
+    bool hole;
+    //a long write goes in steps that each fit the journal, committed in between when it fills up
+    do {
+        hole = false;
+        res = write_step(vol, of, (const char*)buf + done, len - done, offset + done, &hole);
+        if (res > 0) done += res;
+    } while (res >= 0 && (hole || done < len));
+    unlock_file(vol, of);
+    return res < 0 ? res : (ssize_t)len;
+}
+
+//size of an open file
+size_t fs_size(Volume* vol, int fd) {
+    OpenFile* of = get_open_file(vol, fd);
+    if (of == NULL) return 0;
+    lock_file(vol, of, false);
+    const Entry* file = get_entry(vol, of->ino);
+    size_t size = file != NULL ? file->size : 0;
+    unlock_file(vol, of);
+    return size;
+}
+
+//true if some handle refers to inode ino
+bool fs_is_open(Volume* vol, uint32_t ino) {
+    bool open = false;
+    lock_table(vol);
+    for (int fd = 0; fd < MAX_OPEN_FILES && !open; fd++) open = vol->ftable.files[fd].ino == ino;
+    unlock_table(vol);
+    return open;
+}
+
+//release a handle and write back FAT and metainfo, returns an FS_ERR_* code on a bad handle or flush error
+int fs_close(Volume* vol, int fd) {
+    OpenFile* of = get_open_file(vol, fd);
+    if (of == NULL) return FS_ERR_INVALID;
+    lock_table(vol);
+    if (--of->refs == 0) clear_slot(of);
+    unlock_table(vol);
+    return flush_volume(vol) == 0 ? FS_OK : FS_ERR_IO;
+}
+
+//set up an empty table and its locks (used at mount)
+void fs_init_table(Volume* vol) {
+    memset(&vol->ftable, 0, sizeof(FileTable));
+    pthread_mutex_init(&vol->ftable.lock, NULL);
+    for (int fd = 0; fd < MAX_OPEN_FILES; fd++) pthread_rwlock_init(&vol->ftable.files[fd].lock, NULL);
+}
+
+//drop every handle and the table locks (used at unmount)
+void fs_close_all(Volume* vol) {
+    for (int fd = 0; fd < MAX_OPEN_FILES; fd++) {
+        clear_slot(&vol->ftable.files[fd]);
+        pthread_rwlock_destroy(&vol->ftable.files[fd].lock);
+    }
+    pthread_mutex_destroy(&vol->ftable.lock);
+}
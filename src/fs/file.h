@@ -0,0 +1,38 @@
+#pragma once
+
+#include "disk.h"
+#include "fat.h"
+#include "entry.h"
+#include "volume.h"
+#include "errors.h"
+#include "../utils/utils.h"
+
+//with the "threads" mount option every call below may be made from several threads at once
+
+//open a file of a directory by name, returns a handle or a negative FS_ERR_* code
+int fs_open(Volume* vol, uint32_t dir_ino, const char* name);
+
+//open a file by inode, returns a handle or a negative FS_ERR_* code
+int fs_open_ino(Volume* vol, uint32_t ino);
+
+//read up to len bytes at offset, returns the bytes read (0 past the end) or an FS_ERR_* code
+ssize_t fs_pread(Volume* vol, int fd, void* buf, size_t len, size_t offset);
+
+//write len bytes at offset, growing the file as needed (holes read as zeros), returns len or an FS_ERR_* code;
+//a write too long for one transaction is committed in steps, after a crash the file keeps the steps committed
+ssize_t fs_pwrite(Volume* vol, int fd, const void* buf, size_t len, size_t offset);
+
+//size of an open file
+size_t fs_size(Volume* vol, int fd);
+
+//true if some handle refers to inode ino
+bool fs_is_open(Volume* vol, uint32_t ino);
+
+//release a handle and write back FAT and metainfo, returns an FS_ERR_* code on a bad handle or flush error
+int fs_close(Volume* vol, int fd);
+
+//set up an empty table and its locks (used at mount)
+void fs_init_table(Volume* vol);
+
+//drop every handle and the table locks (used at unmount)
+void fs_close_all(Volume* vol);
@@ -0,0 +1,322 @@
+#include "fs.h"
+
+#define CREATE_TX_BLOCKS 16 //blocks a create may change: the new entry, the parent's entry, its index and the buckets of a few splits with their FAT blocks
+#define REMOVE_TX_BLOCKS 4  //blocks a remove changes besides its chain: the entries of child and parent, the dirents of both
+#define RELEASE_TX_BLOCKS 2 //blocks a step of release_detached changes at least: the entry and one FAT block
+
+//message describing an error code
+const char* fs_strerror(int err) {
+    switch (err) {
+        case FS_OK: return "Success";
+        case FS_ERR_IO: return "I/O error on the disk file";
+        case FS_ERR_NO_MEMORY: return "Out of memory";
+        case FS_ERR_NOT_FOUND: return "No such file or directory";
+        case FS_ERR_EXISTS: return "An entry with the same name already exists";
+        case FS_ERR_NO_SPACE: return "No free blocks left on the disk";
+        case FS_ERR_NO_INODES: return "No free inodes left on the disk";
+        case FS_ERR_NAME_TOO_LONG: return "Name too long";
+        case FS_ERR_NOT_EMPTY: return "Directory is not empty";
+        case FS_ERR_DIR_FULL: return "Directory is full";
+        case FS_ERR_BUSY: return "File is open";
+        case FS_ERR_TOO_MANY_OPEN: return "Too many open files";
+        case FS_ERR_OLD_FORMAT: return "Disk uses an older format and must be converted";
+        case FS_ERR_VERSION: return "Disk uses an unsupported format version";
+        case FS_ERR_CORRUPT: return "Disk structures are damaged";
+        case FS_ERR_INVALID: return "Invalid argument";
+        case FS_ERR_TOO_LARGE: return "File too large";
+        default: return "Unknown error";
+    }
+}
+
+//create and mount a new image of size bytes that can grow up to opts->max_size
+int fs_format(Volume* vol, const char* filename, size_t size, const MountOptions* opts) {
+    size_t block_size = opts->block_size;
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0) return FS_ERR_INVALID;
+    size -= size % block_size;
+    size_t max_size = opts->max_size > size ? opts->max_size - opts->max_size % block_size : size;
+    if (size < MIN_DISK_SIZE || max_size > max_disk_size(block_size)) return FS_ERR_INVALID;
+    //the FAT is reserved for the maximum size, so it has to fit in the initial one with room to spare
+    uint32_t fat_end = calc_reserved_blocks(max_size, block_size);
+    uint32_t reserved_blocks = fat_end + calc_inode_blocks(size, block_size) + calc_journal_blocks(size, block_size);
+    if (reserved_blocks >= size / block_size) return FS_ERR_INVALID;
+    //the new file is a single hole: only the blocks written below take space
+    Disk disk;
+    if (open_volume_disk(&disk, filename, size, opts) != 0) return FS_ERR_IO;
+    if (set_block_size(&disk, block_size) != 0 || reserve_disk(&disk, size, max_size) != 0) {
+        close_disk(&disk);
+        return FS_ERR_NO_MEMORY;
+    }
+    // Initialize DiskInfo and FAT in memory
+    if (create_volume(vol, &disk, filename) != 0) {
+        close_disk(&disk);
+        return FS_ERR_NO_MEMORY;
+    }
+    //we allocate the metainfo, FAT, inode table and journal as a single chain starting at block 0;
+    //the inode table starts empty, its blocks are still holes
+    if (reserve_blocks(vol, 0, reserved_blocks) != 0) {
+        unmount_volume(vol);
+        return FS_ERR_NO_SPACE;
+    }
+    //from here on metadata changes go through the journal
+    if (journal_format(&vol->disk, vol->info.journal_start, vol->info.journal_blocks) != 0 ||
+        journal_open(&vol->journal, &vol->disk, vol->info.journal_start, vol->info.journal_blocks, vol->threaded) != 0) {
+        unmount_volume(vol);
+        return FS_ERR_IO;
+    }
+    //the root directory is always the first inode
+    uint32_t result = allocate_inode(vol);
+    Entry root;
+    init_directory(&root, "/", result);
+    root.parent_ino = FAT_EOF;
+    if (result != ROOT_INO || write_entry(vol, &root) != 0) {
+        unmount_volume(vol);
+        return FS_ERR_CORRUPT;
+    }
+    //write fat and metainfo, a new image starts with everything on disk and an empty journal
+    if (sync_volume(vol) != 0) {
+        unmount_volume(vol);
+        return FS_ERR_IO;
+    }
+    return FS_OK;
+}
+
+//mount an existing image at the size its metainfo records; on FS_ERR_VERSION vol->info.version holds the version found
+int fs_mount(Volume* vol, const char* filename, const MountOptions* opts) {
+    Disk disk;
+    memset(vol, 0, sizeof(Volume));
+    if (open_volume_disk(&disk, filename, 0, opts) != 0) return FS_ERR_IO;
+    //images written before format versioning have to be converted first
+    DiskInfo info;
+    int res = FS_OK;
+    if (read_metainfo(&disk, &info) != 0 || info.magic != FS_MAGIC) res = FS_ERR_OLD_FORMAT;
+    else if (info.version != FS_VERSION) res = FS_ERR_VERSION;
+    //the mapping leaves room for every grow, the whole file stays usable until the journal is replayed
+    else if (set_block_size(&disk, info.block_size) != 0 || info.max_size > max_disk_size(info.block_size) ||
+             reserve_disk(&disk, disk.size, info.max_size) != 0) res = FS_ERR_CORRUPT;
+    else if (mount_volume(vol, &disk) != 0) res = FS_ERR_CORRUPT;
+    if (res != FS_OK) {
+        close_disk(&disk);
+        memset(vol, 0, sizeof(Volume));
+        if (res == FS_ERR_VERSION) vol->info.version = info.version;
+    }
+    return res;
+}
+
+//grow a mounted image to new_size bytes (rounded down to whole blocks, up to the maximum set at format);
+//the new space gets its share of inodes and is usable right away
+int fs_grow(Volume* vol, size_t new_size) {
+    size_t block_size = vol->disk.block_size;
+    new_size -= new_size % block_size;
+    size_t old_size = vol->info.disk_size;
+    if (new_size <= old_size || new_size > vol->info.max_size) return FS_ERR_INVALID;
+    uint32_t inode_blocks = calc_inode_blocks(new_size, block_size) - calc_inode_blocks(old_size, block_size);
+    //every grow that adds inodes takes an extent, and the extent must leave some new blocks for data
+    if (inode_blocks > 0 && vol->info.inode_extents == INODE_MAX_EXTENTS) return FS_ERR_NO_INODES;
+    if (inode_blocks >= (new_size - old_size) / block_size) return FS_ERR_INVALID;
+    return grow_volume(vol, new_size, inode_blocks) == 0 ? FS_OK : FS_ERR_IO;
+}
+
+//punch every free block out of the image file so it takes host space only for live data; stores the
+//blocks punched in discarded if not NULL
+int fs_trim(Volume* vol, uint64_t* discarded) {
+    uint64_t n;
+    int res = trim_volume(vol, &n);
+    if (discarded != NULL) *discarded = n;
+    return res == 0 ? FS_OK : FS_ERR_IO;
+}
+
+//write everything back and release the mount
+int fs_unmount(Volume* vol) {
+    return unmount_volume(vol) == 0 ? FS_OK : FS_ERR_IO;
+}
+
+//flush every pending write to the disk file
+int fs_sync(Volume* vol) {
+    return sync_volume(vol) == 0 ? FS_OK : FS_ERR_IO;
+}
+
+//find a child of a directory, stores its inode in ino
+int fs_lookup(Volume* vol, uint32_t dir_ino, const char* name, uint8_t type, uint32_t* ino) {
+    const Entry* dir = get_entry(vol, dir_ino);
+    if (dir == NULL || dir->type != ENTRY_TYPE_DIR) return FS_ERR_INVALID;
+    //cache hits only take the dentry cache lock shared, misses also read the directory shared
+    *ino = dcache_lookup(&vol->dcache, dir_ino, name, type);
+    if (*ino == FAT_EOF) {
+        lock_dir(vol, dir_ino, false);
+        *ino = lookup_child(vol, dir_ino, name, type);
+        unlock_dir(vol, dir_ino);
+    }
+    return *ino == FAT_EOF ? FS_ERR_NOT_FOUND : FS_OK;
+}
+
+//allocate, write and link a new entry with the parent locked
+static int create_entry_locked(Volume* vol, uint32_t parent_ino, const char* name, uint8_t type, uint32_t* ino) {
+    //the parent may have been removed before its lock was taken, or be a removed directory still being freed
+    const Entry* parent_dir = get_entry(vol, parent_ino);
+    if (parent_dir == NULL || parent_dir->ino != parent_ino || (parent_dir->parent_ino == FAT_EOF && parent_ino != ROOT_INO)) return FS_ERR_NOT_FOUND;
+    //check if an entry of the same type and name already exists
+    if (lookup_child(vol, parent_ino, name, type) != FAT_EOF) return FS_ERR_EXISTS;
+    uint32_t new_ino = allocate_inode(vol);
+    if (new_ino == FAT_EOF) return FS_ERR_NO_INODES;
+    Entry entry;
+    if (type == ENTRY_TYPE_DIR) init_directory(&entry, name, new_ino);
+    else init_file(&entry, name, new_ino);
+    entry.parent_ino = parent_ino;
+    int res = write_entry(vol, &entry);
+    //add the new entry to its parent
+    if (res == 0) res = update_directory_children(vol, parent_ino, &entry);
+    if (res != 0) {
+        free_inode(vol, new_ino);
+        return res;
+    }
+    dcache_insert(&vol->dcache, parent_ino, entry.name, type, new_ino);
+    if (ino != NULL) *ino = new_ino;
+    return FS_OK;
+}
+
+//allocate, write and link a new entry; shared by fs_mkdir and fs_create
+static int create_entry(Volume* vol, uint32_t parent_ino, const char* name, uint8_t type, uint32_t* ino) {
+    if (strlen(name) >= MAX_NAME_LEN) return FS_ERR_NAME_TOO_LONG;
+    const Entry* parent_dir = get_entry(vol, parent_ino);
+    if (parent_dir == NULL || parent_dir->type != ENTRY_TYPE_DIR) return FS_ERR_INVALID;
+    //creates in different directories only meet in the allocator
+    if (begin_transaction(vol, CREATE_TX_BLOCKS) != 0) return FS_ERR_IO;
+    lock_dir(vol, parent_ino, true);
+    int res = create_entry_locked(vol, parent_ino, name, type, ino);
+    unlock_dir(vol, parent_ino);
+    end_transaction(vol, CREATE_TX_BLOCKS);
+    //update fat and metainfo on disk
+    if (flush_volume(vol) != 0 && res == FS_OK) res = FS_ERR_IO;
+    return res;
+}
+
+//create a directory, stores its inode in ino if not NULL
+int fs_mkdir(Volume* vol, uint32_t parent_ino, const char* name, uint32_t* ino) {
+    return create_entry(vol, parent_ino, name, ENTRY_TYPE_DIR, ino);
+}
+
+//create an empty file, stores its inode in ino if not NULL
+int fs_create(Volume* vol, uint32_t parent_ino, const char* name, uint32_t* ino) {
+    return create_entry(vol, parent_ino, name, ENTRY_TYPE_FILE, ino);
+}
+
+//free the chain and inode of an entry just removed from its directory if the chain fits in the operation, the room
+//it takes added to extra; else detach the entry, left in detached for release_detached
+static int drop_entry(Volume* vol, uint32_t ino, uint32_t* extra, uint32_t* detached) {
+    Entry* e = get_entry_mut(vol, ino);
+    if (e == NULL) return -1;
+    //every block of the chain may have its own FAT block
+    *extra = e->num_blocks > 0 ? extend_transaction(vol, e->num_blocks, e->num_blocks) : 0;
+    if (*extra >= e->num_blocks) {
+        int res = release_entry_blocks(vol, e);
+        free_inode(vol, ino);
+        return res;
+    }
+    //nothing links to it any more, and fs_open_ino refuses an entry without a parent
+    e->parent_ino = FAT_EOF;
+    e->size = 0;
+    mark_entry_dirty(vol, ino);
+    *detached = ino;
+    return 0;
+}
+
+//free the chain of a detached entry in steps that each fit the open transaction, then its inode; nothing can reach
+//the entry meanwhile, and after a crash fs_check finds it unlinked and frees it
+static int release_detached(Volume* vol, uint32_t ino) {
+    for (;;) {
+        if (begin_transaction(vol, RELEASE_TX_BLOCKS) != 0) return FS_ERR_IO;
+        Entry* e = get_entry_mut(vol, ino);
+        uint32_t extra = 0;
+        int res = e == NULL ? FS_ERR_IO : FS_OK;
+        bool done = true;
+        if (res == FS_OK) {
+            //one FAT block is in the reserved room, the step takes as many more as the transaction has
+            if (e->num_blocks > 1) extra = extend_transaction(vol, 0, e->num_blocks - 1);
+            if (release_entry_head(vol, e, 1 + extra) != 0) res = FS_ERR_CORRUPT;
+            if (e->start_block == FAT_EOC) free_inode(vol, ino);
+            else done = false;
+        }
+        end_transaction(vol, RELEASE_TX_BLOCKS + extra);
+        if (res != FS_OK || done) return res;
+    }
+}
+
+//fs_rmdir with parent and child locked, a directory with too many blocks for the operation is left in detached
+static int rmdir_locked(Volume* vol, uint32_t parent_ino, uint32_t dir_ino, const char* name, uint32_t* extra, uint32_t* detached) {
+    //the child may have been removed or replaced before the locks were taken
+    if (lookup_child(vol, parent_ino, name, ENTRY_TYPE_DIR) != dir_ino) return FS_ERR_NOT_FOUND;
+    const Entry* dir_to_remove = get_entry(vol, dir_ino);
+    if (dir_to_remove == NULL) return FS_ERR_CORRUPT;
+    if (!directory_is_empty(dir_to_remove)) return FS_ERR_NOT_EMPTY;
+    //remove directory from parent by zeroing its dirent
+    if (remove_directory_child(vol, parent_ino, dir_to_remove) < 0) return FS_ERR_CORRUPT;
+    //deallocate directory index and buckets, then the inode
+    int res = drop_entry(vol, dir_ino, extra, detached);
+    dcache_remove(&vol->dcache, parent_ino, name, ENTRY_TYPE_DIR);
+    dcache_invalidate_dir(&vol->dcache, dir_ino);
+    return res != 0 ? FS_ERR_CORRUPT : FS_OK;
+}
+
+//remove an empty directory
+int fs_rmdir(Volume* vol, uint32_t parent_ino, const char* name) {
+    uint32_t dir_ino;
+    int res = fs_lookup(vol, parent_ino, name, ENTRY_TYPE_DIR, &dir_ino);
+    if (res != FS_OK) return res;
+    //the child is locked too, so nothing can be created in it meanwhile
+    if (begin_transaction(vol, REMOVE_TX_BLOCKS) != 0) return FS_ERR_IO;
+    lock_dir_pair(vol, parent_ino, dir_ino);
+    uint32_t extra = 0, detached = FAT_EOF;
+    res = rmdir_locked(vol, parent_ino, dir_ino, name, &extra, &detached);
+    unlock_dir_pair(vol, parent_ino, dir_ino);
+    end_transaction(vol, REMOVE_TX_BLOCKS + extra);
+    if (res == FS_OK && detached != FAT_EOF) res = release_detached(vol, detached);
+    if (flush_volume(vol) != 0 && res == FS_OK) res = FS_ERR_IO;
+    return res;
+}
+
+//fs_unlink with the parent and its own parent locked, a file with too many blocks for the operation is left in detached
+static int unlink_locked(Volume* vol, uint32_t parent_ino, const char* name, uint32_t* extra, uint32_t* detached) {
+    uint32_t file_ino = lookup_child(vol, parent_ino, name, ENTRY_TYPE_FILE);
+    if (file_ino == FAT_EOF) return FS_ERR_NOT_FOUND;
+    Entry* parent_dir = get_entry_mut(vol, parent_ino);
+    const Entry* file_entry = get_entry(vol, file_ino);
+    if (parent_dir == NULL || file_entry == NULL) return FS_ERR_CORRUPT;
+    if (fs_is_open(vol, file_ino)) return FS_ERR_BUSY;
+    //the parent directory shrinks by the size of the file
+    uint64_t total_size = file_entry->size;
+    if (remove_directory_child(vol, parent_ino, file_entry) < 0) return FS_ERR_CORRUPT;
+    int res = drop_entry(vol, file_ino, extra, detached);
+    dcache_remove(&vol->dcache, parent_ino, name, ENTRY_TYPE_FILE);
+    parent_dir->size -= total_size;
+    mark_entry_dirty(vol, parent_ino);
+    if (res != 0 || refresh_parent_dirent(vol, parent_dir) != 0) return FS_ERR_CORRUPT;
+    return FS_OK;
+}
+
+//remove a file that is not open
+int fs_unlink(Volume* vol, uint32_t parent_ino, const char* name) {
+    const Entry* parent_dir = get_entry(vol, parent_ino);
+    if (parent_dir == NULL || parent_dir->type != ENTRY_TYPE_DIR) return FS_ERR_INVALID;
+    //the parent's size changes, and its dirent lives in the grandparent
+    uint32_t grandparent_ino = parent_dir->parent_ino;
+    if (begin_transaction(vol, REMOVE_TX_BLOCKS) != 0) return FS_ERR_IO;
+    lock_dir_pair(vol, parent_ino, grandparent_ino);
+    uint32_t extra = 0, detached = FAT_EOF;
+    int res = unlink_locked(vol, parent_ino, name, &extra, &detached);
+    unlock_dir_pair(vol, parent_ino, grandparent_ino);
+    end_transaction(vol, REMOVE_TX_BLOCKS + extra);
+    //the file is gone from its directory, a long chain goes back in steps
+    if (res == FS_OK && detached != FAT_EOF) res = release_detached(vol, detached);
+    if (flush_volume(vol) != 0 && res == FS_OK) res = FS_ERR_IO;
+    return res;
+}
+
+//call fn on every child of a directory, stops early and returns fn's result if it is not 0
+int fs_readdir(Volume* vol, uint32_t dir_ino, int (*fn)(const Dirent* d, void* arg), void* arg) {
+    const Entry* dir = get_entry(vol, dir_ino);
+    if (dir == NULL || dir->type != ENTRY_TYPE_DIR) return FS_ERR_INVALID;
+    lock_dir(vol, dir_ino, false);
+    int res = for_each_dirent(vol, dir_ino, fn, arg);
+    unlock_dir(vol, dir_ino);
+    return res;
+}
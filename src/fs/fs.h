@@ -0,0 +1,53 @@
+#pragma once
+
+//public interface of libfs: mount handle, namespace operations and file handles.
+//Every call returns FS_OK or a negative FS_ERR_* code and never prints or exits.
+//Mounted with the "threads" option, a volume can be used by several threads at once.
+#include "errors.h"
+#include "disk.h"
+#include "fat.h"
+#include "volume.h"
+#include "entry.h"
+#include "dir.h"
+#include "file.h"
+#include "fsck.h"
+
+//create and mount a new sparse image of size bytes with blocks of opts->block_size bytes that can grow up to
+//opts->max_size (MIN_DISK_SIZE to max_disk_size, rounded down to whole blocks); the FAT for the maximum size
+//must fit in the initial one
+int fs_format(Volume* vol, const char* filename, size_t size, const MountOptions* opts);
+
+//mount an existing image at the size its metainfo records; on FS_ERR_VERSION vol->info.version holds the version found
+int fs_mount(Volume* vol, const char* filename, const MountOptions* opts);
+
+//grow a mounted image to new_size bytes (rounded down to whole blocks, up to the maximum set at format);
+//the new space gets its share of inodes and is usable right away
+int fs_grow(Volume* vol, size_t new_size);
+
+//punch every free block out of the image file so it takes host space only for live data; stores the
+//blocks punched in discarded if not NULL
+int fs_trim(Volume* vol, uint64_t* discarded);
+
+//write everything back and release the mount
+int fs_unmount(Volume* vol);
+
+//flush every pending write to the disk file
+int fs_sync(Volume* vol);
+
+//find a child of a directory, stores its inode in ino
+int fs_lookup(Volume* vol, uint32_t dir_ino, const char* name, uint8_t type, uint32_t* ino);
+
+//create a directory, stores its inode in ino if not NULL
+int fs_mkdir(Volume* vol, uint32_t parent_ino, const char* name, uint32_t* ino);
+
+//remove an empty directory
+int fs_rmdir(Volume* vol, uint32_t parent_ino, const char* name);
+
+//create an empty file, stores its inode in ino if not NULL
+int fs_create(Volume* vol, uint32_t parent_ino, const char* name, uint32_t* ino);
+
+//remove a file that is not open
+int fs_unlink(Volume* vol, uint32_t parent_ino, const char* name);
+
+//call fn on every child of a directory, stops early and returns fn's result if it is not 0
+int fs_readdir(Volume* vol, uint32_t dir_ino, int (*fn)(const Dirent* d, void* arg), void* arg);
@@ -0,0 +1,536 @@
+#include "fsck.h"
+#include <stdarg.h>
+
+#define OWNER_NONE      0           //block not reached by any chain (inode 0 never owns blocks)
+#define OWNER_RESERVED  FAT_EOC     //block of the metainfo, FAT, inode table or journal
+
+//a chain to cut after keep blocks, tail being the last one kept
+typedef struct {
+    uint32_t ino;
+    uint32_t keep;
+    uint32_t tail;
+} ChainFix;
+
+//a dirent to drop, or to give the size of its child once the chains are fixed
+typedef struct {
+    uint32_t block;
+    uint32_t slot;
+    uint32_t ino;
+    bool drop;
+} DirentFix;
+
+//a directory whose child count is wrong
+typedef struct {
+    uint32_t ino;
+    uint32_t children;
+} CountFix;
+
+//state shared by the workers of a check
+typedef struct {
+    Volume* vol;
+    const FsckOptions* opts;
+    FsckReport* report;
+    uint32_t data_start;        //first block after the reserved area
+    uint32_t* owner;            //owner[b]: inode whose chain holds block b
+    uint8_t* reached;           //one bit per inode linked from the tree
+    bool bad_reserved;          //the reserved area is not a single chain
+    bool failed;                //a worker ran out of memory
+    bool read_failed;           //a block of the tables could not be read (or the repair written), the check cannot be trusted
+    uint32_t* queue;            //directories waiting to be walked
+    uint32_t queued;
+    uint32_t queue_capacity;
+    uint32_t pending;           //directories queued or being walked
+    ChainFix* chains;
+    uint32_t num_chains, chains_capacity;
+    DirentFix* dirents;
+    uint32_t num_dirents, dirents_capacity;
+    CountFix* counts;
+    uint32_t num_counts, counts_capacity;
+    pthread_mutex_t lock;       //report, queue and fix lists
+    pthread_cond_t work;        //signalled when a directory is queued or the walk is over
+} Fsck;
+
+//a worker thread and the slice of blocks or inodes it scans
+typedef struct {
+    Fsck* ck;
+    uint32_t from;
+    uint32_t to;
+    uint32_t found;             //free blocks or used inodes seen in the slice
+} Worker;
+
+//append an item to a growable array, with the check lock held
+static bool push_item(Fsck* ck, void** items, uint32_t* count, uint32_t* capacity, size_t size, const void* item) {
+    if (*count == *capacity) {
+        uint32_t new_capacity = *capacity > 0 ? *capacity * 2 : 64;
+        void* grown = realloc(*items, (size_t)new_capacity * size);
+        if (grown == NULL) {
+            ck->failed = true;
+            return false;
+        }
+        *items = grown;
+        *capacity = new_capacity;
+    }
+    memcpy((char*)*items + (size_t)*count * size, item, size);
+    (*count)++;
+    return true;
+}
+
+//count n problems and describe them through the caller's callback
+static void problem(Fsck* ck, uint32_t* counter, uint32_t n, const char* fmt, ...) {
+    char msg[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    pthread_mutex_lock(&ck->lock);
+    *counter += n;
+    if (ck->opts->problem != NULL) ck->opts->problem(msg, ck->opts->arg);
+    pthread_mutex_unlock(&ck->lock);
+}
+
+//note a block that could not be read: the rest of the check goes on, but nothing is repaired
+static void read_failure(Fsck* ck) {
+    __atomic_store_n(&ck->read_failed, true, __ATOMIC_RELAXED);
+}
+
+//remember a chain to cut
+static void add_chain_fix(Fsck* ck, uint32_t ino, uint32_t keep, uint32_t tail) {
+    ChainFix fix = {ino, keep, tail};
+    pthread_mutex_lock(&ck->lock);
+    push_item(ck, (void**)&ck->chains, &ck->num_chains, &ck->chains_capacity, sizeof(ChainFix), &fix);
+    pthread_mutex_unlock(&ck->lock);
+}
+
+//remember a dirent to fix
+static void add_dirent_fix(Fsck* ck, uint32_t block, uint32_t slot, uint32_t ino, bool drop) {
+    DirentFix fix = {block, slot, ino, drop};
+    pthread_mutex_lock(&ck->lock);
+    push_item(ck, (void**)&ck->dirents, &ck->num_dirents, &ck->dirents_capacity, sizeof(DirentFix), &fix);
+    pthread_mutex_unlock(&ck->lock);
+}
+
+//queue a directory for the walk
+static void enqueue_dir(Fsck* ck, uint32_t ino) {
+    pthread_mutex_lock(&ck->lock);
+    if (push_item(ck, (void**)&ck->queue, &ck->queued, &ck->queue_capacity, sizeof(uint32_t), &ino)) {
+        ck->pending++;
+        pthread_cond_signal(&ck->work);
+    }
+    pthread_mutex_unlock(&ck->lock);
+}
+
+//walk the data chain of an entry, claiming its blocks; a broken chain is cut before the first bad block
+static void check_chain(Fsck* ck, const Entry* e) {
+    Volume* vol = ck->vol;
+    uint32_t block = e->start_block, last = FAT_EOC, i = 0;
+    uint32_t* counter = &ck->report->bad_chains;
+    const char* why = NULL;
+    uint32_t other = OWNER_NONE;
+    for (; i < e->num_blocks; i++) {
+        if (block == FAT_EOC) {
+            why = "ends early";
+            break;
+        }
+        if (block < ck->data_start || block >= vol->num_fat_entries) {
+            why = "leaves the data area";
+            break;
+        }
+        if (vol->fat[block] == FAT_FREE) {
+            why = "runs into a free block";
+            break;
+        }
+        //the first chain to claim a block owns it, any later one is cross-linked or looping
+        other = OWNER_NONE;
+        if (!__atomic_compare_exchange_n(&ck->owner[block], &other, e->ino, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            if (other == e->ino) why = "loops";
+            else if (other == OWNER_RESERVED) why = "leaves the data area";
+            else {
+                why = "is cross-linked";
+                counter = &ck->report->cross_links;
+            }
+            break;
+        }
+        last = block;
+        block = vol->fat[block];
+    }
+    if (why == NULL && block != FAT_EOC) why = "is longer than recorded";
+    if (why != NULL) {
+        if (counter == &ck->report->cross_links)
+            problem(ck, counter, 1, "inode %u (%.*s): chain is cross-linked with inode %u at block %u", e->ino, MAX_NAME_LEN, e->name, other, block);
+        else
+            problem(ck, counter, 1, "inode %u (%.*s): chain %s after %u of %u blocks", e->ino, MAX_NAME_LEN, e->name, why, i, e->num_blocks);
+        add_chain_fix(ck, e->ino, i, last);
+        return;
+    }
+    //files may not claim more bytes than their blocks (or the record) hold
+    size_t capacity = has_inline_data(e) ? INLINE_DATA_SIZE : (size_t)e->num_blocks << vol->disk.block_shift;
+    bool bad_size = e->type == ENTRY_TYPE_FILE && e->size > capacity;
+    if (bad_size) problem(ck, &ck->report->bad_counts, 1, "inode %u (%.*s): size %" PRIu64 " exceeds its %zu bytes of storage", e->ino, MAX_NAME_LEN, e->name, e->size, capacity);
+    if (last != e->tail_block) problem(ck, &ck->report->bad_counts, 1, "inode %u (%.*s): tail is block %u, chain ends at %u", e->ino, MAX_NAME_LEN, e->name, e->tail_block, last);
+    if (bad_size || last != e->tail_block) add_chain_fix(ck, e->ino, i, last);
+}
+
+//validate the child a dirent points to and queue it if it is a directory, false if the dirent is bad
+static bool check_child(Fsck* ck, uint32_t dir_ino, const Dirent* d) {
+    Volume* vol = ck->vol;
+    if (d->ino >= vol->info.inode_count) {
+        problem(ck, &ck->report->bad_dirents, 1, "directory %u: dirent %.*s points outside the inode table (%u)", dir_ino, MAX_NAME_LEN, d->name, d->ino);
+        return false;
+    }
+    const Entry* e = get_entry(vol, d->ino);
+    //an unreadable record says nothing about the dirent, which is kept
+    if (e == NULL) {
+        read_failure(ck);
+        return true;
+    }
+    if (e->ino != d->ino) {
+        problem(ck, &ck->report->bad_dirents, 1, "directory %u: dirent %.*s points to free inode %u", dir_ino, MAX_NAME_LEN, d->name, d->ino);
+        return false;
+    }
+    if (e->type != d->type || e->parent_ino != dir_ino || strncmp(e->name, d->name, MAX_NAME_LEN) != 0) {
+        problem(ck, &ck->report->bad_dirents, 1, "directory %u: dirent %.*s does not match inode %u", dir_ino, MAX_NAME_LEN, d->name, d->ino);
+        return false;
+    }
+    uint8_t bit = 1u << (d->ino % 8);
+    if (__atomic_fetch_or(&ck->reached[d->ino / 8], bit, __ATOMIC_RELAXED) & bit) {
+        problem(ck, &ck->report->bad_dirents, 1, "directory %u: dirent %.*s links inode %u a second time", dir_ino, MAX_NAME_LEN, d->name, d->ino);
+        return false;
+    }
+    if (e->type == ENTRY_TYPE_DIR) {
+        __atomic_fetch_add(&ck->report->dirs, 1, __ATOMIC_RELAXED);
+        enqueue_dir(ck, d->ino);
+    } else {
+        __atomic_fetch_add(&ck->report->files, 1, __ATOMIC_RELAXED);
+        check_chain(ck, e);
+    }
+    return true;
+}
+
+//check a directory: its chain, every dirent of its buckets and its child count
+static void walk_dir(Fsck* ck, uint32_t dir_ino) {
+    Volume* vol = ck->vol;
+    const Entry* dir = get_entry(vol, dir_ino);
+    if (dir == NULL) {
+        read_failure(ck);
+        return;
+    }
+    check_chain(ck, dir);
+    uint32_t children = 0;
+    //only blocks the chain walk gave to this directory are trusted as its index and buckets
+    uint32_t index_block = dir->start_block;
+    if (index_block < vol->num_fat_entries && ck->owner[index_block] == dir_ino) {
+        const DirIndex* idx = get_block(&vol->disk, index_block);
+        if (idx == NULL) {
+            read_failure(ck);
+            return;
+        }
+        if (idx->num_buckets > DIR_MAX_BUCKETS(&vol->disk)) {
+            problem(ck, &ck->report->bad_chains, 1, "directory %u (%.*s): index lists %u buckets", dir_ino, MAX_NAME_LEN, dir->name, idx->num_buckets);
+            pthread_mutex_lock(&ck->lock);
+            ck->report->unrepaired++;
+            pthread_mutex_unlock(&ck->lock);
+            return;
+        }
+        for (uint32_t b = 0; b < idx->num_buckets; b++) {
+            uint32_t block = idx->buckets[b];
+            if (block >= vol->num_fat_entries || ck->owner[block] != dir_ino) {
+                problem(ck, &ck->report->bad_chains, 1, "directory %u (%.*s): bucket %u is not in its chain", dir_ino, MAX_NAME_LEN, dir->name, b);
+                continue;
+            }
+            const Dirent* bucket = get_block(&vol->disk, block);
+            if (bucket == NULL) {
+                read_failure(ck);
+                continue;
+            }
+            for (uint32_t slot = 0; slot < DIRENTS_PER_BLOCK(&vol->disk); slot++) {
+                const Dirent* d = &bucket[slot];
+                if (d->ino == 0) continue;
+                if (!check_child(ck, dir_ino, d)) {
+                    add_dirent_fix(ck, block, slot, 0, true);
+                    continue;
+                }
+                children++;
+                //the dirent caches the child size for listings
+                const Entry* child = get_entry(vol, d->ino);
+                if (child != NULL && child->type == ENTRY_TYPE_FILE && d->size != child->size) {
+                    problem(ck, &ck->report->bad_counts, 1, "directory %u: dirent %.*s says %" PRIu64 " bytes, the file has %" PRIu64, dir_ino, MAX_NAME_LEN, d->name, d->size, child->size);
+                    add_dirent_fix(ck, block, slot, d->ino, false);
+                }
+            }
+        }
+    }
+    if (children != dir->num_children) {
+        problem(ck, &ck->report->bad_counts, 1, "directory %u (%.*s): %u children recorded, %u found", dir_ino, MAX_NAME_LEN, dir->name, dir->num_children, children);
+        CountFix fix = {dir_ino, children};
+        pthread_mutex_lock(&ck->lock);
+        push_item(ck, (void**)&ck->counts, &ck->num_counts, &ck->counts_capacity, sizeof(CountFix), &fix);
+        pthread_mutex_unlock(&ck->lock);
+    }
+}
+
+//take directories off the queue until the whole tree is walked
+static void* walk_worker(void* arg) {
+    Fsck* ck = ((Worker*)arg)->ck;
+    pthread_mutex_lock(&ck->lock);
+    for (;;) {
+        while (ck->queued == 0 && ck->pending > 0) pthread_cond_wait(&ck->work, &ck->lock);
+        if (ck->queued == 0) break;
+        uint32_t ino = ck->queue[--ck->queued];
+        pthread_mutex_unlock(&ck->lock);
+        walk_dir(ck, ino);
+        pthread_mutex_lock(&ck->lock);
+        //the last directory done with nothing queued ends the walk
+        if (--ck->pending == 0) pthread_cond_broadcast(&ck->work);
+    }
+    pthread_mutex_unlock(&ck->lock);
+    return NULL;
+}
+
+//scan a slice of the FAT for free blocks and for used blocks no chain reached
+static void* fat_worker(void* arg) {
+    Worker* w = arg;
+    Fsck* ck = w->ck;
+    const uint32_t* fat = ck->vol->fat;
+    w->found = fat_count(fat + w->from, w->to - w->from, FAT_FREE);
+    uint32_t b = w->from;
+    while (b < w->to) {
+        //skip to the next orphan, then report its whole run at once
+        b += fat_find_orphan(fat + b, ck->owner + b, w->to - b);
+        if (b == w->to) break;
+        uint32_t start = b;
+        while (b < w->to && fat[b] != FAT_FREE && ck->owner[b] == OWNER_NONE) b++;
+        problem(ck, &ck->report->orphan_blocks, b - start, "blocks %u-%u are in use but no chain reaches them", start, b - 1);
+    }
+    return NULL;
+}
+
+//scan a slice of the inode table for used inodes no directory links
+static void* inode_worker(void* arg) {
+    Worker* w = arg;
+    Fsck* ck = w->ck;
+    for (uint32_t ino = w->from; ino < w->to; ino++) {
+        const Entry* e = get_entry(ck->vol, ino);
+        if (e == NULL) read_failure(ck);
+        if (e == NULL || e->ino != ino) continue;
+        w->found++;
+        if (!(ck->reached[ino / 8] & (1u << (ino % 8))))
+            problem(ck, &ck->report->orphan_inodes, 1, "inode %u (%.*s) is in use but not linked", ino, MAX_NAME_LEN, e->name);
+    }
+    return NULL;
+}
+
+//run fn on n threads, each over a slice of [from, to); returns what the slices found
+static uint32_t run_workers(Fsck* ck, int n, void* (*fn)(void*), uint32_t from, uint32_t to) {
+    Worker workers[FSCK_MAX_THREADS];
+    pthread_t threads[FSCK_MAX_THREADS];
+    bool started[FSCK_MAX_THREADS];
+    uint32_t slice = (to - from + n - 1) / n;
+    for (int i = 0; i < n; i++) {
+        uint32_t start = from + (uint32_t)i * slice;
+        workers[i] = (Worker){ck, start < to ? start : to, start + slice < to ? start + slice : to, 0};
+        started[i] = pthread_create(&threads[i], NULL, fn, &workers[i]) == 0;
+        //without a thread the slice is done right here
+        if (!started[i]) fn(&workers[i]);
+    }
+    uint32_t found = 0;
+    for (int i = 0; i < n; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+        found += workers[i].found;
+    }
+    return found;
+}
+
+//a reserved run of blocks must be the single chain format or grow gave it
+static void check_reserved_run(Fsck* ck, uint32_t start, uint32_t end) {
+    const uint32_t* fat = ck->vol->fat;
+    for (uint32_t b = start; b < end; b++) {
+        ck->owner[b] = OWNER_RESERVED;
+        uint32_t expected = b + 1 < end ? b + 1 : FAT_EOC;
+        if (fat[b] != expected && !ck->bad_reserved) {
+            problem(ck, &ck->report->bad_chains, 1, "reserved block %u is not chained to the next one", b);
+            ck->bad_reserved = true;
+        }
+    }
+}
+
+//the metainfo, FAT, first inode table extent and journal form one chain, every later extent its own
+static void check_reserved(Fsck* ck) {
+    const DiskInfo* info = &ck->vol->info;
+    check_reserved_run(ck, 0, ck->data_start);
+    for (uint32_t i = 1; i < info->inode_extents; i++) {
+        const InodeExtent* extent = &info->inode_table[i];
+        if (extent->start < ck->data_start || extent->start + extent->blocks > ck->vol->num_fat_entries) {
+            //without its extent part of the inode table is gone, nothing sensible can be repaired
+            problem(ck, &ck->report->bad_chains, 1, "inode table extent %u lies outside the data area", i);
+            ck->report->unrepaired++;
+            continue;
+        }
+        check_reserved_run(ck, extent->start, extent->start + extent->blocks);
+    }
+}
+
+//chain a reserved run of blocks again
+//commit the fixes applied so far if the open transaction might not take blocks more; a fix is never split,
+//a crash between two commits leaves the volume partly repaired
+static void make_room(Fsck* ck, uint32_t blocks) {
+    if (make_tx_room(ck->vol, blocks) != 0) ck->read_failed = true;
+}
+
+static void rechain_run(Fsck* ck, uint32_t start, uint32_t end) {
+    Volume* vol = ck->vol;
+    for (uint32_t b = start; b < end; b++) {
+        if (b == start || b % FAT_ENTRIES_PER_BLOCK(vol) == 0) make_room(ck, 1);
+        set_fat_entry(vol, b, b + 1 < end ? b + 1 : FAT_EOC);
+    }
+}
+
+//apply every fix found by the check, committed whenever the open transaction fills up
+static void repair(Fsck* ck) {
+    Volume* vol = ck->vol;
+    FsckReport* report = ck->report;
+    if (ck->bad_reserved) {
+        rechain_run(ck, 0, ck->data_start);
+        for (uint32_t i = 1; i < vol->info.inode_extents; i++) {
+            const InodeExtent* extent = &vol->info.inode_table[i];
+            if (extent->start >= ck->data_start && extent->start + extent->blocks <= vol->num_fat_entries)
+                rechain_run(ck, extent->start, extent->start + extent->blocks);
+        }
+    }
+    for (uint32_t i = 0; i < ck->num_chains; i++) {
+        const ChainFix* fix = &ck->chains[i];
+        //the entry, the FAT block of the new tail and the dirent of the entry
+        make_room(ck, 3);
+        Entry* e = get_entry_mut(vol, fix->ino);
+        //a directory cut short would lose its index or buckets
+        if (e == NULL || (e->type == ENTRY_TYPE_DIR && fix->keep < e->num_blocks)) {
+            report->unrepaired++;
+            continue;
+        }
+        //inline data survives only in a file that had no chain to begin with
+        size_t capacity = has_inline_data(e) ? INLINE_DATA_SIZE : (size_t)fix->keep << vol->disk.block_shift;
+        if (fix->keep == 0) e->start_block = FAT_EOC;
+        else set_fat_entry(vol, fix->tail, FAT_EOC);
+        e->tail_block = fix->tail;
+        e->num_blocks = fix->keep;
+        mark_entry_dirty(vol, fix->ino);
+        if (e->type == ENTRY_TYPE_FILE && e->size > capacity) {
+            e->size = capacity;
+            refresh_parent_dirent(vol, e);
+        }
+    }
+    for (uint32_t i = 0; i < ck->num_dirents; i++) {
+        const DirentFix* fix = &ck->dirents[i];
+        make_room(ck, 1);
+        Dirent* bucket = get_block_mut(&vol->disk, fix->block);
+        const Entry* child = fix->drop ? NULL : get_entry(vol, fix->ino);
+        if (bucket == NULL || (!fix->drop && child == NULL)) {
+            report->unrepaired++;
+            continue;
+        }
+        if (fix->drop) memset(&bucket[fix->slot], 0, sizeof(Dirent));
+        else bucket[fix->slot].size = child->size;
+        mark_meta_dirty(vol, fix->block);
+    }
+    for (uint32_t i = 0; i < ck->num_counts; i++) {
+        make_room(ck, 1);
+        Entry* dir = get_entry_mut(vol, ck->counts[i].ino);
+        if (dir == NULL) {
+            report->unrepaired++;
+            continue;
+        }
+        dir->num_children = ck->counts[i].children;
+        mark_entry_dirty(vol, ck->counts[i].ino);
+    }
+    //unlinked inodes go first, their blocks are orphans too
+    for (uint32_t ino = 1; ino < vol->info.inode_count; ino++) {
+        const Entry* e = get_entry(vol, ino);
+        if (e != NULL && e->ino == ino && !(ck->reached[ino / 8] & (1u << (ino % 8)))) {
+            make_room(ck, 1);
+            free_inode(vol, ino);
+        }
+    }
+    uint32_t n = vol->num_fat_entries;
+    for (uint32_t b = fat_find_orphan(vol->fat, ck->owner, n); b < n; b += fat_find_orphan(vol->fat + b, ck->owner + b, n - b)) {
+        make_room(ck, 1);
+        set_fat_entry(vol, b, FAT_FREE);
+    }
+    //free-space bitmap, group and inode counters are rebuilt from the repaired tables
+    build_block_map(vol);
+    if (scan_inode_table(vol) != 0) ck->read_failed = true;
+    uint32_t used_inodes = 0;
+    for (uint32_t ino = 1; ino < vol->info.inode_count; ino++)
+        if (vol->inode_map[ino / 8] & (1u << (ino % 8))) used_inodes++;
+    vol->info.free_inodes = vol->info.inode_count - 1 - used_inodes;
+    mark_info_dirty(vol);
+    if (sync_volume(vol) != 0) ck->read_failed = true;
+    report->repaired = fsck_problems(report) - report->unrepaired;
+}
+
+//number of problems in a report
+uint32_t fsck_problems(const FsckReport* report) {
+    return report->bad_chains + report->cross_links + report->bad_dirents + report->orphan_blocks +
+           report->orphan_inodes + report->bad_counts;
+}
+
+//check a mounted volume, walking the tree and scanning the FAT and inode table with several threads;
+//returns FS_OK when the check ran (the report says if the volume is clean) or an FS_ERR_* code.
+//Pending writes are flushed first; nothing else may use the volume until the check returns
+int fs_check(Volume* vol, const FsckOptions* opts, FsckReport* report) {
+    memset(report, 0, sizeof(FsckReport));
+    //the check reads the tables as they are on disk, pending writes included
+    if (sync_volume(vol) != 0) return FS_ERR_IO;
+    int threads = opts->threads > 0 ? opts->threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+    if (threads > FSCK_MAX_THREADS) threads = FSCK_MAX_THREADS;
+    Fsck ck;
+    memset(&ck, 0, sizeof(Fsck));
+    ck.vol = vol;
+    ck.opts = opts;
+    ck.report = report;
+    ck.data_start = vol->info.journal_start + vol->info.journal_blocks;
+    ck.owner = calloc(vol->num_fat_entries, sizeof(uint32_t));
+    ck.reached = calloc((vol->info.inode_count + 7) / 8, 1);
+    if (ck.owner == NULL || ck.reached == NULL) {
+        free(ck.owner);
+        free(ck.reached);
+        return FS_ERR_NO_MEMORY;
+    }
+    pthread_mutex_init(&ck.lock, NULL);
+    pthread_cond_init(&ck.work, NULL);
+    check_reserved(&ck);
+    int res = FS_OK;
+    const Entry* root = get_entry(vol, ROOT_INO);
+    if (root == NULL) {
+        read_failure(&ck);
+    } else if (root->ino != ROOT_INO || root->type != ENTRY_TYPE_DIR) {
+        //without a root everything would look unreachable, nothing can be checked or repaired
+        problem(&ck, &report->bad_dirents, 1, "the root directory is damaged");
+        report->unrepaired = fsck_problems(report);
+        res = FS_ERR_CORRUPT;
+    } else {
+        ck.reached[ROOT_INO / 8] |= 1u << (ROOT_INO % 8);
+        report->dirs = 1;
+        enqueue_dir(&ck, ROOT_INO);
+        //directories are walked in parallel, then the FAT and the inode table are scanned in slices
+        run_workers(&ck, threads, walk_worker, 0, threads);
+        uint32_t free_blocks = run_workers(&ck, threads, fat_worker, 0, vol->num_fat_entries);
+        uint32_t used_inodes = run_workers(&ck, threads, inode_worker, 1, vol->info.inode_count);
+        report->used_blocks = vol->num_fat_entries - free_blocks;
+        if (vol->info.free_blocks != free_blocks)
+            problem(&ck, &report->bad_counts, 1, "metainfo records %zu free blocks, the FAT has %u", vol->info.free_blocks, free_blocks);
+        if (vol->info.free_inodes != vol->info.inode_count - 1 - used_inodes)
+            problem(&ck, &report->bad_counts, 1, "metainfo records %u free inodes, the table has %u", vol->info.free_inodes, vol->info.inode_count - 1 - used_inodes);
+        if (!ck.failed && !ck.read_failed && opts->repair && fsck_problems(report) > 0) repair(&ck);
+        if (ck.failed) res = FS_ERR_NO_MEMORY;
+    }
+    if (res == FS_OK && ck.read_failed) res = FS_ERR_IO;
+    pthread_mutex_destroy(&ck.lock);
+    pthread_cond_destroy(&ck.work);
+    free(ck.owner);
+    free(ck.reached);
+    free(ck.queue);
+    free(ck.chains);
+    free(ck.dirents);
+    free(ck.counts);
+    return res;
+}
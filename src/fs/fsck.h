@@ -0,0 +1,43 @@
+#pragma once
+
+#include "disk.h"
+#include "fat.h"
+#include "entry.h"
+#include "dir.h"
+#include "volume.h"
+#include "errors.h"
+#include "../utils/utils.h"
+
+#define FSCK_MAX_THREADS 64
+
+//how fs_check runs
+typedef struct {
+    int threads;                //worker threads, 0 for one per CPU
+    bool repair;                //fix what can be fixed once the check is done
+    void (*problem)(const char* msg, void* arg);    //called once per problem found, may be NULL
+    void* arg;                  //passed to problem
+} FsckOptions;
+
+//what fs_check found
+typedef struct {
+    uint32_t dirs;              //directories reached from the root
+    uint32_t files;             //files reached from the root
+    uint32_t used_blocks;       //blocks in use according to the FAT
+    uint32_t bad_chains;        //chains that are broken, cyclic, too short or too long
+    uint32_t cross_links;       //blocks claimed by two chains
+    uint32_t bad_dirents;       //dirents pointing to a missing, mismatched or already linked inode
+    uint32_t orphan_blocks;     //blocks in use that no chain reaches
+    uint32_t orphan_inodes;     //inodes in use that no directory reaches
+    uint32_t bad_counts;        //wrong free counters, child counts, sizes or tails
+    uint32_t repaired;          //problems fixed by the repair pass
+    uint32_t unrepaired;        //problems the repair pass had to leave
+} FsckReport;
+
+//check a mounted volume, walking the tree and scanning the FAT and inode table with several threads;
+//returns FS_OK when the check ran (the report says if the volume is clean) or an FS_ERR_* code;
+//FS_ERR_IO if a block of the tables could not be read, in which case nothing is repaired.
+//Pending writes are flushed first; nothing else may use the volume until the check returns
+int fs_check(Volume* vol, const FsckOptions* opts, FsckReport* report);
+
+//number of problems in a report
+uint32_t fsck_problems(const FsckReport* report);
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "disk.h"
+#include "../utils/utils.h"
+
+#define MAX_OPEN_FILES 64
+
+//open file: the inode resolved at open time and an index of its data blocks, so an offset maps to a block in O(1)
+typedef struct {
+    uint32_t ino;               //inode of the file, 0 for a free slot
+    uint32_t refs;              //handles sharing this slot
+    uint32_t* blocks;           //blocks[i] is the i-th data block of the file
+    uint32_t num_indexed;       //blocks in the index, always the entry's num_blocks
+    uint32_t capacity;          //room in blocks
+    pthread_rwlock_t lock;      //threaded mode: shared by readers, exclusive for writers
+} OpenFile;
+
+//open-file table of a volume, a file opened twice shares its slot
+typedef struct {
+    OpenFile files[MAX_OPEN_FILES];
+    pthread_mutex_t lock;       //threaded mode: taken to open and close
+} FileTable;
@@ -0,0 +1,310 @@
+#include "ioqueue.h"
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+
+//fill in a request
+void ioq_prep(IoRequest* req, int op, void* buf, size_t len, off_t offset) {
+    req->op = op;
+    req->iov.iov_base = buf;
+    req->iov.iov_len = len;
+    req->offset = offset;
+    req->error = 0;
+    req->in_flight = false;
+    req->pending = NULL;
+}
+
+//account for done bytes of a request; a read that hit the end of the file reads zeros for the rest
+static void advance_request(IoRequest* req, size_t done) {
+    if (done == 0 && req->op == IOQ_READ) {
+        memset(req->iov.iov_base, 0, req->iov.iov_len);
+        done = req->iov.iov_len;
+    }
+    req->iov.iov_base = (char*)req->iov.iov_base + done;
+    req->iov.iov_len -= done;
+    req->offset += done;
+}
+
+//finish a request in the calling thread with pread/pwrite
+static void complete_request(int fd, IoRequest* req) {
+    while (req->iov.iov_len > 0 && req->error == 0) {
+        ssize_t n = req->op == IOQ_READ ? pread(fd, req->iov.iov_base, req->iov.iov_len, req->offset)
+                                        : pwrite(fd, req->iov.iov_base, req->iov.iov_len, req->offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 || (n == 0 && req->op == IOQ_WRITE)) req->error = n < 0 ? errno : EIO;
+        else advance_request(req, n);
+    }
+}
+
+//---io_uring---
+
+static int ring_setup(unsigned entries, struct io_uring_params* p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int ring_enter(int fd, unsigned to_submit, unsigned min_complete) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+//release the mappings and descriptor of a ring
+static void ring_close(IoRing* r) {
+    if (r->sqes != NULL) munmap(r->sqes, r->entries * sizeof(struct io_uring_sqe));
+    if (r->cq_ring != NULL && r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_size);
+    if (r->sq_ring != NULL) munmap(r->sq_ring, r->sq_ring_size);
+    if (r->fd >= 0) close(r->fd);
+    r->fd = -1;
+    r->sqes = NULL;
+    r->sq_ring = r->cq_ring = NULL;
+}
+
+//create a ring of at least depth entries and map its queues, -1 if the kernel does not offer io_uring
+static int ring_open(IoRing* r, unsigned depth) {
+    struct io_uring_params p;
+    memset(r, 0, sizeof(IoRing));
+    memset(&p, 0, sizeof(p));
+    r->fd = ring_setup(depth, &p);
+    if (r->fd < 0) return -1;
+    r->entries = p.sq_entries;
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    //newer kernels map both rings at once
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && r->cq_ring_size > r->sq_ring_size) r->sq_ring_size = r->cq_ring_size;
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) r->sq_ring = NULL;
+    r->cq_ring = single ? r->sq_ring : mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_ring == MAP_FAILED) r->cq_ring = NULL;
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) r->sqes = NULL;
+    if (r->sq_ring == NULL || r->cq_ring == NULL || r->sqes == NULL) {
+        ring_close(r);
+        return -1;
+    }
+    char* sq = r->sq_ring;
+    char* cq = r->cq_ring;
+    r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->cq_head = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    pthread_mutex_init(&r->lock, NULL);
+    return 0;
+}
+
+//put a request on the submission queue, tagged with its index in the batch
+static void ring_push(IoRing* r, int fd, IoRequest* req, uint32_t index) {
+    unsigned tail = *r->sq_tail;
+    unsigned slot = tail & *r->sq_mask;
+    struct io_uring_sqe* sqe = &r->sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = req->op == IOQ_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)&req->iov;
+    sqe->len = 1;
+    sqe->off = req->offset;
+    sqe->user_data = index;
+    r->sq_array[slot] = slot;
+    //the kernel sees the entry only once the tail moves past it
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+//reap every completion posted so far, returns how many; a request that came back short is finished
+//synchronously, which only happens near the end of the file or on errors
+static uint32_t ring_reap(IoRing* r, int fd, IoRequest* reqs) {
+    uint32_t reaped = 0;
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        const struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+        IoRequest* req = &reqs[cqe->user_data];
+        req->in_flight = false;
+        if (cqe->res < 0 && cqe->res != -EINTR && cqe->res != -EAGAIN) req->error = -cqe->res;
+        else {
+            if (cqe->res >= 0) advance_request(req, cqe->res);
+            complete_request(fd, req);
+        }
+        reaped++;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    return reaped;
+}
+
+//run a batch through a ring: refill the submission queue as completions come in, so up to depth requests are
+//always in flight. The kernel takes the entries in order and *taken counts them. Returns -1 if io_uring_enter
+//itself failed: every request taken has then completed, or failed with EIO if it could not be waited for,
+//and the ones from *taken on never reached the kernel
+static int ring_run(IoRing* r, int fd, unsigned depth, IoRequest* reqs, uint32_t n, uint32_t* taken) {
+    uint32_t next = 0, completed = 0;
+    *taken = 0;
+    if (depth > r->entries) depth = r->entries;
+    while (completed < n) {
+        while (next < n && next - completed < depth) {
+            ring_push(r, fd, &reqs[next], next);
+            next++;
+        }
+        //a failed call took nothing, a short one leaves the rest on the submission queue for the next
+        int res = ring_enter(r->fd, next - *taken, 1);
+        if (res < 0 && errno == EINTR) continue;
+        if (res < 0) break;
+        for (; res > 0; res--) reqs[(*taken)++].in_flight = true;
+        completed += ring_reap(r, fd, reqs);
+    }
+    if (completed == n) return 0;
+    //wait for everything the kernel took, so no late read or write lands after the caller moves on
+    while (completed < *taken) {
+        if (ring_enter(r->fd, 0, 1) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) break;
+        completed += ring_reap(r, fd, reqs);
+    }
+    //requests that could not be waited for are failed, never done a second time
+    for (uint32_t i = 0; i < *taken; i++) {
+        if (reqs[i].in_flight) reqs[i].error = EIO;
+    }
+    return -1;
+}
+
+//---thread pool---
+
+//take requests off the queue and run them until the pool stops
+static void* pool_worker(void* arg) {
+    IoQueue* q = arg;
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        while (q->count == 0 && !q->stopping) pthread_cond_wait(&q->work, &q->lock);
+        if (q->count == 0) break;
+        IoRequest* req = q->slots[q->head];
+        q->head = (q->head + 1) % q->depth;
+        q->count--;
+        pthread_mutex_unlock(&q->lock);
+        complete_request(q->fd, req);
+        pthread_mutex_lock(&q->lock);
+        (*req->pending)--;
+        pthread_cond_broadcast(&q->done);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+//queue every request of the batch as slots free up and wait for the workers to finish them
+static void pool_run(IoQueue* q, IoRequest* reqs, uint32_t n) {
+    uint32_t pending = n;
+    pthread_mutex_lock(&q->lock);
+    for (uint32_t i = 0; i < n; i++) {
+        while (q->count == q->depth) pthread_cond_wait(&q->done, &q->lock);
+        reqs[i].pending = &pending;
+        q->slots[(q->head + q->count) % q->depth] = &reqs[i];
+        q->count++;
+        pthread_cond_signal(&q->work);
+    }
+    while (pending > 0) pthread_cond_wait(&q->done, &q->lock);
+    pthread_mutex_unlock(&q->lock);
+}
+
+//start the fallback pool
+static int pool_start(IoQueue* q) {
+    q->slots = calloc(q->depth, sizeof(IoRequest*));
+    q->num_workers = q->depth < IOQ_POOL_MAX ? q->depth : IOQ_POOL_MAX;
+    q->workers = calloc(q->num_workers, sizeof(pthread_t));
+    if (q->slots == NULL || q->workers == NULL) return -1;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->work, NULL);
+    pthread_cond_init(&q->done, NULL);
+    for (unsigned i = 0; i < q->num_workers; i++) {
+        if (pthread_create(&q->workers[i], NULL, pool_worker, q) != 0) {
+            q->num_workers = i;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//set up a queue of depth requests (1 to MAX_QUEUE_DEPTH) on fd: io_uring unless pool is true or the
+//kernel refuses it, then a thread pool. A queue used by several threads gets IOQ_RINGS rings
+int ioq_init(IoQueue* q, int fd, unsigned depth, bool pool, bool threaded) {
+    memset(q, 0, sizeof(IoQueue));
+    if (depth == 0 || depth > MAX_QUEUE_DEPTH) return -1;
+    q->fd = fd;
+    q->depth = depth;
+    if (!pool) {
+        q->num_rings = threaded ? IOQ_RINGS : 1;
+        q->rings = calloc(q->num_rings, sizeof(IoRing));
+        if (q->rings == NULL) return -1;
+        unsigned opened = 0;
+        while (opened < q->num_rings && ring_open(&q->rings[opened], depth) == 0) opened++;
+        if (opened > 0) {
+            q->num_rings = opened;
+            q->engine = IOQ_ENGINE_URING;
+            return 0;
+        }
+        free(q->rings);
+        q->rings = NULL;
+        q->num_rings = 0;
+    }
+    q->engine = IOQ_ENGINE_POOL;
+    if (pool_start(q) != 0) {
+        ioq_destroy(q);
+        return -1;
+    }
+    return 0;
+}
+
+//stop the workers and release the rings
+void ioq_destroy(IoQueue* q) {
+    for (unsigned i = 0; i < q->num_rings; i++) {
+        ring_close(&q->rings[i]);
+        pthread_mutex_destroy(&q->rings[i].lock);
+    }
+    free(q->rings);
+    if (q->workers != NULL) {
+        pthread_mutex_lock(&q->lock);
+        q->stopping = true;
+        pthread_cond_broadcast(&q->work);
+        pthread_mutex_unlock(&q->lock);
+        for (unsigned i = 0; i < q->num_workers; i++) pthread_join(q->workers[i], NULL);
+        pthread_mutex_destroy(&q->lock);
+        pthread_cond_destroy(&q->work);
+        pthread_cond_destroy(&q->done);
+    }
+    free(q->workers);
+    free(q->slots);
+    memset(q, 0, sizeof(IoQueue));
+}
+
+//run a batch of requests, keeping up to the queue depth in flight, and wait for all of them;
+//returns -1 with errno set if any failed
+int ioq_run(IoQueue* q, IoRequest* reqs, uint32_t n) {
+    if (n == 0) return 0;
+    if (q->engine == IOQ_ENGINE_POOL) pool_run(q, reqs, n);
+    else {
+        //an idle ring if there is one, otherwise wait for the next one in turn
+        unsigned start = __atomic_fetch_add(&q->next_ring, 1, __ATOMIC_RELAXED) % q->num_rings;
+        IoRing* r = NULL;
+        for (unsigned i = 0; i < q->num_rings && r == NULL; i++) {
+            IoRing* candidate = &q->rings[(start + i) % q->num_rings];
+            if (pthread_mutex_trylock(&candidate->lock) == 0) r = candidate;
+        }
+        if (r == NULL) {
+            r = &q->rings[start];
+            pthread_mutex_lock(&r->lock);
+        }
+        uint32_t taken = 0;
+        if (r->fd < 0 || ring_run(r, q->fd, q->depth, reqs, n, &taken) != 0) {
+            //a ring that failed is not used again; only the requests it never took are done here
+            if (r->fd >= 0) ring_close(r);
+            for (uint32_t i = taken; i < n; i++) complete_request(q->fd, &reqs[i]);
+        }
+        pthread_mutex_unlock(&r->lock);
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        if (reqs[i].error != 0) {
+            errno = reqs[i].error;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//name of the engine in use
+const char* ioq_engine_name(const IoQueue* q) {
+    return q->engine == IOQ_ENGINE_URING ? "io_uring" : "thread pool";
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "../utils/utils.h"
+#include <sys/uio.h>
+
+#define IOQ_READ  0
+#define IOQ_WRITE 1
+
+#define IOQ_ENGINE_URING 0  //requests go through an io_uring submission queue
+#define IOQ_ENGINE_POOL  1  //requests are handed to a pool of threads running pread/pwrite
+
+#define DEFAULT_QUEUE_DEPTH 32      //requests in flight at once
+#define MAX_QUEUE_DEPTH     4096
+#define IOQ_REQUEST_MAX (256u << 10)    //transfers are cut into requests of at most 256 KB, so even one large run fills the queue
+#define IOQ_POOL_MAX 16     //threads of the fallback pool, whatever the depth
+#define IOQ_RINGS    4      //rings of a queue shared by several threads, each runs one batch at a time
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+//one read or write of the disk file; a read past the end of the file fills the rest of buf with zeros
+typedef struct {
+    int op;                     //IOQ_READ or IOQ_WRITE
+    struct iovec iov;           //buffer and length, advanced as the transfer completes
+    off_t offset;               //position in the file
+    int error;                  //errno of a failed request, 0 once it is complete
+    bool in_flight;             //io_uring: taken by the kernel and not reaped yet
+    uint32_t* pending;          //pool: requests of the batch still to complete
+} IoRequest;
+
+//io_uring instance: the submission and completion rings shared with the kernel
+typedef struct {
+    pthread_mutex_t lock;       //the rings have a single producer and consumer: one batch at a time
+    int fd;                     //-1 if the ring could not be set up or broke
+    unsigned entries;           //submission queue entries, at least the queue depth
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;              //mappings of the rings and of the submission entries
+    void* cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+} IoRing;
+
+//asynchronous queue of reads and writes on one file, with a queue depth
+typedef struct {
+    int engine;                 //IOQ_ENGINE_URING or IOQ_ENGINE_POOL
+    int fd;                     //file every request goes to
+    unsigned depth;             //requests in flight at once, per batch with io_uring
+    //io_uring
+    IoRing* rings;
+    unsigned num_rings;
+    unsigned next_ring;         //where the next batch starts looking for an idle ring
+    //thread pool
+    pthread_t* workers;
+    unsigned num_workers;
+    IoRequest** slots;          //requests waiting for a worker, a circular buffer of depth entries
+    unsigned head;
+    unsigned count;
+    bool stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t work;        //a request was queued, or the pool is stopping
+    pthread_cond_t done;        //a request completed or left a slot free
+} IoQueue;
+
+//set up a queue of depth requests (1 to MAX_QUEUE_DEPTH) on fd: io_uring unless pool is true or the
+//kernel refuses it, then a thread pool. A queue used by several threads gets IOQ_RINGS rings
+int ioq_init(IoQueue* q, int fd, unsigned depth, bool pool, bool threaded);
+
+//stop the workers and release the rings
+void ioq_destroy(IoQueue* q);
+
+//run a batch of requests, keeping up to the queue depth in flight, and wait for all of them;
+//returns -1 with errno set if any failed
+int ioq_run(IoQueue* q, IoRequest* reqs, uint32_t n);
+
+//fill in a request
+void ioq_prep(IoRequest* req, int op, void* buf, size_t len, off_t offset);
+
+//name of the engine in use
+const char* ioq_engine_name(const IoQueue* q);
@@ -0,0 +1,260 @@
+#include "journal.h"
+
+//blocks reserved for the journal of a disk of the given size
+uint32_t calc_journal_blocks(size_t disk_size, size_t block_size) {
+    //about 1.5% of the disk
+    uint32_t blocks = disk_size / block_size / 64;
+    if (blocks < JOURNAL_MIN_BLOCKS) blocks = JOURNAL_MIN_BLOCKS;
+    if (blocks > JOURNAL_MAX_BLOCKS) blocks = JOURNAL_MAX_BLOCKS;
+    return blocks;
+}
+
+//FNV-1a over a buffer, continuing from hash
+static uint32_t fnv1a(uint32_t hash, const void* buf, size_t len) {
+    const uint8_t* p = buf;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+//checksum of a transaction: its block numbers and the images that follow the descriptor; -1 if an image
+//cannot be read
+static int tx_checksum(const Disk* disk, const JournalDesc* desc, uint32_t desc_block, uint32_t* hash) {
+    *hash = fnv1a(2166136261u, desc->blocks, desc->count * sizeof(uint32_t));
+    for (uint32_t i = 0; i < desc->count; i++) {
+        const void* image = get_block(disk, desc_block + 1 + i);
+        if (image == NULL) return -1;
+        *hash = fnv1a(*hash, image, disk->block_size);
+    }
+    return 0;
+}
+
+//rewrite the header so replay starts at offset tail with sequence number seq, and flush it
+static int write_header(Disk* disk, uint32_t start, uint32_t tail, uint32_t seq) {
+    JournalHeader* header = get_block_mut(disk, start);
+    if (header == NULL) return -1;
+    memset(header, 0, disk->block_size);
+    header->magic = JOURNAL_MAGIC;
+    header->tail = tail;
+    header->tail_seq = seq;
+    return sync_blocks(disk, start, 1);
+}
+
+//write an empty journal over the region (used by format)
+int journal_format(Disk* disk, uint32_t start, uint32_t blocks) {
+    if (blocks < 2 || start + blocks > disk->num_blocks) return -1;
+    //stale descriptors from an older image must not look like transactions
+    for (uint32_t i = 0; i < blocks; i++) {
+        void* block = get_block_mut(disk, start + i);
+        if (block == NULL) return -1;
+        memset(block, 0, disk->block_size);
+    }
+    if (sync_blocks(disk, start, blocks) != 0) return -1;
+    return write_header(disk, start, 1, 1);
+}
+
+//copy every committed transaction back home and empty the journal, returns the transactions replayed or -1;
+//a block that cannot be read stops the replay with -1, before the log is emptied
+int journal_replay(Disk* disk, uint32_t start, uint32_t blocks) {
+    const JournalHeader* header = get_block(disk, start);
+    if (blocks < 2 || start + blocks > disk->num_blocks || header == NULL || header->magic != JOURNAL_MAGIC) return -1;
+    uint32_t pos = header->tail, seq = header->tail_seq;
+    int replayed = 0;
+    //transactions follow each other with increasing sequence numbers; the first one that is stale,
+    //out of place or torn ends the log
+    while (pos > 0 && pos < blocks) {
+        const JournalDesc* desc = get_block(disk, start + pos);
+        if (desc == NULL) return -1;
+        if (desc->magic != JOURNAL_DESC_MAGIC || desc->seq != seq) break;
+        if (desc->count == 0 || desc->count > JOURNAL_DESC_MAX(disk) || pos + 1 + desc->count > blocks) break;
+        uint32_t checksum;
+        if (tx_checksum(disk, desc, start + pos, &checksum) != 0) return -1;
+        if (checksum != desc->checksum) break;
+        for (uint32_t i = 0; i < desc->count; i++) {
+            uint32_t home = desc->blocks[i];
+            if (home >= disk->num_blocks || (home >= start && home < start + blocks)) continue;
+            void* dst = get_block_mut(disk, home);
+            const void* image = get_block(disk, start + pos + 1 + i);
+            if (dst == NULL || image == NULL) return -1;
+            memcpy(dst, image, disk->block_size);
+            record_block_dirty(disk, home);
+        }
+        pos += 1 + desc->count;
+        seq++;
+        replayed++;
+    }
+    if (replayed == 0) return 0;
+    //every image is home once the disk is flushed, then the log can start over
+    if (sync_disk(disk) != 0 || write_header(disk, start, 1, seq) != 0) return -1;
+    return replayed;
+}
+
+//attach to an empty journal (after format or replay)
+int journal_open(Journal* j, const Disk* disk, uint32_t start, uint32_t blocks, bool threaded) {
+    memset(j, 0, sizeof(Journal));
+    const JournalHeader* header = get_block(disk, start);
+    if (blocks < 2 || start + blocks > disk->num_blocks || header == NULL || header->magic != JOURNAL_MAGIC) return -1;
+    //blocks of space the disk may grow into are logged too
+    j->in_tx = calloc((disk->max_blocks + 7) / 8, 1);
+    if (j->in_tx == NULL) return -1;
+    j->start = start;
+    j->blocks = blocks;
+    j->head = header->tail;
+    j->flushed = j->head;
+    j->seq = header->tail_seq;
+    j->desc_max = JOURNAL_DESC_MAX(disk);
+    j->threaded = threaded;
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_rwlock_init(&j->commit_lock, NULL);
+    return 0;
+}
+
+//release the transaction tracking and the locks
+void journal_close(Journal* j) {
+    if (j->in_tx == NULL) return;
+    free(j->tx);
+    free(j->in_tx);
+    pthread_mutex_destroy(&j->lock);
+    pthread_rwlock_destroy(&j->commit_lock);
+    memset(j, 0, sizeof(Journal));
+}
+
+//largest transaction that is logged: half the region, so room for one is kept free after every commit
+static uint32_t max_tx_blocks(const Journal* j) {
+    uint32_t room = (j->blocks - 1) / 2 - 1;
+    return room < j->desc_max ? room : j->desc_max;
+}
+
+//add a changed block to the open transaction
+void journal_add(Journal* j, uint32_t block) {
+    uint8_t bit = 1u << (block % 8);
+    //blocks changed again in the same transaction are logged once
+    if (__atomic_load_n(&j->in_tx[block / 8], __ATOMIC_RELAXED) & bit) return;
+    if (j->threaded) pthread_mutex_lock(&j->lock);
+    if (!(j->in_tx[block / 8] & bit) && !j->tx_overflow) {
+        if (j->tx_count == j->tx_capacity) {
+            uint32_t capacity = j->tx_capacity > 0 ? j->tx_capacity * 2 : 64;
+            uint32_t* tx = j->tx_count < max_tx_blocks(j) ? realloc(j->tx, (size_t)capacity * sizeof(uint32_t)) : NULL;
+            //a transaction that cannot be logged is flushed in place at commit
+            if (tx == NULL) j->tx_overflow = true;
+            else {
+                j->tx = tx;
+                j->tx_capacity = capacity;
+            }
+        }
+        if (!j->tx_overflow) {
+            j->tx[j->tx_count++] = block;
+            __atomic_fetch_or(&j->in_tx[block / 8], bit, __ATOMIC_RELAXED);
+        }
+    }
+    if (j->threaded) pthread_mutex_unlock(&j->lock);
+}
+
+//reserve room in the open transaction for an operation that may add up to want blocks, with pending blocks
+//joining it only at commit; grants up to want blocks, 0 if not even min fit
+uint32_t journal_reserve(Journal* j, uint32_t min, uint32_t want, uint32_t pending) {
+    if (j->threaded) pthread_mutex_lock(&j->lock);
+    //blocks already added by an operation in progress count twice until it ends, which only errs on the safe side
+    uint32_t used = j->tx_count + pending + j->reserved;
+    uint32_t max = max_tx_blocks(j);
+    uint32_t granted = used < max ? max - used : 0;
+    if (granted > want) granted = want;
+    if (granted < min) granted = j->tx_count == 0 && j->reserved == 0 ? want : 0;
+    j->reserved += granted;
+    if (j->threaded) pthread_mutex_unlock(&j->lock);
+    return granted;
+}
+
+//give back blocks reserved with journal_reserve once the operation is over
+void journal_release(Journal* j, uint32_t blocks) {
+    if (j->threaded) pthread_mutex_lock(&j->lock);
+    j->reserved -= blocks;
+    if (j->threaded) pthread_mutex_unlock(&j->lock);
+}
+
+//empty the journal right after the open transaction commits (logged blocks were freed and may be reused)
+void journal_request_checkpoint(Journal* j) {
+    __atomic_store_n(&j->tx_checkpoint, true, __ATOMIC_RELAXED);
+}
+
+//forget the open transaction
+static void clear_tx(Journal* j) {
+    for (uint32_t i = 0; i < j->tx_count; i++) __atomic_store_n(&j->in_tx[j->tx[i] / 8], 0, __ATOMIC_RELAXED);
+    j->tx_count = 0;
+    j->tx_overflow = false;
+    j->tx_checkpoint = false;
+}
+
+//journal_checkpoint with the journal locked
+static int checkpoint_locked(Journal* j, Disk* disk) {
+    //home copies may only reach the disk after the transactions that logged them
+    if (sync_blocks(disk, j->start + j->flushed, j->head - j->flushed) != 0) return -1;
+    j->flushed = j->head;
+    if (sync_disk(disk) != 0) return -1;
+    if (j->head == 1) return 0;
+    if (write_header(disk, j->start, 1, j->seq) != 0) return -1;
+    j->head = 1;
+    j->flushed = 1;
+    return 0;
+}
+
+//flush the logged transactions, then every dirty block home, and empty the journal
+int journal_checkpoint(Journal* j, Disk* disk) {
+    if (j->threaded) pthread_mutex_lock(&j->lock);
+    int res = checkpoint_locked(j, disk);
+    if (j->threaded) pthread_mutex_unlock(&j->lock);
+    return res;
+}
+
+//log the open transaction, flushed at once in sync mode and with the next checkpoint in write-back mode;
+//a transaction too large for the journal is written through
+int journal_commit(Journal* j, Disk* disk) {
+    if (j->threaded) pthread_mutex_lock(&j->lock);
+    int res = 0;
+    if (j->tx_overflow || j->tx_count > max_tx_blocks(j)) {
+        //operations reserve their room, so only one granted more than the journal holds gets here (or a failed
+        //allocation of tx); the home copies are the only ones, flushing them all empties the journal too
+        res = checkpoint_locked(j, disk);
+    } else if (j->tx_count > 0) {
+        //transactions never wrap, and there is always room: a checkpoint now would write home blocks
+        //of this transaction before it is logged
+        uint32_t desc_block = j->start + j->head;
+        JournalDesc* desc = get_block_mut(disk, desc_block);
+        if (desc == NULL) res = -1;
+        else {
+            memset(desc, 0, disk->block_size);
+            desc->magic = JOURNAL_DESC_MAGIC;
+            desc->seq = j->seq;
+            desc->count = j->tx_count;
+        }
+        for (uint32_t i = 0; i < j->tx_count && res == 0; i++) {
+            void* image = get_block_mut(disk, desc_block + 1 + i);
+            const void* home = get_block(disk, j->tx[i]);
+            if (image == NULL || home == NULL) res = -1;
+            else {
+                desc->blocks[i] = j->tx[i];
+                memcpy(image, home, disk->block_size);
+            }
+        }
+        if (res == 0) res = tx_checksum(disk, desc, desc_block, &desc->checksum);
+        //a transaction that could not be logged stays open, nothing of it reached the log
+        if (res == 0) {
+            j->head += 1 + j->tx_count;
+            j->seq++;
+            //descriptor and images go out together, a torn write only fails the checksum
+            if (disk->mode == DISK_MODE_SYNC) {
+                res = sync_blocks(disk, j->start + j->flushed, j->head - j->flushed);
+                if (res == 0) j->flushed = j->head;
+            }
+        }
+    }
+    //old images of freed blocks must not outlive the transaction that freed them; and the next transaction
+    //must find room, the journal is emptied while no change is left unlogged
+    bool full = j->head + 1 + max_tx_blocks(j) > j->blocks;
+    if (res == 0 && (j->tx_checkpoint || full)) res = checkpoint_locked(j, disk);
+    if (res == 0) clear_tx(j);
+    if (j->threaded) pthread_mutex_unlock(&j->lock);
+    return res;
+}
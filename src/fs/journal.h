@@ -0,0 +1,86 @@
+#pragma once
+
+#include "disk.h"
+#include "../utils/utils.h"
+
+#define JOURNAL_MAGIC      0x4C4E524A   //"JRNL", journal header
+#define JOURNAL_DESC_MAGIC 0x4353444A   //"JDSC", transaction descriptor
+#define JOURNAL_MIN_BLOCKS 40           //smallest journal region, header included: half of it takes any single operation
+#define JOURNAL_MAX_BLOCKS 1024         //largest journal region (4 MB with 4 KB blocks)
+#define JOURNAL_DESC_MAX(disk) (((disk)->block_size - sizeof(JournalDesc)) / sizeof(uint32_t))  //blocks logged by one descriptor
+
+//first block of the journal region: where replay starts
+typedef struct {
+    uint32_t magic;             //JOURNAL_MAGIC
+    uint32_t tail;              //offset of the oldest transaction not yet checkpointed
+    uint32_t tail_seq;          //sequence number of that transaction
+} JournalHeader;
+
+//a transaction is a descriptor followed by the images of the blocks it lists, written and flushed at once
+typedef struct {
+    uint32_t magic;             //JOURNAL_DESC_MAGIC
+    uint32_t seq;               //sequence number, one more than the previous transaction
+    uint32_t count;             //images following the descriptor
+    uint32_t checksum;          //FNV-1a of the block numbers and the images, a torn write fails it
+    uint32_t blocks[];          //home block of each image, up to JOURNAL_DESC_MAX
+} JournalDesc;
+
+//write-ahead log of metadata blocks: the blocks an operation changed are logged as one transaction,
+//their home copies are written back lazily, never before the log, and the log is emptied once they are all on disk
+typedef struct {
+    uint32_t start;             //first block of the region (the header), 0 when there is no journal
+    uint32_t blocks;            //blocks in the region, header included
+    uint32_t head;              //offset where the next transaction goes
+    uint32_t flushed;           //transactions before this offset are on disk
+    uint32_t seq;               //sequence number of the next transaction
+    uint32_t desc_max;          //images one descriptor can list with the disk's block size
+    uint32_t* tx;               //blocks changed by the open transaction
+    uint32_t tx_count;          //entries in tx
+    uint32_t tx_capacity;       //room in tx
+    uint32_t reserved;          //blocks promised to operations in progress, see journal_reserve
+    bool tx_overflow;           //the open transaction outgrew the journal and is written through instead
+    bool tx_checkpoint;         //the open transaction freed logged blocks, the journal is emptied after it
+    uint8_t* in_tx;             //one bit per disk block, set when the block is in tx
+    bool threaded;              //locks below are taken only in threaded mode
+    pthread_mutex_t lock;       //tx and in_tx
+    pthread_rwlock_t commit_lock;   //held shared by operations, exclusive by a commit
+} Journal;
+
+//blocks reserved for the journal of a disk of the given size
+uint32_t calc_journal_blocks(size_t disk_size, size_t block_size);
+
+//write an empty journal over the region (used by format)
+int journal_format(Disk* disk, uint32_t start, uint32_t blocks);
+
+//copy every committed transaction back home and empty the journal, returns the transactions replayed or -1 (also
+//when a block of the log cannot be read: the replay stops before the log is emptied)
+int journal_replay(Disk* disk, uint32_t start, uint32_t blocks);
+
+//attach to an empty journal (after format or replay)
+int journal_open(Journal* j, const Disk* disk, uint32_t start, uint32_t blocks, bool threaded);
+
+//release the transaction tracking and the locks
+void journal_close(Journal* j);
+
+//add a changed block to the open transaction
+void journal_add(Journal* j, uint32_t block);
+
+//reserve room in the open transaction for an operation that may add up to want blocks, with pending blocks
+//joining it only at commit (dirty FAT blocks, metainfo); grants up to want blocks, 0 if not even min fit and the
+//transaction has to be committed first. With nothing else in the transaction the whole request is granted, so an
+//operation larger than the journal (an image formatted with a smaller one) still runs, and is written through
+uint32_t journal_reserve(Journal* j, uint32_t min, uint32_t want, uint32_t pending);
+
+//give back blocks reserved with journal_reserve once the operation is over, its changes are in the transaction
+void journal_release(Journal* j, uint32_t blocks);
+
+//empty the journal right after the open transaction commits (logged blocks were freed and may be reused)
+void journal_request_checkpoint(Journal* j);
+
+//log the open transaction, flushed at once in sync mode and with the next checkpoint in write-back mode;
+//operations reserve their room, only one too large for the journal is written through;
+//the journal is emptied whenever the next transaction might not fit
+int journal_commit(Journal* j, Disk* disk);
+
+//flush the logged transactions, then every dirty block home, and empty the journal
+int journal_checkpoint(Journal* j, Disk* disk);
@@ -0,0 +1,495 @@
+#include "volume.h"
+#include "fat.h"
+#include "entry.h"
+#include "file.h"
+
+//fill opts with the defaults (write-back mode)
+void default_mount_options(MountOptions* opts) {
+    opts->mode = DISK_MODE_WRITEBACK;
+    opts->dirty_threshold = DEFAULT_DIRTY_THRESHOLD;
+    opts->flush_interval = DEFAULT_FLUSH_INTERVAL;
+    opts->threaded = false;
+    opts->max_size = 0;
+    opts->discard = false;
+    opts->block_size = DEFAULT_BLOCK_SIZE;
+    opts->io = DISK_IO_MMAP;
+    opts->queue_depth = DEFAULT_QUEUE_DEPTH;
+}
+
+//parse a comma separated option string into opts, returns -1 on unknown options
+int parse_mount_options(const char* str, MountOptions* opts) {
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%s", str);
+    for (char* opt = strtok(buf, ","); opt != NULL; opt = strtok(NULL, ",")) {
+        if (strcmp(opt, "sync") == 0) opts->mode = DISK_MODE_SYNC;
+        else if (strcmp(opt, "writeback") == 0) opts->mode = DISK_MODE_WRITEBACK;
+        else if (strncmp(opt, "interval=", 9) == 0) opts->flush_interval = strtoul(opt + 9, NULL, 10);
+        else if (strncmp(opt, "threshold=", 10) == 0) opts->dirty_threshold = strtoul(opt + 10, NULL, 10);
+        else if (strcmp(opt, "threads") == 0) opts->threaded = true;
+        else if (strcmp(opt, "discard") == 0) opts->discard = true;
+        else if (strncmp(opt, "max=", 4) == 0) opts->max_size = (size_t)strtoull(opt + 4, NULL, 10) << 20;
+        else if (strncmp(opt, "block=", 6) == 0) opts->block_size = (uint32_t)strtoul(opt + 6, NULL, 10) << 10;
+        else if (strcmp(opt, "io=mmap") == 0) opts->io = DISK_IO_MMAP;
+        else if (strcmp(opt, "io=pread") == 0) opts->io = DISK_IO_PREAD;
+        else if (strcmp(opt, "io=direct") == 0) opts->io = DISK_IO_DIRECT;
+        else if (strcmp(opt, "io=uring") == 0) opts->io = DISK_IO_URING;
+        else if (strcmp(opt, "io=pool") == 0) opts->io = DISK_IO_POOL;
+        else if (strncmp(opt, "qd=", 3) == 0) {
+            opts->queue_depth = strtoul(opt + 3, NULL, 10);
+            if (opts->queue_depth == 0 || opts->queue_depth > MAX_QUEUE_DEPTH) return -1;
+        }
+        else return -1;
+    }
+    return 0;
+}
+
+//open the disk file with the given mount options (size 0: an existing image at its own size)
+int open_volume_disk(Disk* disk, const char* filename, size_t size, const MountOptions* opts) {
+    if (open_disk(disk, filename, size, opts->mode, opts->io) != 0) return -1;
+    disk->dirty_threshold = opts->dirty_threshold;
+    disk->flush_interval = opts->flush_interval;
+    disk->threaded = opts->threaded;
+    disk->discard = opts->discard;
+    if (open_disk_queue(disk, opts->queue_depth) != 0) {
+        close_disk(disk);
+        return -1;
+    }
+    return 0;
+}
+
+//allocate the resident FAT, dirty flags, bitmap and groups for every block the mapping can grow to;
+//the geometry is set by extend_groups. Untouched parts of the arrays never cost memory
+static int setup_volume(Volume* vol, const Disk* disk) {
+    memset(vol, 0, sizeof(Volume));
+    vol->disk = *disk;
+    vol->fat_start_block = 1; //FAT starts right after the metainfo block
+    vol->fat_blocks = calc_reserved_blocks(disk->map_size, disk->block_size) - 1;
+    //the FAT is padded to whole blocks so each block can be written back directly
+    vol->fat = calloc((size_t)vol->fat_blocks * FAT_ENTRIES_PER_BLOCK(vol), sizeof(uint32_t));
+    vol->fat_dirty = calloc(vol->fat_blocks, sizeof(uint8_t));
+    vol->block_map = calloc(((size_t)disk->max_blocks + 7) / 8, 1);
+    //groups are cache line aligned so their locks and counters never share a line
+    uint32_t max_groups = GROUP_OF(vol, (size_t)disk->max_blocks + ALLOC_GROUP_BLOCKS(vol) - 1);
+    vol->groups = aligned_alloc(sizeof(AllocGroup), (size_t)max_groups * sizeof(AllocGroup));
+    if (vol->fat == NULL || vol->fat_dirty == NULL || vol->block_map == NULL || vol->groups == NULL || dcache_init(&vol->dcache, disk->threaded) != 0) {
+        free(vol->groups);
+        free(vol->block_map);
+        free(vol->fat);
+        free(vol->fat_dirty);
+        return -1;
+    }
+    vol->threaded = disk->threaded;
+    discard_init(&vol->discard, disk->discard, disk->threaded);
+    pthread_mutex_init(&vol->alloc_lock, NULL);
+    for (int i = 0; i < DIR_LOCK_STRIPES; i++) pthread_rwlock_init(&vol->dir_locks[i], NULL);
+    fs_init_table(vol);
+    return 0;
+}
+
+//extend the allocation groups over the first num_blocks blocks, the new blocks are free
+static void extend_groups(Volume* vol, uint32_t num_blocks) {
+    uint32_t group_blocks = ALLOC_GROUP_BLOCKS(vol);
+    uint32_t num_groups = GROUP_OF(vol, (size_t)num_blocks + group_blocks - 1);
+    //the last group may have been partial
+    if (vol->num_groups > 0) {
+        uint32_t last = vol->num_groups - 1;
+        lock_group(vol, last);
+        AllocGroup* g = &vol->groups[last];
+        uint32_t end = g->start + group_blocks < num_blocks ? g->start + group_blocks : num_blocks;
+        __atomic_store_n(&g->free_blocks, g->free_blocks + end - g->end, __ATOMIC_RELAXED);
+        g->end = end;
+        unlock_group(vol, last);
+    }
+    for (uint32_t i = vol->num_groups; i < num_groups; i++) {
+        AllocGroup* g = &vol->groups[i];
+        memset(g, 0, sizeof(AllocGroup));
+        g->start = i * group_blocks;
+        g->end = g->start + group_blocks < num_blocks ? g->start + group_blocks : num_blocks;
+        g->free_blocks = g->end - g->start;
+        g->hint = g->start;
+        pthread_mutex_init(&g->lock, NULL);
+    }
+    //readers outside transactions bound-check blocks against the entry count
+    __atomic_store_n(&vol->num_groups, num_groups, __ATOMIC_RELEASE);
+    __atomic_store_n(&vol->num_fat_entries, num_blocks, __ATOMIC_RELEASE);
+}
+
+//destroy the locks, allocation groups and journal tracking set up for the mount
+static void destroy_locks(Volume* vol) {
+    fs_close_all(vol);
+    journal_close(&vol->journal);
+    discard_destroy(&vol->discard);
+    for (uint32_t i = 0; i < vol->num_groups; i++) pthread_mutex_destroy(&vol->groups[i].lock);
+    free(vol->groups);
+    vol->groups = NULL;
+    pthread_mutex_destroy(&vol->alloc_lock);
+    for (int i = 0; i < DIR_LOCK_STRIPES; i++) pthread_rwlock_destroy(&vol->dir_locks[i]);
+}
+
+//build a fresh volume in memory (used by format): every block free, metainfo dirty
+int create_volume(Volume* vol, const Disk* disk, const char* name) {
+    if (setup_volume(vol, disk) != 0) return -1;
+    //the FAT starts zeroed, that is all free: only the FAT blocks that get used are ever written
+    extend_groups(vol, disk->num_blocks);
+    vol->info.block_size = disk->block_size;
+    vol->info.disk_size = disk->size;
+    vol->info.max_size = disk->map_size;
+    vol->info.free_blocks = vol->num_fat_entries;
+    vol->info.alloc_hint = 0;
+    vol->info.magic = FS_MAGIC;
+    vol->info.version = FS_VERSION;
+    //the inode table follows the FAT, inode 0 is reserved
+    vol->info.inode_extents = 1;
+    vol->info.inode_table[0].start = vol->fat_start_block + vol->fat_blocks;
+    vol->info.inode_table[0].blocks = calc_inode_blocks(disk->size, disk->block_size);
+    vol->info.inode_count = vol->info.inode_table[0].blocks * INODES_PER_BLOCK(disk);
+    vol->info.free_inodes = vol->info.inode_count - 1;
+    //the journal follows the inode table
+    vol->info.journal_start = vol->info.inode_table[0].start + vol->info.inode_table[0].blocks;
+    vol->info.journal_blocks = calc_journal_blocks(disk->size, disk->block_size);
+    //inodes added by later grows are tracked in the same map
+    vol->inode_map = calloc(((size_t)calc_inode_blocks(vol->info.max_size, disk->block_size) * INODES_PER_BLOCK(disk) + 7) / 8, 1);
+    if (vol->inode_map == NULL) {
+        free(vol->block_map);
+        free(vol->fat);
+        free(vol->fat_dirty);
+        dcache_destroy(&vol->dcache);
+        destroy_locks(vol);
+        return -1;
+    }
+    vol->inode_map[0] |= 1;
+    vol->inode_hint = 1;
+    snprintf(vol->info.name, MAX_NAME_LEN, "%s", name);
+    vol->info_dirty = true;
+    return 0;
+}
+
+//load metainfo and FAT from an already formatted disk
+int mount_volume(Volume* vol, const Disk* disk) {
+    if (setup_volume(vol, disk) != 0) return -1;
+    int res = read_metainfo(&vol->disk, &vol->info);
+    //refuse images written in another format version
+    if (res == 0 && (vol->info.magic != FS_MAGIC || vol->info.version != FS_VERSION)) res = -1;
+    //the disk was switched to the recorded block size before the volume was set up
+    if (res == 0 && vol->info.block_size != vol->disk.block_size) res = -1;
+    //transactions committed before a crash are copied home before anything is read, metainfo included
+    if (res == 0) {
+        int replayed = journal_replay(&vol->disk, vol->info.journal_start, vol->info.journal_blocks);
+        if (replayed < 0) res = -1;
+        else if (replayed > 0) res = read_metainfo(&vol->disk, &vol->info);
+    }
+    //the metainfo, replayed, says how much of the file is the disk
+    if (res == 0 && (vol->info.inode_extents == 0 || vol->info.inode_extents > INODE_MAX_EXTENTS ||
+                     reserve_disk(&vol->disk, vol->info.disk_size, vol->info.max_size) != 0)) res = -1;
+    if (res == 0) {
+        extend_groups(vol, vol->disk.num_blocks);
+        res = read_fat(&vol->disk, vol->fat, vol->num_fat_entries, vol->fat_start_block);
+    }
+    if (res == 0) res = build_block_map(vol);
+    if (res == 0) res = scan_inode_table(vol);
+    if (res == 0) res = journal_open(&vol->journal, &vol->disk, vol->info.journal_start, vol->info.journal_blocks, vol->threaded);
+    //single-threaded allocations continue where the last mount stopped
+    if (res == 0 && vol->info.alloc_hint < vol->num_fat_entries) {
+        vol->last_group = GROUP_OF(vol, vol->info.alloc_hint);
+        vol->groups[vol->last_group].hint = vol->info.alloc_hint;
+    }
+    if (res != 0) {
+        free(vol->inode_map);
+        free(vol->block_map);
+        free(vol->fat);
+        free(vol->fat_dirty);
+        dcache_destroy(&vol->dcache);
+        destroy_locks(vol);
+        return res;
+    }
+    return 0;
+}
+
+//set a FAT entry and mark its FAT block dirty
+void set_fat_entry(Volume* vol, uint32_t index, uint32_t value) {
+    vol->fat[index] = value;
+    uint32_t group = GROUP_OF(vol, index);
+    //a FAT block takes room in the open transaction once, until it is written back
+    if (!vol->fat_dirty[group]) {
+        vol->fat_dirty[group] = 1;
+        __atomic_fetch_add(&vol->fat_dirty_blocks, 1, __ATOMIC_RELAXED);
+    }
+}
+
+//mark metainfo dirty
+void mark_info_dirty(Volume* vol) {
+    //set from several allocation groups at once in threaded mode
+    __atomic_store_n(&vol->info_dirty, true, __ATOMIC_RELAXED);
+}
+
+//record a change to a metadata block (inode table, directory, FAT, metainfo) in the open transaction
+void mark_meta_dirty(Volume* vol, uint32_t block) {
+    //without a journal (format, before it is written) blocks are handled like data
+    if (vol->journal.in_tx == NULL) {
+        mark_block_dirty(&vol->disk, block);
+        return;
+    }
+    //the journal commit is the flush, the home copy is written back lazily even in sync mode
+    journal_add(&vol->journal, block);
+    record_block_dirty(&vol->disk, block);
+}
+
+//blocks that join the open transaction only at commit: the dirty FAT blocks and the metainfo
+static uint32_t pending_blocks(Volume* vol) {
+    return __atomic_load_n(&vol->fat_dirty_blocks, __ATOMIC_RELAXED) + 1;
+}
+
+//start an operation that changes up to blocks metadata blocks, committing the open transaction first if it has
+//no room for them; returns -1 if that commit failed
+int begin_transaction(Volume* vol, uint32_t blocks) {
+    if (vol->journal.in_tx == NULL) return 0;
+    for (;;) {
+        if (vol->threaded) pthread_rwlock_rdlock(&vol->journal.commit_lock);
+        if (journal_reserve(&vol->journal, blocks, blocks, pending_blocks(vol)) > 0) return 0;
+        if (vol->threaded) pthread_rwlock_unlock(&vol->journal.commit_lock);
+        //the commit waits for the operations in progress, their room comes back with it
+        if (flush_volume(vol) != 0) return -1;
+    }
+}
+
+//room for up to want more blocks in the operation in progress, none unless at least min fit
+uint32_t extend_transaction(Volume* vol, uint32_t min, uint32_t want) {
+    if (vol->journal.in_tx == NULL) return want;
+    return journal_reserve(&vol->journal, min, want, pending_blocks(vol));
+}
+
+//end an operation started with begin_transaction, giving back the room it reserved
+void end_transaction(Volume* vol, uint32_t blocks) {
+    if (vol->journal.in_tx == NULL) return;
+    journal_release(&vol->journal, blocks);
+    if (vol->threaded) pthread_rwlock_unlock(&vol->journal.commit_lock);
+}
+
+//commit the open transaction if it might not take blocks more, for a caller that has the volume to itself
+int make_tx_room(Volume* vol, uint32_t blocks) {
+    if (vol->journal.in_tx == NULL) return 0;
+    uint32_t granted = journal_reserve(&vol->journal, blocks, blocks, pending_blocks(vol));
+    if (granted == 0) return flush_volume(vol);
+    journal_release(&vol->journal, granted);
+    return 0;
+}
+
+//copy a resident block into its view as part of the open transaction, -1 if the block cannot be read
+static int write_meta_block(Volume* vol, uint32_t block, const void* src, size_t len) {
+    void* view = get_block_mut(&vol->disk, block);
+    if (view == NULL) return -1;
+    memcpy(view, src, len);
+    mark_meta_dirty(vol, block);
+    return 0;
+}
+
+//write back dirty FAT blocks and metainfo and commit the open transaction, with no operation halfway through
+static int write_back_locked(Volume* vol) {
+    size_t free_blocks = 0;
+    int res = 0;
+    //each FAT block in use belongs to one allocation group and is copied out with only that group locked;
+    //the rest of the FAT region stays a hole until the disk grows into it
+    for (uint32_t i = 0; i < vol->num_groups; i++) {
+        lock_group(vol, i);
+        free_blocks += vol->groups[i].free_blocks;
+        if (vol->fat_dirty[i]) {
+            //a block that cannot be written stays dirty for the next write-back
+            if (write_meta_block(vol, vol->fat_start_block + i, vol->fat + (size_t)i * FAT_ENTRIES_PER_BLOCK(vol), vol->disk.block_size) != 0) res = -1;
+            else {
+                vol->fat_dirty[i] = 0;
+                __atomic_fetch_sub(&vol->fat_dirty_blocks, 1, __ATOMIC_RELAXED);
+            }
+        }
+        unlock_group(vol, i);
+    }
+    //block counters live in the groups, metainfo gets their totals
+    uint32_t last = __atomic_load_n(&vol->last_group, __ATOMIC_RELAXED);
+    lock_group(vol, last);
+    uint32_t alloc_hint = vol->groups[last].hint;
+    unlock_group(vol, last);
+    lock_allocator(vol);
+    if (__atomic_exchange_n(&vol->info_dirty, false, __ATOMIC_ACQ_REL)) {
+        vol->info.free_blocks = free_blocks;
+        vol->info.alloc_hint = alloc_hint;
+        if (write_meta_block(vol, 0, &vol->info, sizeof(DiskInfo)) != 0) {
+            __atomic_store_n(&vol->info_dirty, true, __ATOMIC_RELAXED);
+            res = -1;
+        }
+    }
+    unlock_allocator(vol);
+    //the transaction is committed only with all of its FAT blocks and the metainfo
+    if (res != 0 || vol->journal.in_tx == NULL) return res;
+    return journal_commit(&vol->journal, &vol->disk);
+}
+
+//punch the queued runs that are still free out of the disk file; a run that fails just stays allocated
+static void discard_queued(Volume* vol) {
+    DiscardRange* ranges;
+    uint32_t count = discard_take(&vol->discard, &ranges);
+    uint64_t discarded = 0;
+    //blocks allocated again since they were freed hold new data and are skipped
+    for (uint32_t i = 0; i < count; i++) discard_free_blocks(vol, ranges[i].start, ranges[i].start + ranges[i].len, &discarded);
+    free(ranges);
+}
+
+//write back dirty FAT blocks and metainfo and commit them with the open transaction; flush the disk
+//if sync is set or write-back limits are reached, unless the flush is deferred
+static int write_back_volume(Volume* vol, bool sync, bool defer) {
+    bool exclusive = vol->threaded && vol->journal.in_tx != NULL;
+    if (exclusive) pthread_rwlock_wrlock(&vol->journal.commit_lock);
+    int res = write_back_locked(vol);
+    //home copies are flushed with no operation halfway through, after the journal
+    bool flush = sync || (!defer && sync_due(&vol->disk));
+    if (res == 0 && flush) {
+        if (vol->journal.in_tx != NULL) res = journal_checkpoint(&vol->journal, &vol->disk);
+        else res = sync_disk(&vol->disk);
+    }
+    //freed blocks lose their contents in batches, once the transactions that freed them are on disk
+    bool durable = flush || vol->disk.mode == DISK_MODE_SYNC;
+    if (res == 0 && durable && (sync || discard_due(&vol->discard))) discard_queued(vol);
+    if (exclusive) pthread_rwlock_unlock(&vol->journal.commit_lock);
+    return res;
+}
+
+//extend a mounted volume to new_size bytes: the disk file, the allocation groups and inode_blocks more blocks
+//of inode table at the start of the new space, committed and flushed as one transaction
+int grow_volume(Volume* vol, size_t new_size, uint32_t inode_blocks) {
+    //no operation may be halfway through while the geometry changes
+    bool exclusive = vol->threaded && vol->journal.in_tx != NULL;
+    if (exclusive) pthread_rwlock_wrlock(&vol->journal.commit_lock);
+    uint32_t old_blocks = vol->num_fat_entries;
+    int res = grow_disk(&vol->disk, new_size);
+    if (res == 0) {
+        extend_groups(vol, vol->disk.num_blocks);
+        if (inode_blocks > 0) res = reserve_blocks(vol, old_blocks, inode_blocks);
+    }
+    if (res == 0) {
+        lock_allocator(vol);
+        if (inode_blocks > 0) {
+            InodeExtent* extent = &vol->info.inode_table[vol->info.inode_extents];
+            extent->start = old_blocks;
+            extent->blocks = inode_blocks;
+            vol->info.inode_extents++;
+            vol->info.free_inodes += inode_blocks * INODES_PER_BLOCK(&vol->disk);
+            //the extent is in place before readers can see its inodes
+            __atomic_store_n(&vol->info.inode_count, vol->info.inode_count + inode_blocks * INODES_PER_BLOCK(&vol->disk), __ATOMIC_RELEASE);
+        }
+        vol->info.disk_size = new_size;
+        unlock_allocator(vol);
+        mark_info_dirty(vol);
+        res = write_back_locked(vol);
+    }
+    //the new size is flushed before anything is allocated in the new space
+    if (res == 0) {
+        if (vol->journal.in_tx != NULL) res = journal_checkpoint(&vol->journal, &vol->disk);
+        else res = sync_disk(&vol->disk);
+    }
+    if (exclusive) pthread_rwlock_unlock(&vol->journal.commit_lock);
+    return res;
+}
+
+//commit the open transaction and punch every free block out of the disk file, with no operation halfway
+//through; stores the blocks punched in discarded, returns -1 if a hole could not be punched
+int trim_volume(Volume* vol, uint64_t* discarded) {
+    bool exclusive = vol->threaded && vol->journal.in_tx != NULL;
+    if (exclusive) pthread_rwlock_wrlock(&vol->journal.commit_lock);
+    *discarded = 0;
+    int res = write_back_locked(vol);
+    //the blocks freed by the open transaction lose their contents only once it is on disk
+    if (res == 0) {
+        if (vol->journal.in_tx != NULL) res = journal_checkpoint(&vol->journal, &vol->disk);
+        else res = sync_disk(&vol->disk);
+    }
+    if (res == 0) {
+        //the queued runs are covered by the full pass
+        DiscardRange* ranges;
+        discard_take(&vol->discard, &ranges);
+        free(ranges);
+        res = discard_free_blocks(vol, 0, vol->num_fat_entries, discarded);
+    }
+    if (exclusive) pthread_rwlock_unlock(&vol->journal.commit_lock);
+    return res;
+}
+
+//write back dirty FAT blocks and metainfo and commit the open transaction to the journal,
+//flush the disk if write-back limits are reached (while deferred, only a full journal flushes)
+int flush_volume(Volume* vol) {
+    return write_back_volume(vol, false, vol->defer_flush);
+}
+
+//commit the open transaction, flush every dirty block to the disk file and empty the journal
+int sync_volume(Volume* vol) {
+    return write_back_volume(vol, true, false);
+}
+
+//flush, release the resident structures and unmap the disk, returns -1 if the write-back failed
+int unmount_volume(Volume* vol) {
+    if (vol->disk.mem == NULL) return 0;
+    int res = sync_volume(vol);
+    if (close_disk(&vol->disk) != 0) res = -1;
+    destroy_locks(vol);
+    free(vol->fat);
+    free(vol->fat_dirty);
+    free(vol->block_map);
+    free(vol->inode_map);
+    dcache_destroy(&vol->dcache);
+    memset(vol, 0, sizeof(Volume));
+    return res;
+}
+
+//take the allocator lock (threaded mode only)
+void lock_allocator(Volume* vol) {
+    if (vol->threaded) pthread_mutex_lock(&vol->alloc_lock);
+}
+
+//release the allocator lock
+void unlock_allocator(Volume* vol) {
+    if (vol->threaded) pthread_mutex_unlock(&vol->alloc_lock);
+}
+
+//take the lock of an allocation group (threaded mode only)
+void lock_group(Volume* vol, uint32_t group) {
+    if (vol->threaded) pthread_mutex_lock(&vol->groups[group].lock);
+}
+
+//release the lock of an allocation group
+void unlock_group(Volume* vol, uint32_t group) {
+    if (vol->threaded) pthread_mutex_unlock(&vol->groups[group].lock);
+}
+
+//take the lock of a directory, shared for readers or exclusive for writers
+void lock_dir(Volume* vol, uint32_t dir_ino, bool write) {
+    if (!vol->threaded) return;
+    pthread_rwlock_t* lock = &vol->dir_locks[dir_ino % DIR_LOCK_STRIPES];
+    if (write) pthread_rwlock_wrlock(lock);
+    else pthread_rwlock_rdlock(lock);
+}
+
+//release the lock of a directory
+void unlock_dir(Volume* vol, uint32_t dir_ino) {
+    if (vol->threaded) pthread_rwlock_unlock(&vol->dir_locks[dir_ino % DIR_LOCK_STRIPES]);
+}
+
+//take the exclusive locks of two directories in a fixed order (either may be FAT_EOF)
+void lock_dir_pair(Volume* vol, uint32_t a, uint32_t b) {
+    if (!vol->threaded) return;
+    //stripes are always taken lowest first, and a shared stripe only once
+    uint32_t sa = a == FAT_EOF ? DIR_LOCK_STRIPES : a % DIR_LOCK_STRIPES;
+    uint32_t sb = b == FAT_EOF ? DIR_LOCK_STRIPES : b % DIR_LOCK_STRIPES;
+    if (sa > sb) {
+        uint32_t t = sa;
+        sa = sb;
+        sb = t;
+    }
+    if (sa < DIR_LOCK_STRIPES) pthread_rwlock_wrlock(&vol->dir_locks[sa]);
+    if (sb < DIR_LOCK_STRIPES && sb != sa) pthread_rwlock_wrlock(&vol->dir_locks[sb]);
+}
+
+//release the locks taken by lock_dir_pair
+void unlock_dir_pair(Volume* vol, uint32_t a, uint32_t b) {
+    if (!vol->threaded) return;
+    uint32_t sa = a == FAT_EOF ? DIR_LOCK_STRIPES : a % DIR_LOCK_STRIPES;
+    uint32_t sb = b == FAT_EOF ? DIR_LOCK_STRIPES : b % DIR_LOCK_STRIPES;
+    if (sa < DIR_LOCK_STRIPES) pthread_rwlock_unlock(&vol->dir_locks[sa]);
+    if (sb < DIR_LOCK_STRIPES && sb != sa) pthread_rwlock_unlock(&vol->dir_locks[sb]);
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include "disk.h"
+#include "dcache.h"
+#include "ftable.h"
+#include "journal.h"
+#include "discard.h"
+#include "../utils/utils.h"
+
+#define FAT_ENTRIES_PER_BLOCK(vol) ((vol)->disk.block_size / sizeof(uint32_t))
+
+//options given at mount time, e.g. "sync" or "writeback,interval=10,threshold=512"
+typedef struct {
+    int mode;                   //DISK_MODE_SYNC or DISK_MODE_WRITEBACK
+    uint32_t dirty_threshold;   //write-back: flush after this many dirty blocks (0 = no limit)
+    unsigned flush_interval;    //write-back: flush after this many seconds (0 = no limit)
+    bool threaded;              //the volume is shared by several threads and takes its locks
+    size_t max_size;            //format: size the image can grow to, "max=<MB>" (0 = its initial size)
+    bool discard;               //punch freed blocks out of the image file
+    uint32_t block_size;        //format: bytes per block, "block=<KB>" from 1 to 64 (a power of two)
+    int io;                     //block backend: DISK_IO_MMAP, DISK_IO_PREAD, DISK_IO_DIRECT, DISK_IO_URING or DISK_IO_POOL, "io=mmap|pread|direct|uring|pool"
+    unsigned queue_depth;       //uring and pool: requests in flight at once, "qd=<n>" from 1 to MAX_QUEUE_DEPTH
+} MountOptions;
+
+#define DIR_LOCK_STRIPES 64     //directories share this many reader/writer locks, by inode
+
+#define ALLOC_GROUP_BLOCKS(vol) FAT_ENTRIES_PER_BLOCK(vol)   //blocks per allocation group: each group owns one FAT block
+#define GROUP_OF(vol, block) ((block) >> ((vol)->disk.block_shift - 2)) //allocation group of a block, by shift
+
+//allocation group: a slice of the block space with its own lock, free counter and search hint,
+//so threads allocating in different groups share neither a lock nor a cache line
+typedef struct __attribute__((aligned(64))) {
+    pthread_mutex_t lock;       //threaded mode: bitmap bits, FAT entries and counters of the group
+    uint32_t start;             //first block of the group
+    uint32_t end;               //one past the last block of the group
+    uint32_t free_blocks;       //free blocks in the group
+    uint32_t hint;              //block where the next search in the group starts
+} AllocGroup;
+
+//mounted volume: owns the in-memory metainfo and FAT for the lifetime of the mount
+typedef struct {
+    Disk disk;                  //memory mapped disk
+    DiskInfo info;              //resident metainfo
+    uint32_t* fat;              //resident FAT, padded to a whole number of blocks, allocated for the maximum size
+    uint32_t num_fat_entries;   //one FAT entry per disk block
+    uint32_t fat_start_block;   //first FAT block on disk
+    uint32_t fat_blocks;        //number of blocks reserved for the FAT, enough for the maximum size
+    uint8_t* fat_dirty;         //one flag per FAT block, set when the block must be written back
+    uint32_t fat_dirty_blocks;  //flags set in fat_dirty: blocks that join the open transaction at its commit
+    uint8_t* block_map;         //free-space bitmap, one bit per block, set when the block is in use
+    bool info_dirty;            //metainfo must be written back
+    bool defer_flush;           //batch mode: flush_volume still commits, home blocks wait for sync, unmount or a full journal
+    uint8_t* inode_map;         //one bit per inode, set when the inode is in use
+    uint32_t inode_hint;        //lowest inode that may be free
+    DentryCache dcache;         //name lookups in directories
+    FileTable ftable;           //open files and their block indexes
+    Journal journal;            //metadata changes since the last flush_volume, logged there as one transaction
+    DiscardQueue discard;       //freed blocks waiting to be punched out of the disk file
+    AllocGroup* groups;         //allocation groups, block space split in ALLOC_GROUP_BLOCKS(vol) slices
+    uint32_t num_groups;        //number of allocation groups, one per FAT block in use
+    uint32_t last_group;        //group of the last allocation, where single-threaded allocations continue
+    uint32_t next_group;        //threaded mode: home group handed to the next thread that allocates
+    bool threaded;              //locks below are taken only in threaded mode
+    pthread_mutex_t alloc_lock; //inode bitmap and inode counters in info
+    pthread_rwlock_t dir_locks[DIR_LOCK_STRIPES];   //buckets and entry of a directory, by inode
+} Volume;
+
+//fill opts with the defaults (write-back mode)
+void default_mount_options(MountOptions* opts);
+
+//parse a comma separated option string into opts, returns -1 on unknown options
+int parse_mount_options(const char* str, MountOptions* opts);
+
+//open the disk file with the given mount options (size 0: an existing image at its own size)
+int open_volume_disk(Disk* disk, const char* filename, size_t size, const MountOptions* opts);
+
+//build a fresh volume in memory (used by format): every block free, metainfo dirty
+int create_volume(Volume* vol, const Disk* disk, const char* name);
+
+//load metainfo and FAT from an already formatted disk
+int mount_volume(Volume* vol, const Disk* disk);
+
+//extend a mounted volume to new_size bytes: the disk file, the allocation groups and inode_blocks more blocks
+//of inode table at the start of the new space, committed and flushed as one transaction
+int grow_volume(Volume* vol, size_t new_size, uint32_t inode_blocks);
+
+//commit the open transaction and punch every free block out of the disk file, with no operation halfway
+//through; stores the blocks punched in discarded, returns -1 if a hole could not be punched
+int trim_volume(Volume* vol, uint64_t* discarded);
+
+//set a FAT entry and mark its FAT block dirty
+void set_fat_entry(Volume* vol, uint32_t index, uint32_t value);
+
+//mark metainfo dirty
+void mark_info_dirty(Volume* vol);
+
+//record a change to a metadata block (inode table, directory, FAT, metainfo) in the open transaction
+void mark_meta_dirty(Volume* vol, uint32_t block);
+
+//start an operation that changes up to blocks metadata blocks (FAT blocks included), committing the open transaction
+//first if it has no room for them; flush_volume waits for the operations in progress (threaded mode).
+//Returns -1 if that commit failed, the operation is then not started
+int begin_transaction(Volume* vol, uint32_t blocks);
+
+//room for up to want more blocks in the operation in progress, none unless at least min fit; returns the blocks
+//granted, given back with the others by end_transaction
+uint32_t extend_transaction(Volume* vol, uint32_t min, uint32_t want);
+
+//end an operation started with begin_transaction, giving back the room it reserved
+void end_transaction(Volume* vol, uint32_t blocks);
+
+//commit the open transaction if it might not take blocks more, for a caller that has the volume to itself (repair)
+int make_tx_room(Volume* vol, uint32_t blocks);
+
+//write back dirty FAT blocks and metainfo and commit the open transaction to the journal,
+//flush the disk if write-back limits are reached (while deferred, only a full journal flushes)
+int flush_volume(Volume* vol);
+
+//commit the open transaction, flush every dirty block to the disk file and empty the journal
+int sync_volume(Volume* vol);
+
+//flush, release the resident structures and unmap the disk, returns -1 if the write-back failed
+int unmount_volume(Volume* vol);
+
+//take the allocator lock (threaded mode only)
+void lock_allocator(Volume* vol);
+
+//release the allocator lock
+void unlock_allocator(Volume* vol);
+
+//take the lock of an allocation group (threaded mode only)
+void lock_group(Volume* vol, uint32_t group);
+
+//release the lock of an allocation group
+void unlock_group(Volume* vol, uint32_t group);
+
+//take the lock of a directory, shared for readers or exclusive for writers
+void lock_dir(Volume* vol, uint32_t dir_ino, bool write);
+
+//release the lock of a directory
+void unlock_dir(Volume* vol, uint32_t dir_ino);
+
+//take the exclusive locks of two directories in a fixed order (either may be FAT_EOF)
+void lock_dir_pair(Volume* vol, uint32_t a, uint32_t b);
+
+//release the locks taken by lock_dir_pair
+void unlock_dir_pair(Volume* vol, uint32_t a, uint32_t b);
@@ -0,0 +1,58 @@
+#include "./fs/fs.h"
+
+//exit codes, as the classic fsck
+#define FSCK_EXIT_CLEAN      0      //no problems found
+#define FSCK_EXIT_CORRECTED  1      //problems found and all repaired
+#define FSCK_EXIT_LEFT       4      //problems left on the disk
+#define FSCK_EXIT_ERROR      8      //the check could not run
+
+//print one problem found by the check
+static void print_problem(const char* msg, void* arg) {
+    (void)arg;
+    printf("%s\n", msg);
+}
+
+//usage: fs-fsck [-r] [-j threads] image
+int main(int argc, char** argv) {
+    FsckOptions opts = {0, false, print_problem, NULL};
+    const char* filename = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0) {
+            //repair what can be repaired
+            opts.repair = true;
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            //worker threads, one per CPU by default
+            opts.threads = atoi(argv[++i]);
+        } else if (argv[i][0] != '-' && filename == NULL) {
+            filename = argv[i];
+        } else {
+            filename = NULL;
+            break;
+        }
+    }
+    if (filename == NULL) {
+        fprintf(stderr, "Usage: %s [-r] [-j threads] image\n", argv[0]);
+        return FSCK_EXIT_ERROR;
+    }
+    Volume vol;
+    MountOptions mount_opts;
+    default_mount_options(&mount_opts);
+    int res = fs_mount(&vol, filename, &mount_opts);
+    if (res != FS_OK) {
+        fprintf(stderr, "%s: %s\n", filename, fs_strerror(res));
+        return FSCK_EXIT_ERROR;
+    }
+    FsckReport report;
+    res = fs_check(&vol, &opts, &report);
+    if (fs_unmount(&vol) != FS_OK && res == FS_OK) res = FS_ERR_IO;
+    if (res != FS_OK && res != FS_ERR_CORRUPT) {
+        fprintf(stderr, "%s: %s\n", filename, fs_strerror(res));
+        return FSCK_EXIT_ERROR;
+    }
+    uint32_t problems = fsck_problems(&report);
+    printf("%s: %u directories, %u files, %u blocks in use, %u problems", filename, report.dirs, report.files, report.used_blocks, problems);
+    if (opts.repair && problems > 0) printf(", %u repaired", report.repaired);
+    printf("\n");
+    if (problems == 0) return FSCK_EXIT_CLEAN;
+    return opts.repair && report.unrepaired == 0 ? FSCK_EXIT_CORRECTED : FSCK_EXIT_LEFT;
+}
@@ -4,9 +4,25 @@
 #include "./fs/entry.h"
 #include "./shell/shell_commands.h"
 
-int main() {
-    
-    shell_init();
-
+//usage: fs-shell [-b] [-f script]
+int main(int argc, char** argv) {
+    FILE* in = stdin;
+    bool batch = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-b") == 0) {
+            //commands on stdin, no prompts
+            batch = true;
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            //commands from a script file, always in batch mode
+            in = fopen(argv[++i], "r");
+            if (in == NULL) handle_error("Error opening script");
+            batch = true;
+        } else {
+            fprintf(stderr, "Usage: %s [-b] [-f script]\n", argv[0]);
+            return 1;
+        }
+    }
+    shell_init(in, batch);
+    if (in != stdin) fclose(in);
     return 0;
-}
\ No newline at end of file
+}
@@ -1,53 +1,100 @@
 #include "shell.h"
 
-#define MAX_TOKENS 3
-#define MAX_COMMAND_LENGTH 128
+//split a command line into tokens in place. Quotes ('...' or "...") keep spaces inside a token,
+//a backslash escapes the next character outside single quotes. The array grows as needed and
+//is padded with NULLs so optional arguments can be tested directly. Returns the number of
+//tokens, -1 on an unterminated quote or if out of memory.
+static int tokenize(char* line, char*** tokens, size_t* capacity) {
+    int count = 0;
+    char* r = line;
+    while (1) {
+        while (*r == ' ' || *r == '\t' || *r == '\r') r++;
+        //keep room for this token and the NULL padding
+        if ((size_t)count + 4 > *capacity) {
+            size_t new_capacity = *capacity > 0 ? *capacity * 2 : 16;
+            char** grown = realloc(*tokens, new_capacity * sizeof(char*));
+            if (grown == NULL) return -1;
+            *tokens = grown;
+            *capacity = new_capacity;
+        }
+        if (*r == '\0') break;
+        char* w = r;
+        (*tokens)[count++] = w;
+        char quote = 0;
+        while (*r != '\0' && (quote != 0 || (*r != ' ' && *r != '\t' && *r != '\r'))) {
+            if (quote == 0 && (*r == '\'' || *r == '"')) quote = *r++;
+            else if (quote != 0 && *r == quote) { quote = 0; r++; }
+            else if (*r == '\\' && quote != '\'' && r[1] != '\0') { r++; *w++ = *r++; }
+            else *w++ = *r++;
+        }
+        if (quote != 0) return -1;
+        if (*r != '\0') r++;
+        *w = '\0';
+    }
+    for (int i = count; i < count + 4; i++) (*tokens)[i] = NULL;
+    return count;
+}
+
+//join tokens with single spaces into a heap string (caller frees)
+static char* join_tokens(char** tokens, int count) {
+    size_t len = 1;
+    for (int i = 0; i < count; i++) len += strlen(tokens[i]) + 1;
+    char* text = malloc(len);
+    if (text == NULL) return NULL;
+    text[0] = '\0';
+    char* w = text;
+    for (int i = 0; i < count; i++) {
+        if (i > 0) *w++ = ' ';
+        size_t n = strlen(tokens[i]);
+        memcpy(w, tokens[i], n + 1);
+        w += n;
+    }
+    return text;
+}
 
-void shell_init() {
-    char* disk_memory = NULL;         // Memory mapped disk
-    uint32_t* fat = NULL;             // Pointer to FAT
-    size_t disk_size = 0;             // Disk size
-    uint32_t reserved_blocks = 0;     // Number of reserved blocks (metainfo + FAT)
-    uint32_t root_block = 0;          // Block index of the root directory
+//run the shell reading commands from in. Batch mode prints no banner or prompts,
+//skips the current path rebuild and defers FAT/metainfo write-back to the end of the input.
+void shell_init(FILE* in, bool batch) {
+    Volume vol = {0};                 // Mounted volume: mapping, metainfo and FAT
+    uint32_t root_ino = 0;            // Inode of the root directory
     uint32_t cursor = 0;               // Cursor for current directory
-    char current_path[128] = "/";     // initial path (root)
+    char current_path[MAX_PATH_LEN] = "/";     // initial path (root)
     bool DISK_IS_MOUNTED = false;     // flag to check if a disk is mounted
-    printf("\nWelcome to FS Shell!\n");
+    char* command = NULL;             // current input line, grown by getline
+    size_t command_size = 0;
+    char** tokens = NULL;             // tokens of the current line
+    size_t tokens_capacity = 0;
+    if (!batch) printf("\nWelcome to FS Shell!\n");
     while (1) {
-        printf("----------------------\n");
-        printf("\ntype 'help' for a list of commands\n");
-        printf("----------------------\n");
-        get_current_path(disk_memory, cursor, BLOCK_SIZE, disk_size, current_path, sizeof(current_path));
-        printf("SHELL:%s$ ", current_path);
-        char command[MAX_COMMAND_LENGTH];
-        if (!fgets(command, MAX_COMMAND_LENGTH, stdin)) {
-            printf("Error reading input\n");
-            continue;
+        if (!batch) {
+            printf("----------------------\n");
+            printf("\ntype 'help' for a list of commands\n");
+            printf("----------------------\n");
+            get_current_path(&vol, cursor, current_path, sizeof(current_path));
+            printf("SHELL:%s$ ", current_path);
+        }
+        if (getline(&command, &command_size, in) == -1) {
+            //end of input closes the shell, writing back whatever is pending
+            if (DISK_IS_MOUNTED && fs_unmount(&vol) != FS_OK) perror("Error flushing volume");
+            break;
         }
         //remove newline character
         command[strcspn(command, "\n")] = 0;
-        if (strlen(command) == 0) {
-            printf("Invalid input: no command entered\n");
-            continue;
-        }
         //tokenize command
-        char* tokens[MAX_TOKENS + 1];
-        int i = 0;
-        char* token = strtok(command, " \t");
-        while (token != NULL && i < MAX_TOKENS) {
-            tokens[i++] = token;
-            token = strtok(NULL, " \t");
+        int num_tokens = tokenize(command, &tokens, &tokens_capacity);
+        if (num_tokens < 0) {
+            printf("Error: unterminated quote\n");
+            continue;
         }
-        if (token != NULL) {
-            printf("Error: too many arguments. Maximum is %d\n", MAX_TOKENS);
+        if (num_tokens == 0) {
+            if (!batch) printf("Invalid input: no command entered\n");
             continue;
         }
-        tokens[i] = NULL;  // terminator
         char* comm = tokens[0];
         //help command
         if (strcmp(comm, "help") == 0) {
             printf("\nAvailable commands:\n");
-            printf(" - format <fs_filename>: create or open disk\n");
+            printf(" - format <fs_filename> [options]: create or open disk (options: sync, writeback, interval=<s>, threshold=<blocks>, threads, max=<MB>, discard, block=<KB>, io=mmap|pread|direct|uring|pool, qd=<n>)\n");
             printf(" - mkdir <dir_name>: create new directory\n");
             printf(" - cd <dir_name>: change directory\n");
             printf(" - touch <file_name>: create new file\n");
@@ -55,7 +102,14 @@ void shell_init() {
             printf(" - ls: list directory contents\n");
             printf(" - append <file_name> append text to file\n");
             printf(" - rm <file_name>: remove file\n");
+            printf(" - import <host_path> <file_name>: copy a host file into a new file\n");
+            printf(" - export <file_name> <host_path>: copy a file to the host\n");
             printf(" - rmdir <dir_name>: remove directory\n");
+            printf(" - sync: flush all pending writes to the disk file\n");
+            printf(" - grow <size>: grow the disk while mounted, up to the max=<MB> it was formatted with\n");
+            printf(" - trim: give the free space of the disk back to the host file system\n");
+            printf(" - fsck [repair]: check the disk for broken chains, cross-links and orphans, optionally fixing them\n");
+            printf(" - convert <old_fs_filename> <new_fs_filename>: copy a disk from an older format into a new disk\n");
             printf(" - close\n");
             continue;
         }
@@ -66,26 +120,101 @@ void shell_init() {
                 continue;
             }
             printf("Exiting shell...\n");
-            close_and_unmap_disk(disk_memory, disk_size);
+            if (fs_unmount(&vol) != FS_OK) perror("Error flushing volume");
             break;
         }
+        //sync command
+        else if (strcmp(comm, "sync") == 0) {
+            if (!DISK_IS_MOUNTED) {
+                printf("No disk is currently mounted.\n");
+                continue;
+            }
+            if (fs_sync(&vol) != FS_OK) printf("Error: failed to sync disk\n");
+            continue;
+        }
+        //grow command
+        else if (strcmp(comm, "grow") == 0) {
+            if (!DISK_IS_MOUNTED) {
+                printf("No disk is currently mounted.\n");
+                continue;
+            }
+            if (tokens[1] == NULL) {
+                printf("Error: usage: grow <size>\n");
+                continue;
+            }
+            //same units as the format prompt
+            int res = fs_grow(&vol, parse_size(tokens[1], 1024 * 1024));
+            if (res != FS_OK) {
+                printf("Error: %s\n", fs_strerror(res));
+                continue;
+            }
+            printf("Disk grown to %s\n", format_size(vol.disk.size));
+            continue;
+        }
+        //trim command
+        else if (strcmp(comm, "trim") == 0) {
+            if (!DISK_IS_MOUNTED) {
+                printf("No disk is currently mounted.\n");
+                continue;
+            }
+            uint64_t discarded;
+            if (fs_trim(&vol, &discarded) != FS_OK) {
+                printf("Error: failed to punch holes in the disk file (%s)\n", strerror(errno));
+                continue;
+            }
+            printf("Trimmed %" PRIu64 " free blocks (%s)\n", discarded, format_size(discarded << vol.disk.block_shift));
+            continue;
+        }
+        //fsck command
+        else if (strcmp(comm, "fsck") == 0) {
+            if (!DISK_IS_MOUNTED) {
+                printf("No disk is currently mounted.\n");
+                continue;
+            }
+            bool repair = tokens[1] != NULL && strcmp(tokens[1], "repair") == 0;
+            if (tokens[1] != NULL && !repair) {
+                printf("Error: usage: fsck [repair]\n");
+                continue;
+            }
+            check_disk(&vol, repair);
+            //a repair may have unlinked the current directory
+            const Entry* current = get_entry(&vol, cursor);
+            if (current == NULL || current->ino != cursor) cursor = ROOT_INO;
+            continue;
+        }
+        //convert command
+        else if (strcmp(comm, "convert") == 0) {
+            if (tokens[1] == NULL || tokens[2] == NULL) {
+                printf("Error: missing arguments\n");
+                continue;
+            }
+            MountOptions opts;
+            default_mount_options(&opts);
+            if (convert_disk(tokens[1], tokens[2], &opts) != 0) {
+                printf("Error: failed to convert disk\n");
+                continue;
+            }
+            printf("Disk converted: %s -> %s, mount it with 'format %s'\n", tokens[1], tokens[2], tokens[2]);
+            continue;
+        }
         //format command
         else if (strcmp(comm, "format") == 0) {
-            //2 arguments expected: filename and size
-            //print error if too many arguments are given
+            //filename expected, mount options are optional
             if (tokens[1] == NULL) {
                 printf("Error: missing arguments\n");
                 continue;
             }
-            if(tokens[2] != NULL) {
-                printf("Error: too many arguments. Usage: format <fs_filename> <size>\n");
+            char* filename = tokens[1];
+            MountOptions opts;
+            default_mount_options(&opts);
+            if (tokens[2] != NULL && parse_mount_options(tokens[2], &opts) != 0) {
+                printf("Error: invalid mount options. Usage: format <fs_filename> [sync|writeback,interval=<s>,threshold=<blocks>,threads,max=<MB>,discard,block=<KB>,io=mmap|pread|direct|uring|pool,qd=<n>]\n");
                 continue;
             }
-            char* filename = tokens[1];
-            //the user is asked for size in MB (16, 32, 64)
-            printf("Enter disk size in MB (16, 32, 64): ");
+            //the user is asked for size in MB, or with a K/M/G/T suffix; an existing image keeps its own size
+            if (!batch) printf("Enter disk size in MB (or with a K/M/G/T suffix, up to 16T): ");
             char size_str[16];
-            if (!fgets(size_str, sizeof(size_str), stdin)) {
+            if (!fgets(size_str, sizeof(size_str), in)) {
                 printf("Error reading size input\n");
                 continue;
             }
@@ -94,38 +223,41 @@ void shell_init() {
                 printf("Error: no size entered\n");
                 continue;
             }
-            //convert to size_t
-            size_t size = strtoul(size_str, NULL, 10);
-            if (size != 16 && size != 32 && size != 64) {
+            //convert to bytes
+            size_t disk_size = parse_size(size_str, 1024 * 1024);
+            if (disk_size < MIN_DISK_SIZE || disk_size > MAX_DISK_SIZE) {
                 printf("Error: invalid size\n");
                 continue;
             }
-            disk_size = size * 1024 * 1024; // convert to bytes
-            if (fat != NULL) {
-                free(fat);
-                fat = NULL;
+            //release the previously mounted volume, if any
+            if (DISK_IS_MOUNTED) {
+                if (fs_unmount(&vol) != FS_OK) perror("Error flushing volume");
+                DISK_IS_MOUNTED = false;
+            }
+            if (format_disk(&vol, filename, disk_size, &opts) != 0) {
+                printf("Error: failed to format disk\n");
+                cursor = 0;
+                continue;
             }
-            disk_memory = format_disk(filename, disk_size);
-            if (disk_memory == NULL) handle_error("Failed to format disk");
-            printf("\nDisk formatted and mounted successfully: %s (%s)\n", filename, format_size(disk_size));
+            printf("\nDisk formatted and mounted successfully: %s (%s)\n", filename, format_size(vol.disk.size));
             if (DEBUG){
                 printf("\n");
-                print_disk_status(disk_memory, disk_size);
+                print_disk_status(&vol.disk);
                 printf("\n");
             } 
-            //compute reserved blocks and root block
-            reserved_blocks = calc_reserved_blocks(disk_size, BLOCK_SIZE);
-            root_block = reserved_blocks; // Assuming root is the first block after reserved
-            Entry* root = read_directory_from_block(disk_memory, root_block, BLOCK_SIZE, disk_size);
+            //the root directory is always the first inode
+            root_ino = ROOT_INO;
+            const Entry* root = get_entry(&vol, root_ino);
             if (root == NULL) handle_error("Failed to read root directory");
             if(DEBUG){
                 printf("Root directory:\n");
                 print_directory(root);
             }
-            free(root);
-            cursor = root_block;
+            cursor = root_ino;
             strncpy(current_path, "/", sizeof(current_path));
-            if(DEBUG) printf("Cursor at root block: %u\n", cursor);
+            //in batch mode every command is still committed to the journal, the flushes wait for the end of the input
+            vol.defer_flush = batch;
+            if(DEBUG) printf("Cursor at root inode: %u\n", cursor);
             DISK_IS_MOUNTED = true;
             continue;
         }
@@ -142,17 +274,16 @@ void shell_init() {
             }
             char* dir_name = tokens[1];
             if(DEBUG) printf("Creating directory: %s\n", dir_name);
-            //cursor is the block of the current directory, already set in cd or at startup
+            //cursor is the inode of the current directory, already set in cd or at startup
             //the new directory is created inside the current directory
-            create_directory(disk_memory, dir_name, cursor, disk_size);
+            create_directory(&vol, dir_name, cursor);
             if(DEBUG) printf("Directory created: %s\n", dir_name);
             if(DEBUG){
                 //print the updated current directory
                 printf("Updated current directory:\n");
-                Entry* current_dir = read_directory_from_block(disk_memory, cursor, BLOCK_SIZE, disk_size);
+                const Entry* current_dir = get_entry(&vol, cursor);
                 if (current_dir == NULL) handle_error("Failed to read current directory");
                 print_directory(current_dir);
-                free(current_dir);
             }
             continue;
         }
@@ -163,13 +294,13 @@ void shell_init() {
                 continue;
             }
             if(DEBUG) printf("Changing directory...\n");
-            //cursor has to be updated to the new directory block
+            //cursor has to be updated to the new directory inode
             if (tokens[1] == NULL) {
                 printf("Error: missing arguments\n");
                 continue;
             }
             char* dir_name = tokens[1];
-            cursor = change_directory(dir_name, cursor, disk_memory, disk_size);
+            cursor = change_directory(&vol, dir_name, cursor);
             if (cursor == FAT_EOF) {
                 printf("Error: failed to change directory\n");
                 continue;
@@ -189,15 +320,14 @@ void shell_init() {
             }
             char* dir_name = tokens[1];
             if(DEBUG) printf("Removing directory: %s\n", dir_name);
-            remove_directory(disk_memory, dir_name, cursor, disk_size);
+            remove_directory(&vol, dir_name, cursor);
             if(DEBUG) printf("Directory removed: %s\n", dir_name);
             if(DEBUG){
                 //print the updated current directory
-                Entry* current_dir = read_directory_from_block(disk_memory, cursor, BLOCK_SIZE, disk_size);
+                const Entry* current_dir = get_entry(&vol, cursor);
                 if (current_dir == NULL) handle_error("Failed to read current directory");
                 printf("Updated current directory:\n");
                 print_directory(current_dir);
-                free(current_dir);
             }
             continue;
         }      
@@ -209,7 +339,7 @@ void shell_init() {
             }
             if(DEBUG) printf("Listing files...\n");
             //we now list the contents of the current directory
-            list_directory_contents(disk_memory, cursor, disk_size);
+            list_directory_contents(&vol, cursor);
             continue;
         }
         //touch command
@@ -224,7 +354,7 @@ void shell_init() {
             }
             char* file_name = tokens[1];
             if(DEBUG) printf("Creating empty file...\n");
-            create_file(disk_memory, file_name, cursor, disk_size);
+            create_file(&vol, file_name, cursor);
             if(DEBUG) printf("Created empty file: %s\n", file_name);
             continue;
         }
@@ -238,30 +368,27 @@ void shell_init() {
                 continue;
             }
             char* file_name = tokens[1];
-            //we need a buffer for the text to append
-            char text[4096];
+            char* text = NULL;
             if (tokens[2] == NULL) {
                 // Ask user for text to append
-                printf("Enter text to append (end with newline):\n");
-                if (!fgets(text, sizeof(text), stdin)) {
+                if (!batch) printf("Enter text to append (end with newline):\n");
+                size_t text_size = 0;
+                if (getline(&text, &text_size, in) == -1) {
+                    free(text);
                     printf("Error reading text\n");
                     continue;
                 }
-                // Rimuovi newline finale
+                // Remove the trailing newline
                 text[strcspn(text, "\n")] = 0;
             } else {
-                // If present, take everything after the file name as text
-                char* text_start = strstr(command, file_name);
-                if (text_start) {
-                    text_start += strlen(file_name);
-                    while (*text_start == ' ' || *text_start == '\t') text_start++;
-                }
-                strncpy(text, text_start, sizeof(text)-1);
-                text[sizeof(text)-1] = 0;
+                //everything after the file name is the text, quote it to keep repeated spaces
+                text = join_tokens(tokens + 2, num_tokens - 2);
+                if (text == NULL) handle_error("Failed to allocate text buffer");
             }
             if(DEBUG) printf("Appending to file: %s\n", file_name);
             if(DEBUG) printf("Text to append: %s\n", text);
-            append_to_file(disk_memory, text, strlen(text), file_name, cursor, BLOCK_SIZE, disk_size);
+            append_to_file(&vol, text, strlen(text), file_name, cursor);
+            free(text);
             continue;
         }
         //rm command
@@ -276,10 +403,36 @@ void shell_init() {
             }
             char* file_name = tokens[1];
             if(DEBUG) printf("Removing file: %s\n", file_name);
-            remove_file(disk_memory, file_name, cursor, disk_size);
+            remove_file(&vol, file_name, cursor);
             if(DEBUG) printf("File removed: %s\n", file_name);
             continue;
         }
+        //import command
+        else if (strcmp(comm, "import") == 0) {
+            if (!DISK_IS_MOUNTED) {
+                printf("Error: no disk mounted. Please format a disk first.\n");
+                continue;
+            }
+            if (tokens[1] == NULL || tokens[2] == NULL) {
+                printf("Error: missing arguments\n");
+                continue;
+            }
+            import_file(&vol, tokens[1], tokens[2], cursor);
+            continue;
+        }
+        //export command
+        else if (strcmp(comm, "export") == 0) {
+            if (!DISK_IS_MOUNTED) {
+                printf("Error: no disk mounted. Please format a disk first.\n");
+                continue;
+            }
+            if (tokens[1] == NULL || tokens[2] == NULL) {
+                printf("Error: missing arguments\n");
+                continue;
+            }
+            export_file(&vol, tokens[1], tokens[2], cursor);
+            continue;
+        }
         //cat command
         else if (strcmp(comm, "cat") == 0) {
             if (!DISK_IS_MOUNTED) {
@@ -292,7 +445,7 @@ void shell_init() {
             }
             char* file_name = tokens[1];
             if(DEBUG) printf("Displaying content of file: %s\n", file_name);
-            cat_file(disk_memory, file_name, cursor, BLOCK_SIZE, disk_size);
+            cat_file(&vol, file_name, cursor);
             if(DEBUG) printf("\nEnd of file: %s\n", file_name);
             continue;
         }
@@ -302,10 +455,7 @@ void shell_init() {
             continue;
         }
     }
-    //cleanup on exit
-    if (fat != NULL) {
-        free(fat);
-        fat = NULL;
-    }
-    printf("shell closed\n");
+    free(command);
+    free(tokens);
+    if (!batch) printf("shell closed\n");
 }
\ No newline at end of file
@@ -6,4 +6,5 @@
 #include "shell_commands.h"
 #include "../utils/utils.h"
 
-void shell_init();
\ No newline at end of file
+//run the shell on in, batch mode skips prompts and defers write-back to the end of the input
+void shell_init(FILE* in, bool batch);
\ No newline at end of file
@@ -1,527 +1,438 @@
 #include "shell_commands.h"
 
 //format
-char* format_disk(const char *filename, size_t size) {
-    bool DISK_EXISTS = false;     // flag to check if a disk is mounted
-    char* disk_memory = NULL;         // Memory mapped disk
+int format_disk(Volume* vol, const char *filename, size_t size, const MountOptions* opts) {
     //check if disk already exists
-    FILE* file = fopen(filename, "r");
-    if (file) {
-        fclose(file);
+    if (access(filename, F_OK) == 0) {
         printf("Disk file already exists. Reading...\n");
-        disk_memory = open_and_map_disk(filename, size);
-        if (disk_memory == NULL) handle_error("Failed to open and map existing disk");
-        DISK_EXISTS = true;
-        //no need to write anything, just return the memory mapped disk
-        return disk_memory;
+        //no need to write anything, just load metainfo and FAT; the image keeps its own size
+        int res = fs_mount(vol, filename, opts);
+        if (res == FS_ERR_IO) handle_error("Failed to open and map existing disk");
+        //images written before format versioning have to be converted first
+        if (res == FS_ERR_OLD_FORMAT) printf("Disk uses an older format, convert it with: convert %s <new_fs_filename>\n", filename);
+        else if (res == FS_ERR_VERSION) printf("Disk uses format version %u, this build reads version %u\n", vol->info.version, FS_VERSION);
+        return res;
     }
     // Create a new disk
-    if(!DISK_EXISTS) {
-        if (DEBUG) printf("Creating and formatting new disk...\n");
-        disk_memory = open_and_map_disk(filename, size);
-        if (disk_memory == NULL) handle_error("Failed to create and format new disk");
-        //we need to initialize the disk info structure: metainfo, fat, root directory
-        //Calculate reserved blocks
-        uint32_t reserved_blocks = calc_reserved_blocks(size, BLOCK_SIZE);
-        uint32_t metainfo_blocks = 1;
-        uint32_t fat_blocks = reserved_blocks - metainfo_blocks;
-        if(DEBUG) printf("Reserved blocks: %u (Metainfo: %u, FAT: %u)\n", reserved_blocks, metainfo_blocks, fat_blocks);
-        // Initialize DiskInfo
-        DiskInfo info = {0};
-        info.block_size = BLOCK_SIZE;
-        info.disk_size = size;
-        info.free_blocks = (size / BLOCK_SIZE) - reserved_blocks;
-        info.free_list_head = 0; // Allocate/append will set this correctly
-        snprintf(info.name, MAX_NAME_LEN, "%s", filename);
-        // Initialize FAT
-        uint32_t num_blocks = size / BLOCK_SIZE;
-        uint32_t num_fat_entries = num_blocks;
-        uint32_t fat[num_fat_entries]; // Array to hold FAT entries
-        init_fat(fat, num_fat_entries);
-        if (DEBUG) printf("FAT initialized successfully.\n");
-        //we allocate the metainfo block
-        uint32_t result = allocate_block(fat, &info);
-        if (result == FAT_EOF) handle_error("Failed to allocate block for metainfo");
-        if (DEBUG) printf("Reserved block %d allocated for metainfo.\n", result);
-        //we append the reserved blocks to the chain
-        uint32_t index = 0;
-        for (uint32_t i = 1; i < reserved_blocks; i++) {
-            uint32_t new_block = append_block_to_chain(fat, &info, index);
-            if (new_block == FAT_EOF) handle_error("Failed to append reserved block to chain");
-            index++;
-        }
-        //write metainfo and fat to disk
-        int res = write_metainfo(disk_memory, &info, BLOCK_SIZE, size);
-        if (res != 0) handle_error("Failed to write metainfo to disk");
-        if (DEBUG) printf("Metainfo written to disk successfully.\n");
-        uint32_t fat_index = 1; // FAT starts at block 1
-        res = write_fat(disk_memory, fat, num_fat_entries, fat_index, BLOCK_SIZE, size);
-        if (res != 0) handle_error("Failed to write FAT to disk");
-        if (DEBUG) printf("FAT written to disk successfully.\n");
-        //add root directory
-        //allocate block for root
-        result = allocate_block(fat, &info);
-        if (result == FAT_EOF) handle_error("Failed to allocate block for root directory");
-        Entry root = {0};
-        init_directory(&root, "/", result);
-        root.current_block = result;
-        root.parent_block = FAT_EOF;
-        if (DEBUG) printf("Root directory initialized successfully.\n");
-        //write root to disk
-        res = write_entry(disk_memory, &root, BLOCK_SIZE, size);
-        if (res != 0) handle_error("Failed to write root directory to disk");
-        if (DEBUG) printf("Root directory written to disk successfully.\n");
-        //update fat and metainfo
-        res = write_info_and_fat(disk_memory, fat, num_fat_entries, 1, &info, BLOCK_SIZE, size);
-        if (res != 0) handle_error("Failed to update FAT and metainfo after root directory creation");
-        if (DEBUG) printf("FAT and metainfo updated successfully after root directory creation.\n");
-    }
-    return disk_memory;
+    if (DEBUG) printf("Creating and formatting new disk...\n");
+    int res = fs_format(vol, filename, size, opts);
+    if (res == FS_ERR_IO) handle_error("Failed to create and format new disk");
+    if (res != FS_OK) printf("Error: %s\n", fs_strerror(res));
+    if (DEBUG && res == FS_OK) print_disk_info(&vol->info);
+    return res;
 }
 
 //mkdir
-void create_directory(char* disk_mem, const char *name, uint32_t parent_block, size_t disk_size_bytes) {
+void create_directory(Volume* vol, const char *name, uint32_t parent_ino) {
     //the new directory will be created inside the parent directory
-    if (DEBUG) printf("Creating directory '%s' inside parent block %u\n", name, parent_block);
-    //load metainfo and fat
-    DiskInfo info;
-    uint32_t num_fat_entries = disk_size_bytes / BLOCK_SIZE;
-    uint32_t fat[num_fat_entries];
-    read_info_and_fat(disk_mem, &info, fat, disk_size_bytes);
-    if (DEBUG) {
-        printf("In create_directory:\n");
-        print_disk_info(&info);
-        print_fat(fat, ENTRIES_TO_PRINT);
-    }
-    //check if there's space for a new directory
-    if (info.free_blocks == 0) handle_error("No free blocks available to create new directory");
-    //scan the children of the parent directory to check if a directory with the same name already exists
-    //read parent directory
-    Entry* parent_dir = read_directory_from_block(disk_mem, parent_block, BLOCK_SIZE, disk_size_bytes);
-    if (parent_dir == NULL) handle_error("Failed to read parent directory");
-    uint32_t* children_blocks = get_children_blocks(parent_dir);
-    if (children_blocks == NULL) handle_error("Failed to get children blocks of parent directory");
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (children_blocks[i] == 0) continue; // No child in this slot
-        Entry* child = read_directory_from_block(disk_mem, children_blocks[i], BLOCK_SIZE, disk_size_bytes);
-        if (child == NULL) handle_error("Failed to read child directory");
-        if (strcmp(child->name, name) == 0 && child->type == ENTRY_TYPE_DIR) {
-            printf("Directory with the same name already exists in the parent directory");
-            free(parent_dir);
-            free(child);
-            return;
-        }
-        free(child);
-    }
-    //if program reaches here, it's possible to create the new directory
-    if (DEBUG) printf("Parent directory read successfully.\n");
-    if (DEBUG) print_directory(parent_dir);
-    //allocate block for new directory
-    uint32_t new_dir_block = allocate_block(fat, &info);
-    if (new_dir_block == FAT_EOF) handle_error("Failed to allocate block for new directory");
-    //initialize new directory
-    Entry new_dir;
-    init_directory(&new_dir, name, new_dir_block);
-    new_dir.current_block = new_dir_block;
-    new_dir.parent_block = parent_block;
-    //write new directory to disk
-    int res = write_entry(disk_mem, &new_dir, BLOCK_SIZE, disk_size_bytes);
-    if (res != 0) handle_error("Failed to write new directory to disk");
-    if (DEBUG) printf("New directory written to disk successfully.\n");
-    //add new directory to parent
-    update_directory_children(parent_dir, new_dir_block);
-    //write updated parent directory to disk
-    res = write_entry(disk_mem, parent_dir, BLOCK_SIZE, disk_size_bytes);
-    if (res != 0) handle_error("Failed to update parent directory on disk");
-    if (DEBUG) printf("Parent directory updated successfully.\n");
-    //update fat and metainfo on disk
-    res = write_info_and_fat(disk_mem, fat, num_fat_entries, 1, &info, BLOCK_SIZE, disk_size_bytes);
-    if (res != 0) handle_error("Failed to update FAT and metainfo after creating new directory");
-    if (DEBUG) printf("FAT and metainfo updated successfully after creating new directory.\n");
-    if (DEBUG) printf("Directory '%s' created successfully inside parent block %u\n", name, parent_block);
-    if (DEBUG) {
-        printf("Updated parent directory:\n");
-        print_directory(parent_dir);
-        printf("New directory:\n");
-        print_directory(&new_dir);
+    if (DEBUG) printf("Creating directory '%s' inside parent inode %u\n", name, parent_ino);
+    uint32_t new_dir_ino;
+    int res = fs_mkdir(vol, parent_ino, name, &new_dir_ino);
+    switch (res) {
+        case FS_OK: break;
+        case FS_ERR_NO_INODES: printf("No free inodes available to create new directory\n"); return;
+        case FS_ERR_NAME_TOO_LONG: printf("Directory name too long (max %d characters)\n", MAX_NAME_LEN - 1); return;
+        case FS_ERR_EXISTS: printf("Directory with the same name already exists in the parent directory"); return;
+        case FS_ERR_NO_SPACE: printf("No free blocks available to grow the directory.\n"); return;
+        case FS_ERR_DIR_FULL: printf("Directory is full, cannot add more children.\n"); return;
+        case FS_ERR_IO: handle_error("Failed to update FAT and metainfo after creating new directory");
+        default: printf("Error: %s\n", fs_strerror(res)); return;
     }
     if (DEBUG) {
-        //print updated disk info and fat
-        print_disk_info(&info);
-        print_fat(fat, ENTRIES_TO_PRINT);
+        printf("Directory '%s' created successfully inside parent inode %u\n", name, parent_ino);
+        print_directory(get_entry(vol, new_dir_ino));
+        print_disk_info(&vol->info);
+        print_fat(vol->fat, ENTRIES_TO_PRINT);
     }
-    //clean up
-    free(parent_dir);
 }
 
 //rmdir
-void remove_directory(char* disk_mem, const char *name, uint32_t parent_block, size_t disk_size_bytes) {
-    //load metainfo and fat
-    DiskInfo info;
-    uint32_t num_fat_entries = disk_size_bytes / BLOCK_SIZE;
-    uint32_t fat[num_fat_entries];
-    read_info_and_fat(disk_mem, &info, fat, disk_size_bytes);
-    //read parent directory
-    Entry* parent_dir = read_directory_from_block(disk_mem, parent_block, BLOCK_SIZE, disk_size_bytes);
-    if (parent_dir == NULL) handle_error("Failed to read parent directory");
-    //find the child directory to remove
-    uint32_t* children_blocks = get_children_blocks(parent_dir);
-    if (children_blocks == NULL) handle_error("Failed to get children blocks of parent directory");
-    int dir_index = -1;
-    Entry* dir_to_remove = NULL;
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (children_blocks[i] == 0) continue; // No child in this slot
-        Entry* child = read_directory_from_block(disk_mem, children_blocks[i], BLOCK_SIZE, disk_size_bytes);
-        if (child == NULL) handle_error("Failed to read child directory");
-        if (strcmp(child->name, name) == 0 && child->type == ENTRY_TYPE_DIR) {
-            dir_index = i;
-            dir_to_remove = child;
-            break;
-        }
-        free(child);
-    }
-    if (dir_index == -1 || dir_to_remove == NULL) {
-        printf("Directory to remove not found in parent directory");
-        free(parent_dir);
-        return;
-    }
-    //check if directory is empty
-    if (dir_to_remove->size > 0) {
-        printf("Directory is not empty, cannot remove");
-        free(parent_dir);
-        free(dir_to_remove);
-        return;
+void remove_directory(Volume* vol, const char *name, uint32_t parent_ino) {
+    int res = fs_rmdir(vol, parent_ino, name);
+    switch (res) {
+        case FS_OK: break;
+        case FS_ERR_NOT_FOUND: printf("Directory to remove not found in parent directory"); return;
+        case FS_ERR_NOT_EMPTY: printf("Directory is not empty, cannot remove"); return;
+        case FS_ERR_IO: handle_error("Failed to update FAT and metainfo after removing directory");
+        default: printf("Error: %s\n", fs_strerror(res)); return;
     }
-    //deallocate directory block
-    int res = deallocate_chain(fat, &info, dir_to_remove->current_block);
-    if (res != 0) handle_error("Failed to deallocate directory block");
-    //remove directory from parent by zeroing its entry
-    parent_dir->dir_blocks[dir_index] = 0;
-    if(parent_dir->size > 0) parent_dir->size--;
-    //write updated parent directory to disk
-    res = write_entry(disk_mem, parent_dir, BLOCK_SIZE, disk_size_bytes);
-    if (res != 0) handle_error("Failed to write updated parent directory to disk");
-    //update fat and metainfo on disk
     if(DEBUG){
         //print updated fat
-        print_fat(fat, ENTRIES_TO_PRINT);
+        print_fat(vol->fat, ENTRIES_TO_PRINT);
     }
-    res = write_info_and_fat(disk_mem, fat, num_fat_entries, 1, &info, BLOCK_SIZE, disk_size_bytes);
-    if (res != 0) handle_error("Failed to update FAT and metainfo after removing directory");
-    //clean up
-    free(parent_dir);
+}
+
+//print one line of ls
+static int print_dirent(const Dirent* child, void* arg) {
+    (void)arg;
+    printf("- Name: %.*s - Type: %s - Size: %s\n", MAX_NAME_LEN, child->name, child->type == ENTRY_TYPE_DIR ? "Directory" : "File", format_size(child->size));
+    return 0;
 }
 
 //ls
-void list_directory_contents(char* disk_mem, uint32_t cursor, size_t disk_size_bytes) {
+void list_directory_contents(Volume* vol, uint32_t cursor) {
     //read directory at cursor
-    Entry* dir = read_directory_from_block(disk_mem, cursor, BLOCK_SIZE, disk_size_bytes);
+    const Entry* dir = get_entry(vol, cursor);
     if (dir == NULL) handle_error("Failed to read directory at cursor");
     printf("Contents of directory '%s':\n", dir->name);
-    uint32_t* children_blocks = get_children_blocks(dir);
-    if (children_blocks == NULL) handle_error("Failed to get children blocks of directory");
-    int has_children = 0;
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-            if (children_blocks[i] == 0) continue; // No child in this slot
-        Entry* child = read_directory_from_block(disk_mem, children_blocks[i], BLOCK_SIZE, disk_size_bytes);
-        if (child == NULL) handle_error("Failed to read child entry");
-        printf("- Name: %s - Type: %s - Size: %s\n", child->name, child->type == ENTRY_TYPE_DIR ? "Directory" : "File", format_size(child->size));
-        free(child);
-        has_children = 1;
-    }
-    if (!has_children) {
+    //name, type and size of every child are inline in the directory buckets
+    if (directory_is_empty(dir)) {
         printf("Directory is empty.\n");
+        return;
     }
-    free(dir);
+    fs_readdir(vol, cursor, print_dirent, NULL);
 }
 
 //cd
-uint32_t change_directory(const char *path, uint32_t cursor, char* disk_mem, size_t disk_size_bytes) {
+uint32_t change_directory(Volume* vol, const char *path, uint32_t cursor) {
     //this function returns a new cursor
     //it's possible to change from the parent directory to one of its children
     //or from a child directory to its parent (..)
-    //load metainfo and fat
-    uint32_t new_cursor = cursor;
-    DiskInfo info;
-    uint32_t num_fat_entries = disk_size_bytes / BLOCK_SIZE;
-    uint32_t fat[num_fat_entries];
-    read_info_and_fat(disk_mem, &info, fat, disk_size_bytes);
     //read current directory
-    Entry* current_dir = read_directory_from_block(disk_mem, cursor, BLOCK_SIZE, disk_size_bytes);
+    const Entry* current_dir = get_entry(vol, cursor);
     if (current_dir == NULL) handle_error("Failed to read current directory");
     //check if path is ".." to go to parent
     if (strcmp(path, "..") == 0) {
-        if (current_dir->parent_block == FAT_EOF) {
+        if (current_dir->parent_ino == FAT_EOF) {
             printf("Already at root directory, cannot go up.\n");
-            free(current_dir);
             return cursor;
         }
-        Entry* parent_dir = read_directory_from_block(disk_mem, current_dir->parent_block, BLOCK_SIZE, disk_size_bytes);
-        if (parent_dir == NULL) handle_error("Failed to read parent directory");
-        if (DEBUG) printf("Changed directory to parent: '%s'\n", parent_dir->name);
-        new_cursor = parent_dir->current_block;
-        free(current_dir);
-        free(parent_dir);
-        return new_cursor;
+        if (DEBUG) printf("Changed directory to parent inode %u\n", current_dir->parent_ino);
+        return current_dir->parent_ino;
     }
     //look for the child directory with the given name
-    uint32_t* children_blocks = get_children_blocks(current_dir);
-    if (children_blocks == NULL) handle_error("Failed to get children blocks of current directory");
-    int found = 0;
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (children_blocks[i] == 0) continue; // No child in this slot
-        Entry* child = read_directory_from_block(disk_mem, children_blocks[i], BLOCK_SIZE, disk_size_bytes);
-        if (child == NULL) handle_error("Failed to read child directory");
-        if (strcmp(child->name, path) == 0 && child->type == ENTRY_TYPE_DIR) {
-            if (DEBUG) printf("Changed directory to child: '%s'\n", child->name);
-            new_cursor = child->current_block;
-            found = 1;
-            free(child);
-            break;
-        }
-        free(child);
-    }
-    if (!found) {
+    uint32_t child_ino;
+    if (fs_lookup(vol, cursor, path, ENTRY_TYPE_DIR, &child_ino) != FS_OK) {
         printf("Directory '%s' not found in current directory.\n", path);
+        return cursor;
     }
-    free(current_dir);
-    return new_cursor;
+    if (DEBUG) printf("Changed directory to child: '%s'\n", path);
+    return child_ino;
 }
 
 //touch
-void create_file(char* disk_mem, const char* name, uint32_t parent_block, size_t disk_size_bytes){
-    //allocate a new block with FAT (allocateBlock).
-    DiskInfo info;
-    uint32_t num_fat_entries = disk_size_bytes / BLOCK_SIZE;
-    uint32_t fat[num_fat_entries];
-    read_info_and_fat(disk_mem, &info, fat, disk_size_bytes);
-    //check if there's space for a new file
-    if (info.free_blocks == 0) handle_error("No free blocks available to create new file");
-    //scan the children of the parent directory to check if a file with the same name already exists
-    //read parent directory
-    Entry* parent_dir = read_directory_from_block(disk_mem, parent_block, BLOCK_SIZE, disk_size_bytes);
-    if (parent_dir == NULL) handle_error("Failed to read parent directory");
-    if (DEBUG) printf("Parent directory read successfully.\n");
-    uint32_t* children_blocks = get_children_blocks(parent_dir);
-    if (children_blocks == NULL) handle_error("Failed to get children blocks of parent directory");
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (children_blocks[i] == 0) continue; // No child in this slot
-        Entry* child = read_directory_from_block(disk_mem, children_blocks[i], BLOCK_SIZE, disk_size_bytes);
-        if (child == NULL) handle_error("Failed to read child directory");
-        if (strcmp(child->name, name) == 0 && child->type == ENTRY_TYPE_FILE) {
-            printf("File with the same name already exists in the parent directory");
-            free(child);
-            free(parent_dir);
-            return;
-        }
-        free(child);
-    }
-    //if program reaches here, it means it's possible to create the new file
-    //allocate block for new file
-    uint32_t new_file_block = allocate_block(fat, &info);
-    if (new_file_block == FAT_EOF) handle_error("Failed to allocate block for new file");
-    //initialize new file
-    Entry new_file;
-    init_file(&new_file, name, new_file_block);
-    if (DEBUG) printf("shell_commands: Creating file with name: %s at block %u\n", new_file.name, new_file_block);
-    new_file.name[MAX_NAME_LEN - 1] = '\0'; // Ensure null-termination
-    new_file.current_block = new_file_block;
-    new_file.parent_block = parent_block;
-    //write new file to disk
-    write_entry(disk_mem, &new_file, BLOCK_SIZE, disk_size_bytes);
-    //update parent directory
-    update_directory_children(parent_dir, new_file_block);
-    //write updated parent directory to disk
-    write_entry(disk_mem, parent_dir, BLOCK_SIZE, disk_size_bytes);
-    //update fat and metainfo on disk
+void create_file(Volume* vol, const char* name, uint32_t parent_ino){
+    int res = fs_create(vol, parent_ino, name, NULL);
+    switch (res) {
+        case FS_OK: break;
+        case FS_ERR_NO_INODES: printf("No free inodes available to create new file\n"); return;
+        case FS_ERR_NAME_TOO_LONG: printf("File name too long (max %d characters)\n", MAX_NAME_LEN - 1); return;
+        case FS_ERR_EXISTS: printf("File with the same name already exists in the parent directory"); return;
+        case FS_ERR_NO_SPACE: printf("No free blocks available to grow the directory.\n"); return;
+        case FS_ERR_DIR_FULL: printf("Directory is full, cannot add more children.\n"); return;
+        case FS_ERR_IO: handle_error("Failed to update FAT and metainfo after creating new file");
+        default: printf("Error: %s\n", fs_strerror(res)); return;
+    }
     if (DEBUG) {
         printf("Updated FAT:\n");
-        print_fat(fat, ENTRIES_TO_PRINT);
+        print_fat(vol->fat, ENTRIES_TO_PRINT);
     }
-    int res = write_info_and_fat(disk_mem, fat, num_fat_entries, 1, &info, BLOCK_SIZE, disk_size_bytes);
-    if (res != 0) handle_error("Failed to update FAT and metainfo after creating new file");
-    if (DEBUG) printf("FAT and metainfo updated successfully after creating new file.\n");
-    //clean up
-    free(parent_dir);
 }
 
 //rm
-void remove_file(char* disk_mem, const char *name, uint32_t parent_block, size_t disk_size_bytes){
-    //load_info_and_fat
-    DiskInfo info;
-    uint32_t num_fat_entries = disk_size_bytes / BLOCK_SIZE;
-    uint32_t fat[num_fat_entries];
-    read_info_and_fat(disk_mem, &info, fat, disk_size_bytes);
-    //read parent directory
-    Entry* parent_dir = read_directory_from_block(disk_mem, parent_block, BLOCK_SIZE, disk_size_bytes);
-    if (parent_dir == NULL) handle_error("Failed to read parent directory");
-    //find file entry in parent (scan dir_blocks)
-    uint32_t* children_blocks = get_children_blocks(parent_dir);
-    if (children_blocks == NULL) handle_error("Failed to get children blocks of parent directory");
-    int file_index = -1;
-    Entry* file_entry = NULL;
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (children_blocks[i] == 0) continue; // No child in this slot
-        Entry* child = read_directory_from_block(disk_mem, children_blocks[i], BLOCK_SIZE, disk_size_bytes);
-        if (child == NULL) handle_error("Failed to read child entry");
-        if (strcmp(child->name, name) == 0 && child->type == ENTRY_TYPE_FILE) {
-            file_index = i;
-            file_entry = child;
-            break;
-        }
-        free(child);
+void remove_file(Volume* vol, const char *name, uint32_t parent_ino){
+    int res = fs_unlink(vol, parent_ino, name);
+    switch (res) {
+        case FS_OK: break;
+        case FS_ERR_NOT_FOUND: printf("File to remove not found in parent directory"); return;
+        case FS_ERR_BUSY: printf("File is open, cannot remove"); return;
+        case FS_ERR_IO: handle_error("Failed to update FAT and metainfo after removing file");
+        default: printf("Error: %s\n", fs_strerror(res)); return;
     }
-    if (file_index == -1 || file_entry == NULL) {
-        printf("File to remove not found in parent directory");
-        free(parent_dir);
-        return;
-    }
-    //If program reaches here, it means it found the file to remove
-    //compute total size to subtract from parent directory size
-    uint32_t total_size = file_entry->size;
-    int res = deallocate_chain(fat, &info, file_entry->current_block);
-    if (res != 0) handle_error("Failed to deallocate file blocks");
-    //update parent directory
-    parent_dir->dir_blocks[file_index] = 0;
-    parent_dir->size-= total_size;
-    //write_entry (parent)
-    res = write_entry(disk_mem, parent_dir, BLOCK_SIZE, disk_size_bytes);
-    if (res != 0) handle_error("Failed to write updated parent directory to disk");
-    //update_fat_and_metainfo
     if (DEBUG) {
         printf("Updated FAT:\n");
-        print_fat(fat, ENTRIES_TO_PRINT);
+        print_fat(vol->fat, ENTRIES_TO_PRINT);
     }
-    res = write_info_and_fat(disk_mem, fat, num_fat_entries, 1, &info, BLOCK_SIZE, disk_size_bytes);
-    if (res != 0) handle_error("Failed to update FAT and metainfo after removing file");
-    //clean up
-    free(parent_dir);
-    free(file_entry);
 }
 
 //append
-void append_to_file(char* disk_mem, char* data, size_t data_len, char* filename, uint32_t cursor, size_t block_size, size_t disk_size_bytes){
-    //load info and FAT
-    DiskInfo info;
-    uint32_t num_fat_entries = disk_size_bytes / block_size;
-    uint32_t fat[num_fat_entries];
-    read_info_and_fat(disk_mem, &info, fat, disk_size_bytes);
-    //find file_entry in current directory
-    Entry* file_entry = NULL;
-    Entry* current_dir = read_directory_from_block(disk_mem, cursor, block_size, disk_size_bytes);
-    if (!current_dir) handle_error("Failed to read current directory");
-    uint32_t* children_blocks = get_children_blocks(current_dir);
-    if (!children_blocks) handle_error("Failed to get children blocks");
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (children_blocks[i] == 0) continue;
-        Entry* child = read_directory_from_block(disk_mem, children_blocks[i], block_size, disk_size_bytes);
-        if (!child) handle_error("Failed to read child directory");
-        if (strcmp(child->name, filename) == 0 && child->type == ENTRY_TYPE_FILE) {
-            file_entry = child;
-            break;
-        }
-        free(child);
+void append_to_file(Volume* vol, const char* data, size_t data_len, const char* filename, uint32_t cursor){
+    //open the file in current directory, the handle maps offsets to blocks without walking the chain
+    int fd = fs_open(vol, cursor, filename);
+    if (fd < 0) {
+        if (fd == FS_ERR_NOT_FOUND) printf("File to append to not found in current directory\n");
+        else printf("Error: %s\n", fs_strerror(fd));
+        return;
     }
-    free(current_dir);
-    if (!file_entry) {
-        printf("File to append to not found in current directory\n");
+    ssize_t res = fs_pwrite(vol, fd, data, data_len, fs_size(vol, fd));
+    if (res < 0) printf("Error: %s\n", fs_strerror(res));
+    //closing writes back FAT and metainfo
+    if (fs_close(vol, fd) != FS_OK) handle_error("Failed to update FAT/metainfo after append");
+}
+
+//cat, import and export move data in chunks of this many bytes: one chunk is a batch of runs the
+//uring and pool backends keep in flight at once
+#define COPY_CHUNK_SIZE (1u << 20)     //1 MB
+
+//copy buffer aligned for O_DIRECT, so io=direct reads and writes it without a bounce buffer
+static char* alloc_copy_buffer(void) {
+    char* buffer = aligned_alloc(DIRECT_IO_ALIGN, COPY_CHUNK_SIZE);
+    if (buffer == NULL) handle_error("Failed to allocate copy buffer");
+    return buffer;
+}
+
+// cat
+void cat_file(Volume* vol, const char* filename, uint32_t cursor){
+    int fd = fs_open(vol, cursor, filename);
+    if (fd < 0) {
+        if (fd == FS_ERR_NOT_FOUND) printf("File to read not found in current directory\n");
+        else printf("Error: %s\n", fs_strerror(fd));
         return;
     }
-    uint32_t entry_block = file_entry->current_block;
-    //find first data block, allocate one if it doesn't exist
-    uint32_t data_block = fat[entry_block];
-    if (data_block == FAT_EOC) {
-        data_block = allocate_block(fat, &info);
-        if (data_block == FAT_EOF) handle_error("No free blocks");
-        fat[entry_block] = data_block;
-        fat[data_block] = FAT_EOC;
-    }
-    //scroll the chain until the last data block
-    uint32_t last_data_block = data_block;
-    while (fat[last_data_block] != FAT_EOC) last_data_block = fat[last_data_block];
-    //compute write offset in block
-    size_t offset = file_entry->size % block_size;
-    size_t to_write = data_len;
-    size_t written = 0;
-    while (to_write > 0) {
-        char buffer[block_size];
-        //if offset > 0, read the block to avoid overwriting existing data
-        if (offset > 0) {
-            int res = read_block(disk_mem, last_data_block, buffer, block_size, disk_size_bytes);
-            if (res != 0) handle_error("Failed to read last data block for append");
-        } else {
-            memset(buffer, 0, block_size);
-        }
-        size_t space = block_size - offset;
-        size_t chunk = (to_write < space) ? to_write : space;
-        memcpy(buffer + offset, data + written, chunk);
-        int res = write_block(disk_mem, last_data_block, buffer, block_size, disk_size_bytes);
-        if (res != 0) handle_error("Failed to write appended block to disk");
-        file_entry->size += chunk;
-        written += chunk;
-        to_write -= chunk;
-        offset = 0;
-        //if there is still data, allocate a new block and continue
-        if (to_write > 0) {
-            uint32_t new_block = allocate_block(fat, &info);
-            if (new_block == FAT_EOF) handle_error("No free blocks for additional data block");
-            fat[last_data_block] = new_block;
-            fat[new_block] = FAT_EOC;
-            last_data_block = new_block;
-        }
+    char* buffer = alloc_copy_buffer();
+    size_t offset = 0;
+    ssize_t n;
+    while ((n = fs_pread(vol, fd, buffer, COPY_CHUNK_SIZE, offset)) > 0) {
+        fwrite(buffer, 1, n, stdout);
+        offset += n;
     }
-    int res = write_entry(disk_mem, file_entry, block_size, disk_size_bytes);
-    if (res != 0) handle_error("Failed to write updated file entry to disk");
-    //update parent directory size
-    Entry* parent_dir = read_directory_from_block(disk_mem, file_entry->parent_block, block_size, disk_size_bytes);
-    if (!parent_dir) handle_error("Failed to read parent directory");
-    parent_dir->size += data_len;
-    res = write_entry(disk_mem, parent_dir, block_size, disk_size_bytes);
-    if (res != 0) handle_error("Failed to update parent directory size");
-    free(parent_dir);
-    res = write_info_and_fat(disk_mem, fat, num_fat_entries, 1, &info, block_size, disk_size_bytes);
-    if (res != 0) handle_error("Failed to update FAT/metainfo after append");
-    free(file_entry);
+    if (n < 0) printf("Error: %s", fs_strerror(n));
+    printf("\n");
+    free(buffer);
+    fs_close(vol, fd);
 }
 
-// cat
-void cat_file(char* disk_mem, const char* filename, uint32_t cursor, size_t block_size, size_t disk_size_bytes){
-    DiskInfo info;
-    uint32_t num_fat_entries = disk_size_bytes / block_size;
-    uint32_t fat[num_fat_entries];
-    read_info_and_fat(disk_mem, &info, fat, disk_size_bytes);
-    Entry* file_entry = NULL;
-    Entry* current_dir = read_directory_from_block(disk_mem, cursor, block_size, disk_size_bytes);
-    if (!current_dir) handle_error("Failed to read current directory");
-    uint32_t* children_blocks = get_children_blocks(current_dir);
-    if (!children_blocks) handle_error("Failed to get children blocks");
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (children_blocks[i] == 0) continue;
-        Entry* child = read_directory_from_block(disk_mem, children_blocks[i], block_size, disk_size_bytes);
-        if (!child) handle_error("Failed to read child directory");
-        if (strcmp(child->name, filename) == 0 && child->type == ENTRY_TYPE_FILE) {
-            file_entry = child;
+//import
+int import_file(Volume* vol, const char* host_path, const char* name, uint32_t cursor){
+    int host_fd = open(host_path, O_RDONLY);
+    if (host_fd == -1) {
+        perror("Error opening host file");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(host_fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        printf("Error: %s is not a regular file\n", host_path);
+        close(host_fd);
+        return -1;
+    }
+    //refuse up front what cannot fit, instead of leaving a truncated copy behind
+    size_t needed = ((size_t)st.st_size + vol->disk.block_size - 1) >> vol->disk.block_shift;
+    if (needed > count_free_blocks(vol)) {
+        printf("Error: not enough free space for %s (%s)\n", host_path, format_size(st.st_size));
+        close(host_fd);
+        return -1;
+    }
+    uint32_t ino;
+    int fd = fs_create(vol, cursor, name, &ino);
+    if (fd == FS_OK) fd = fs_open_ino(vol, ino);
+    if (fd < 0) {
+        printf("Error: %s\n", fs_strerror(fd));
+        close(host_fd);
+        return -1;
+    }
+    char* buffer = alloc_copy_buffer();
+    //every chunk reserves its blocks as one run right after the previous one, so the file stays sequential
+    size_t offset = 0;
+    int res = 0;
+    while (1) {
+        ssize_t n = read(host_fd, buffer, COPY_CHUNK_SIZE);
+        if (n < 0) {
+            perror("Error reading host file");
+            res = -1;
+            break;
+        }
+        if (n == 0) break;
+        ssize_t written = fs_pwrite(vol, fd, buffer, n, offset);
+        if (written != n) {
+            printf("Error: %s after %s\n", fs_strerror(written), format_size(offset));
+            res = -1;
             break;
         }
-        free(child);
+        offset += n;
+        //let write-back flush on its threshold while the copy goes on
+        if (flush_volume(vol) != 0) handle_error("Failed to update FAT/metainfo during import");
     }
-    free(current_dir);
-    if (!file_entry) {
-        printf("File to read not found in current directory\n");
-        return;
+    free(buffer);
+    close(host_fd);
+    if (fs_close(vol, fd) != FS_OK) handle_error("Failed to update FAT/metainfo after import");
+    if (res == 0) printf("Imported %s into %s (%s)\n", host_path, name, format_size(offset));
+    return res;
+}
+
+//export
+int export_file(Volume* vol, const char* name, const char* host_path, uint32_t cursor){
+    int fd = fs_open(vol, cursor, name);
+    if (fd < 0) {
+        if (fd == FS_ERR_NOT_FOUND) printf("File to export not found in current directory\n");
+        else printf("Error: %s\n", fs_strerror(fd));
+        return -1;
+    }
+    int host_fd = open(host_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (host_fd == -1) {
+        perror("Error creating host file");
+        fs_close(vol, fd);
+        return -1;
+    }
+    char* buffer = alloc_copy_buffer();
+    size_t offset = 0;
+    int res = 0;
+    ssize_t n;
+    while ((n = fs_pread(vol, fd, buffer, COPY_CHUNK_SIZE, offset)) > 0) {
+        //write() may stop short, finish the chunk before reading the next one
+        for (ssize_t done = 0; done < n; ) {
+            ssize_t w = write(host_fd, buffer + done, n - done);
+            if (w < 0) {
+                perror("Error writing host file");
+                res = -1;
+                break;
+            }
+            done += w;
+        }
+        if (res != 0) break;
+        offset += n;
     }
-    uint32_t data_block = fat[file_entry->current_block];
-    size_t bytes_left = file_entry->size;
+    if (n < 0) res = -1;
+    free(buffer);
+    if (close(host_fd) != 0) res = -1;
+    fs_close(vol, fd);
+    if (res == 0) printf("Exported %s to %s (%s)\n", name, host_path, format_size(offset));
+    return res;
+}
+
+#define LEGACY_DIR_ENTRIES 32
+
+//entry layout of images written before format versioning: children are bare block numbers
+typedef struct {
+    char name[MAX_NAME_LEN];
+    uint8_t type;
+    uint32_t size;
+    uint32_t dir_blocks[LEGACY_DIR_ENTRIES];
+    uint32_t parent_block;
+    uint32_t current_block;
+} LegacyEntry;
+
+#define LEGACY_BLOCK_SIZE 4096  //images written before versioning always used 4 KB blocks
+
+//read-only mapping of a legacy image
+typedef struct {
+    const char* mem;
+    size_t size;
+    uint32_t num_blocks;
+    const uint32_t* fat;        //legacy FAT, stored right after the metainfo block
+} LegacyDisk;
+
+//borrow a legacy entry, NULL if out of bounds
+static const LegacyEntry* legacy_entry(const LegacyDisk* old, uint32_t block) {
+    if (block == 0 || block >= old->num_blocks) return NULL;
+    return (const LegacyEntry*)(old->mem + (size_t)block * LEGACY_BLOCK_SIZE);
+}
+
+//copy the data chain of a legacy file into a file of the new volume
+static int convert_file_data(Volume* vol, const LegacyDisk* old, const LegacyEntry* file, uint32_t new_ino) {
+    int fd = fs_open_ino(vol, new_ino);
+    if (fd < 0) return -1;
+    uint32_t data_block = old->fat[file->current_block];
+    size_t bytes_left = file->size;
+    size_t offset = 0;
     while (data_block != FAT_EOC && bytes_left > 0) {
-        char buffer[block_size];
-        memset(buffer, 0, block_size);
-        int res = read_block(disk_mem, data_block, buffer, block_size, disk_size_bytes);
-        if (res != 0) handle_error("Failed to read data block");
-        size_t to_print = (bytes_left < block_size) ? bytes_left : block_size;
-        fwrite(buffer, 1, to_print, stdout);
-        bytes_left -= to_print;
-        data_block = fat[data_block];
+        if (data_block >= old->num_blocks) break;
+        size_t chunk = bytes_left < LEGACY_BLOCK_SIZE ? bytes_left : LEGACY_BLOCK_SIZE;
+        if (fs_pwrite(vol, fd, old->mem + (size_t)data_block * LEGACY_BLOCK_SIZE, chunk, offset) < 0) break;
+        offset += chunk;
+        bytes_left -= chunk;
+        data_block = old->fat[data_block];
     }
-    printf("\n");
-    free(file_entry);
-}
\ No newline at end of file
+    if (fs_close(vol, fd) != FS_OK) return -1;
+    return bytes_left == 0 ? 0 : -1;
+}
+
+//recreate every child of a legacy directory inside new_dir
+static int convert_directory(Volume* vol, const LegacyDisk* old, const LegacyEntry* dir, uint32_t new_dir, int depth) {
+    if (depth > (int)old->num_blocks) return -1; //cycle in a damaged image
+    for (int i = 0; i < LEGACY_DIR_ENTRIES; i++) {
+        if (dir->dir_blocks[i] == 0) continue;
+        const LegacyEntry* child = legacy_entry(old, dir->dir_blocks[i]);
+        if (child == NULL) return -1;
+        char name[MAX_NAME_LEN];
+        snprintf(name, sizeof(name), "%.*s", MAX_NAME_LEN - 1, child->name);
+        uint32_t ino;
+        if (child->type == ENTRY_TYPE_DIR) {
+            if (fs_mkdir(vol, new_dir, name, &ino) != FS_OK) return -1;
+            if (convert_directory(vol, old, child, ino, depth + 1) != 0) return -1;
+        } else {
+            if (fs_create(vol, new_dir, name, &ino) != FS_OK) return -1;
+            if (convert_file_data(vol, old, child, ino) != 0) return -1;
+        }
+    }
+    return 0;
+}
+
+//print one problem found by fsck
+static void print_problem(const char* msg, void* arg) {
+    (void)arg;
+    printf("  %s\n", msg);
+}
+
+//fsck: check the mounted disk and print what is wrong, repairing it if asked
+int check_disk(Volume* vol, bool repair) {
+    FsckOptions opts = {0, repair, print_problem, NULL};
+    FsckReport report;
+    int res = fs_check(vol, &opts, &report);
+    if (res == FS_ERR_IO) handle_error("Failed to flush the disk before checking it");
+    printf("%u directories, %u files, %u blocks in use\n", report.dirs, report.files, report.used_blocks);
+    if (res != FS_OK && res != FS_ERR_CORRUPT) {
+        printf("Error: %s\n", fs_strerror(res));
+        return res;
+    }
+    uint32_t problems = fsck_problems(&report);
+    if (problems == 0) {
+        printf("Disk is clean\n");
+        return 0;
+    }
+    printf("%u problems: %u bad chains, %u cross-links, %u bad dirents, %u orphan blocks, %u orphan inodes, %u bad counters\n",
+           problems, report.bad_chains, report.cross_links, report.bad_dirents, report.orphan_blocks, report.orphan_inodes, report.bad_counts);
+    if (repair) printf("%u repaired, %u left\n", report.repaired, report.unrepaired);
+    else printf("Run 'fsck repair' to fix them\n");
+    return res;
+}
+
+//convert an image written before format versioning into a new image with the current format
+int convert_disk(const char* legacy_filename, const char* new_filename, const MountOptions* opts) {
+    if (access(new_filename, F_OK) == 0) {
+        printf("Error: %s already exists\n", new_filename);
+        return -1;
+    }
+    int fd = open(legacy_filename, O_RDONLY);
+    if (fd == -1) {
+        perror("Error opening legacy disk");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < LEGACY_BLOCK_SIZE) {
+        printf("Error: %s is not a disk image\n", legacy_filename);
+        close(fd);
+        return -1;
+    }
+    LegacyDisk old;
+    old.size = st.st_size;
+    old.num_blocks = old.size / LEGACY_BLOCK_SIZE;
+    old.mem = mmap(NULL, old.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (old.mem == MAP_FAILED) {
+        perror("Error mapping legacy disk");
+        return -1;
+    }
+    old.fat = (const uint32_t*)(old.mem + LEGACY_BLOCK_SIZE);
+    int res = -1;
+    DiskInfo info;
+    memcpy(&info, old.mem, sizeof(DiskInfo));
+    uint32_t root_block = calc_reserved_blocks(old.size, LEGACY_BLOCK_SIZE);
+    const LegacyEntry* old_root = legacy_entry(&old, root_block);
+    if (info.magic == FS_MAGIC) {
+        printf("Error: %s is already versioned (format %u)\n", legacy_filename, info.version);
+    } else if (info.block_size != LEGACY_BLOCK_SIZE || info.disk_size != old.size || old_root == NULL || old_root->type != ENTRY_TYPE_DIR) {
+        printf("Error: %s is not a recognized disk image\n", legacy_filename);
+    } else {
+        Volume vol = {0};
+        int err = fs_format(&vol, new_filename, old.size, opts);
+        if (err == FS_OK) {
+            res = convert_directory(&vol, &old, old_root, ROOT_INO, 0);
+            if (res != 0) printf("Error: conversion failed, %s is incomplete\n", new_filename);
+            if (fs_unmount(&vol) != FS_OK) res = -1;
+        } else {
+            printf("Error: %s: %s\n", new_filename, fs_strerror(err));
+        }
+    }
+    munmap((void*)old.mem, old.size);
+    return res;
+}
@@ -1,33 +1,43 @@
 #pragma once
 
-#include "../fs/fat.h"
-#include "../fs/disk.h"
-#include "../fs/entry.h"
+#include "../fs/fs.h"
 #include "../utils/utils.h"
 
 //format
-char* format_disk(const char *filename, size_t size);
+int format_disk(Volume* vol, const char *filename, size_t size, const MountOptions* opts);
 
 //mkdir
-void create_directory(char* disk_mem, const char *name, uint32_t parent_block, size_t disk_size_bytes);
+void create_directory(Volume* vol, const char *name, uint32_t parent_ino);
 
 //rmdir
-void remove_directory(char* disk_mem, const char *name, uint32_t parent_block, size_t disk_size_bytes);
+void remove_directory(Volume* vol, const char *name, uint32_t parent_ino);
 
 //ls
-void list_directory_contents();
+void list_directory_contents(Volume* vol, uint32_t cursor);
 
 //cd
-uint32_t change_directory(const char *path, uint32_t cursor, char* disk_mem, size_t disk_size_bytes);
+uint32_t change_directory(Volume* vol, const char *path, uint32_t cursor);
 
 //touch
-void create_file(char* disk_mem, const char* name, uint32_t parent_block, size_t disk_size_bytes);
+void create_file(Volume* vol, const char* name, uint32_t parent_ino);
 
 //rm
-void remove_file(char* disk_mem, const char *name, uint32_t parent_block, size_t disk_size_bytes);
+void remove_file(Volume* vol, const char *name, uint32_t parent_ino);
 
 //append
-void append_to_file(char* disk_mem, char* data, size_t data_len, char* filename, uint32_t cursor, size_t block_size, size_t disk_size_bytes);
+void append_to_file(Volume* vol, const char* data, size_t data_len, const char* filename, uint32_t cursor);
 
 //cat
-void cat_file(char* disk_mem, const char* filename, uint32_t cursor, size_t block_size, size_t disk_size_bytes);
\ No newline at end of file
+void cat_file(Volume* vol, const char* filename, uint32_t cursor);
+
+//import: copy a host file into a new file of the current directory
+int import_file(Volume* vol, const char* host_path, const char* name, uint32_t cursor);
+
+//export: copy a file of the current directory to a host file
+int export_file(Volume* vol, const char* name, const char* host_path, uint32_t cursor);
+
+//fsck: check the mounted disk and print what is wrong, repairing it if asked
+int check_disk(Volume* vol, bool repair);
+
+//convert an image written before format versioning into a new image with the current format
+int convert_disk(const char* legacy_filename, const char* new_filename, const MountOptions* opts);
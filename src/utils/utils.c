@@ -18,4 +18,20 @@ const char* format_size(size_t bytes) {
     else
         snprintf(buf, sizeof(buf), "%.2f GB", bytes / (1024.0 * 1024.0 * 1024.0));
     return buf;
+}
+
+// Parse a size such as "512", "2G" or "300g": a number of units, or of K/M/G/T when suffixed; 0 if invalid
+size_t parse_size(const char* str, size_t unit) {
+    char* end;
+    errno = 0;
+    unsigned long long n = strtoull(str, &end, 10);
+    if (end == str || errno != 0 || str[0] == '-') return 0;
+    switch (*end) {
+        case 'k': case 'K': unit = 1ull << 10; end++; break;
+        case 'm': case 'M': unit = 1ull << 20; end++; break;
+        case 'g': case 'G': unit = 1ull << 30; end++; break;
+        case 't': case 'T': unit = 1ull << 40; end++; break;
+    }
+    if (*end != '\0' || n > SIZE_MAX / unit) return 0;
+    return n * unit;
 }
\ No newline at end of file
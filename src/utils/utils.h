@@ -1,5 +1,6 @@
 #pragma once
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,12 +11,18 @@
 #include <sys/mman.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
 
 #define DEBUG 0
 #define ENTRIES_TO_PRINT 10
 
 //error handling function
-void handle_error(const char* msg);
+__attribute__((noreturn)) void handle_error(const char* msg);
 
 // Format size in bytes as KB/MB/GB string
-const char* format_size(size_t bytes);
\ No newline at end of file
+const char* format_size(size_t bytes);
+
+// Parse a size such as "512", "2G" or "300g": a number of units, or of K/M/G/T when suffixed; 0 if invalid
+size_t parse_size(const char* str, size_t unit);
\ No newline at end of file